@@ -4,6 +4,7 @@
 #include <QDebug>
 #include "../src/Audio/AVPP.hpp"
 #include "../src/Audio/PlaybackBuffer.hpp"
+#include "../src/SpectralBands.hpp"
 #include "../src/Utils.hpp"
 
 
@@ -131,27 +132,24 @@ void processFile(const QString & aFileName, const Options & aOptions)
 	auto maxNumSamples = numSamples - aOptions.mWindowSize - aOptions.mStride;
 	vector<float> res;
 	res.reserve(maxNumSamples);
-	vector<float> rateFactor;
+	vector<double> bandFrequencies;
 	for (size_t k = 0; k < 10; ++k)
 	{
 		auto freq = aOptions.mExtractFrequency * (80 + 2 * k) / 100;
-		rateFactor.push_back(static_cast<float>(2 * M_PI) / aOptions.mSampleRate * freq);
+		bandFrequencies.push_back(SpectralBands::radiansPerSample(freq, aOptions.mSampleRate));
 	}
+	SpectralBands bands(bandFrequencies);
+	vector<complex<double>> coeffs(bands.numBands());
 	for (size_t i = 0; i < maxNumSamples; i += aOptions.mStride)
 	{
-		float freqStrength = 0;
-		for (size_t j = 0; j < aOptions.mWindowSize; ++j)
+		bands.correlate(audio + i, aOptions.mWindowSize, i, coeffs.data());
+		double freqStrength = 0;
+		for (const auto & c: coeffs)
 		{
-			auto sample = audio[i + j] / 32768.0f;
-			for (const auto rf: rateFactor)
-			{
-				auto cosval = cosf(rf * (i + j));
-				auto sinval = sinf(rf * (i + j));
-				freqStrength += sample * cosval + sample * sinval;
-			}
+			freqStrength += (c.real() + c.imag()) / 32768;
 		}
-		res.push_back(abs(freqStrength));
-		// res.push_back(freqStrength);
+		res.push_back(static_cast<float>(abs(freqStrength)));
+		// res.push_back(static_cast<float>(freqStrength));
 	}
 
 	outputDebugFile(res, buf, aOptions);
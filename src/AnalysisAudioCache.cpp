@@ -0,0 +1,348 @@
+#include "AnalysisAudioCache.hpp"
+#include <algorithm>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+
+
+
+
+
+/** The header stored at the start of each cache entry file, followed by the raw samples.
+Stored in the native byte order; an entry written on a machine with different endianness fails the magic check
+and is treated as invalid. */
+struct FileHeader
+{
+	/** Identifies the file format and its version. */
+	UInt32 mMagic;
+
+	/** The samplerate of the stored samples. */
+	Int32 mSampleRate;
+
+	/** The time when the entry was last stored or loaded, in msec since the epoch. */
+	Int64 mLastUsed;
+
+	/** The number of 16-bit samples following the header. */
+	Int64 mNumSamples;
+};
+
+static_assert(sizeof(FileHeader) == 24, "The FileHeader needs to have no padding");
+
+/** The value of FileHeader::mMagic for the current format version ("AAC1"). */
+static const UInt32 FILE_MAGIC = 0x31434141;
+
+/** The extension used for the cache entry files. */
+static const QString FILE_EXTENSION = QStringLiteral(".pcm");
+
+
+
+
+
+/** Reads and validates the header of the specified opened entry file.
+Returns true if the header is valid and matches the file size, false otherwise. */
+static bool readHeader(QFile & aFile, FileHeader & aOutHeader)
+{
+	if (aFile.read(reinterpret_cast<char *>(&aOutHeader), sizeof(aOutHeader)) != sizeof(aOutHeader))
+	{
+		return false;
+	}
+	if ((aOutHeader.mMagic != FILE_MAGIC) || (aOutHeader.mNumSamples < 0))
+	{
+		return false;
+	}
+	return (aFile.size() == static_cast<qint64>(sizeof(aOutHeader)) + aOutHeader.mNumSamples * static_cast<qint64>(sizeof(Int16)));
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AnalysisAudioCache:
+
+AnalysisAudioCache::AnalysisAudioCache():
+	mMaxSize(0),
+	mTotalSize(0)
+{
+}
+
+
+
+
+
+void AnalysisAudioCache::setFolder(const QString & aFolder, qint64 aMaxSize)
+{
+	std::unique_lock<std::mutex> lock(mMtx);
+	mFolder.clear();
+	mEntries.clear();
+	mTotalSize = 0;
+	mMaxSize = aMaxSize;
+	QDir dir(aFolder);
+	if (!dir.mkpath("."))
+	{
+		qWarning() << "Cannot create the analysis audio cache folder " << aFolder << ", the cache is disabled.";
+		return;
+	}
+	mFolder = dir.absolutePath() + "/";
+
+	// Index the existing entries, remove the invalid ones:
+	auto files = dir.entryInfoList({"*" + FILE_EXTENSION}, QDir::Files);
+	for (const auto & fi: files)
+	{
+		QFile f(fi.absoluteFilePath());
+		FileHeader header;
+		if (!f.open(QIODevice::ReadOnly) || !readHeader(f, header))
+		{
+			f.close();
+			qDebug() << "Removing invalid analysis audio cache entry " << fi.fileName();
+			QFile::remove(fi.absoluteFilePath());
+			continue;
+		}
+		mEntries[fi.fileName()] = {fi.size(), header.mLastUsed, false};
+		mTotalSize += fi.size();
+	}
+	for (const auto & evicted: evict(0))
+	{
+		QFile::remove(mFolder + evicted);
+	}
+	qDebug() << "Analysis audio cache: " << mEntries.size() << " entries, " << mTotalSize << " bytes";
+}
+
+
+
+
+
+bool AnalysisAudioCache::isEnabled()
+{
+	std::unique_lock<std::mutex> lock(mMtx);
+	return !mFolder.isEmpty();
+}
+
+
+
+
+
+bool AnalysisAudioCache::load(const QByteArray & aHash, int aSampleRate, std::vector<Int16> & aOutSamples)
+{
+	// Look the entry up and mark it used, under the lock; the file itself is read without the lock:
+	auto fileName = entryFileName(aHash, aSampleRate);
+	auto now = QDateTime::currentMSecsSinceEpoch();
+	QString folder;
+	{
+		std::unique_lock<std::mutex> lock(mMtx);
+		if (mFolder.isEmpty() || aHash.isEmpty())
+		{
+			return false;
+		}
+		auto itr = mEntries.find(fileName);
+		if ((itr == mEntries.end()) || itr->second.mIsBeingWritten)
+		{
+			return false;
+		}
+		itr->second.mLastUsed = now;
+		folder = mFolder;
+	}
+
+	// Read the samples:
+	QFile f(folder + fileName);
+	FileHeader header;
+	if (
+		!f.open(QIODevice::ReadWrite) ||
+		!readHeader(f, header) ||
+		(header.mSampleRate != aSampleRate)
+	)
+	{
+		f.close();
+		qDebug() << "Analysis audio cache entry " << fileName << " is invalid, removing";
+		removeInvalidEntry(folder, fileName);
+		return false;
+	}
+	aOutSamples.resize(static_cast<size_t>(header.mNumSamples));
+	auto numBytes = static_cast<qint64>(aOutSamples.size() * sizeof(Int16));
+	if (f.read(reinterpret_cast<char *>(aOutSamples.data()), numBytes) != numBytes)
+	{
+		f.close();
+		aOutSamples.clear();
+		qDebug() << "Cannot read analysis audio cache entry " << fileName << ", removing";
+		removeInvalidEntry(folder, fileName);
+		return false;
+	}
+
+	// Update the last-used timestamp in the file, so that the LRU order survives restarts:
+	header.mLastUsed = now;
+	if (!f.seek(0) || (f.write(reinterpret_cast<const char *>(&header), sizeof(header)) != sizeof(header)))
+	{
+		qDebug() << "Cannot update the last-used timestamp of analysis audio cache entry " << fileName;
+	}
+	return true;
+}
+
+
+
+
+
+void AnalysisAudioCache::store(const QByteArray & aHash, int aSampleRate, const std::vector<Int16> & aSamples)
+{
+	// Reserve the space for the entry and pick the entries to evict, under the lock;
+	// the files are written and removed without the lock:
+	auto fileName = entryFileName(aHash, aSampleRate);
+	auto numBytes = static_cast<qint64>(aSamples.size() * sizeof(Int16));
+	auto size = static_cast<qint64>(sizeof(FileHeader)) + numBytes;
+	auto now = QDateTime::currentMSecsSinceEpoch();
+	QString folder;
+	QStringList evictedFiles;
+	{
+		std::unique_lock<std::mutex> lock(mMtx);
+		if (mFolder.isEmpty() || aHash.isEmpty())
+		{
+			return;
+		}
+		if (size > mMaxSize)
+		{
+			// Wouldn't fit even into an empty cache
+			return;
+		}
+		auto itr = mEntries.find(fileName);
+		if (itr != mEntries.end())
+		{
+			if (itr->second.mIsBeingWritten)
+			{
+				// Another thread is storing the same audio right now
+				return;
+			}
+			removeEntry(fileName);
+		}
+		evictedFiles = evict(size);
+		mEntries[fileName] = {size, now, true};
+		mTotalSize += size;
+		folder = mFolder;
+	}
+	for (const auto & evicted: evictedFiles)
+	{
+		QFile::remove(folder + evicted);
+	}
+
+	// Write the file, atomically:
+	FileHeader header;
+	header.mMagic = FILE_MAGIC;
+	header.mSampleRate = aSampleRate;
+	header.mLastUsed = now;
+	header.mNumSamples = static_cast<Int64>(aSamples.size());
+	QSaveFile f(folder + fileName);
+	auto isSuccess = (
+		f.open(QIODevice::WriteOnly) &&
+		(f.write(reinterpret_cast<const char *>(&header), sizeof(header)) == sizeof(header)) &&
+		(f.write(reinterpret_cast<const char *>(aSamples.data()), numBytes) == numBytes) &&
+		f.commit()
+	);
+	if (!isSuccess)
+	{
+		qWarning() << "Cannot write analysis audio cache entry " << fileName << ": " << f.errorString();
+	}
+
+	// Finish the reservation:
+	std::unique_lock<std::mutex> lock(mMtx);
+	if (folder != mFolder)
+	{
+		// The cache has been re-set meanwhile, the reservation is gone
+		return;
+	}
+	auto itr = mEntries.find(fileName);
+	if (itr == mEntries.end())
+	{
+		return;
+	}
+	if (isSuccess)
+	{
+		itr->second.mIsBeingWritten = false;
+	}
+	else
+	{
+		removeEntry(fileName);
+	}
+}
+
+
+
+
+
+QString AnalysisAudioCache::entryFileName(const QByteArray & aHash, int aSampleRate)
+{
+	return QString::fromLatin1(aHash.toHex()) + "-" + QString::number(aSampleRate) + FILE_EXTENSION;
+}
+
+
+
+
+
+QStringList AnalysisAudioCache::evict(qint64 aExtraSize)
+{
+	QStringList res;
+	if (mTotalSize + aExtraSize <= mMaxSize)
+	{
+		return res;
+	}
+
+	// Sort the entries by their last use, remove from the oldest until the size fits:
+	// (The entries being written are in use, they cannot be evicted)
+	std::vector<std::pair<qint64, QString>> lru;
+	lru.reserve(mEntries.size());
+	for (const auto & entry: mEntries)
+	{
+		if (!entry.second.mIsBeingWritten)
+		{
+			lru.emplace_back(entry.second.mLastUsed, entry.first);
+		}
+	}
+	std::sort(lru.begin(), lru.end());
+	for (const auto & item: lru)
+	{
+		if (mTotalSize + aExtraSize <= mMaxSize)
+		{
+			break;
+		}
+		removeEntry(item.second);
+		res.append(item.second);
+	}
+	return res;
+}
+
+
+
+
+
+void AnalysisAudioCache::removeEntry(const QString & aFileName)
+{
+	auto itr = mEntries.find(aFileName);
+	if (itr != mEntries.end())
+	{
+		mTotalSize -= itr->second.mSize;
+		mEntries.erase(itr);
+	}
+}
+
+
+
+
+
+void AnalysisAudioCache::removeInvalidEntry(const QString & aFolder, const QString & aFileName)
+{
+	{
+		std::unique_lock<std::mutex> lock(mMtx);
+		if (aFolder != mFolder)
+		{
+			// The cache has been re-set meanwhile
+			return;
+		}
+		auto itr = mEntries.find(aFileName);
+		if ((itr == mEntries.end()) || itr->second.mIsBeingWritten)
+		{
+			// Already removed, or being replaced by a new write
+			return;
+		}
+		removeEntry(aFileName);
+	}
+	QFile::remove(aFolder + aFileName);
+}
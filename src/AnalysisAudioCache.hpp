@@ -0,0 +1,98 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include "TempoDetector.hpp"
+
+
+
+
+
+/** An on-disk cache of the decoded and resampled audio used for tempo detection, keyed by the song hash.
+Re-detecting a song with different options can then skip decoding the file altogether.
+Each cache entry is a single file in the cache folder, containing a small header and the raw 16-bit mono samples.
+The total size of the cache is capped; when storing a new entry would exceed the cap, the least recently used
+entries are evicted. The last-used timestamp is kept in each entry's header, so that the LRU order survives restarts.
+The cache is disabled until setFolder() is called.
+Thread-safe, the tempo detection and the ingest run in multiple BackgroundTasks at once. The lock guards only
+the index of the entries; the entry files are read and written outside of it, so that the tasks don't serialize
+on the disk I/O. */
+class AnalysisAudioCache
+{
+public:
+
+	AnalysisAudioCache();
+
+	/** Enables the cache, stored in the specified folder, with the specified max total size (in bytes).
+	Indexes the entries already present in the folder, and evicts the oldest ones if they are over the size cap. */
+	void setFolder(const QString & aFolder, qint64 aMaxSize);
+
+	/** Returns true if the cache is enabled (setFolder() has succeeded). */
+	bool isEnabled();
+
+	/** Loads the audio stored for the specified song hash and samplerate into aOutSamples.
+	Returns true on success, false if there's no such entry (or the cache is disabled). */
+	bool load(const QByteArray & aHash, int aSampleRate, std::vector<Int16> & aOutSamples);
+
+	/** Stores the audio for the specified song hash and samplerate, replacing any previous entry.
+	Evicts the least recently used entries to keep the cache within the size cap.
+	Ignored if the cache is disabled or the hash is empty. */
+	void store(const QByteArray & aHash, int aSampleRate, const std::vector<Int16> & aSamples);
+
+
+protected:
+
+	/** Information about a single entry stored in the cache folder. */
+	struct Entry
+	{
+		/** The size of the file, in bytes. */
+		qint64 mSize;
+
+		/** The time when the entry was last stored or loaded, in msec since the epoch. */
+		qint64 mLastUsed;
+
+		/** True while the entry's file is being written by store().
+		Such an entry cannot be loaded nor evicted yet, its size is only reserved. */
+		bool mIsBeingWritten;
+	};
+
+
+	/** The mutex protecting all the member variables against multithreaded access.
+	Not held while reading or writing the entry files. */
+	std::mutex mMtx;
+
+	/** The folder where the entries are stored, including the trailing slash.
+	Empty if the cache is disabled. */
+	QString mFolder;
+
+	/** The max total size of all entries, in bytes. */
+	qint64 mMaxSize;
+
+	/** All the entries currently in the cache, map of FileName (without the folder) -> Entry. */
+	std::map<QString, Entry> mEntries;
+
+	/** The total size of all the entries in mEntries, in bytes. */
+	qint64 mTotalSize;
+
+
+	/** Returns the filename (without the folder) of the entry for the specified song hash and samplerate. */
+	static QString entryFileName(const QByteArray & aHash, int aSampleRate);
+
+	/** Removes the least recently used entries from mEntries until the total size, plus aExtraSize, fits in the size cap.
+	Returns the filenames of the removed entries, the caller is responsible for removing the files from the disk
+	(preferably after unlocking mMtx).
+	Expects mMtx to be locked by the caller. */
+	QStringList evict(qint64 aExtraSize);
+
+	/** Removes the specified entry from mEntries, doesn't touch the disk.
+	Expects mMtx to be locked by the caller. */
+	void removeEntry(const QString & aFileName);
+
+	/** Removes the entry that failed to load, both from mEntries and from the disk.
+	Locks mMtx; does nothing if the cache folder has changed or the entry is being rewritten meanwhile. */
+	void removeInvalidEntry(const QString & aFolder, const QString & aFileName);
+};
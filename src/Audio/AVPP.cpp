@@ -1,5 +1,14 @@
 #include "AVPP.hpp"
 #include <cassert>
+#include <limits>
+#include <QBuffer>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QStorageInfo>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
 #include "../Exception.hpp"
 
 extern "C"
@@ -59,18 +68,63 @@ public:
 ////////////////////////////////////////////////////////////////////////////////
 // FileIO:
 
-std::shared_ptr<FileIO> FileIO::createContext(const QString & aFileName)
+std::shared_ptr<FileIO> FileIO::createContext(const QString & aFileName, bool aShouldMapFile)
 {
-	Initializer::init();
-	auto res = std::shared_ptr<FileIO>(new FileIO);
-	if (res == nullptr)
+	std::unique_ptr<QFile> f(new QFile(aFileName));
+	if (!f->open(QIODevice::ReadOnly))
+	{
+		return nullptr;
+	}
+	if (!aShouldMapFile)
+	{
+		return createContext(std::move(f));
+	}
+
+	// Serve the reads straight from the file mapping, if possible, it saves a syscall and a copy per read:
+	auto data = mapFile(*f, true);
+	if (!data.isEmpty())
+	{
+		auto res = createContext(data);
+		if (res != nullptr)
+		{
+			res->mMappedFile = std::move(f);
+			return res;
+		}
+	}
+
+	// Cannot map, read through the file:
+	return createContext(std::move(f));
+}
+
+
+
+
+
+std::shared_ptr<FileIO> FileIO::createContext(const QByteArray & aData)
+{
+	auto buf = new QBuffer;
+	std::unique_ptr<QIODevice> dev(buf);
+	buf->setData(aData);  // Implicitly shared, no copy
+	if (!buf->open(QIODevice::ReadOnly))
 	{
 		return nullptr;
 	}
-	if (!res->Open(aFileName))
+	return createContext(std::move(dev));
+}
+
+
+
+
+
+std::shared_ptr<FileIO> FileIO::createContext(std::unique_ptr<QIODevice> && aDevice)
+{
+	Initializer::init();
+	auto res = std::shared_ptr<FileIO>(new FileIO);
+	if (res == nullptr)
 	{
 		return nullptr;
 	}
+	res->mDevice = std::move(aDevice);
 	static const int bufferSize = 4096;
 	auto buffer = reinterpret_cast<unsigned char *>(av_malloc(bufferSize));
 	res->mContext = avio_alloc_context(buffer, bufferSize, 0, res.get(), &FileIO::read, nullptr, &FileIO::seek);
@@ -86,37 +140,79 @@ std::shared_ptr<FileIO> FileIO::createContext(const QString & aFileName)
 
 
 
-FileIO::FileIO():
-	mContext(nullptr)
+QByteArray FileIO::mapFile(QFile & aFile, bool aIsSequentialAccess)
 {
+	auto size = aFile.size();
+	if (
+		(size <= 0) ||
+		(size > std::numeric_limits<int>::max()) ||  // QByteArray cannot hold the data
+		!isMappingSafe(aFile.fileName())
+	)
+	{
+		return QByteArray();
+	}
+	auto data = aFile.map(0, size);
+	if (data == nullptr)
+	{
+		return QByteArray();
+	}
+	#ifndef _WIN32
+		if (aIsSequentialAccess)
+		{
+			// Let the kernel read ahead aggressively and free the pages soon after they are read:
+			posix_madvise(data, static_cast<size_t>(size), POSIX_MADV_SEQUENTIAL);
+		}
+	#else
+		Q_UNUSED(aIsSequentialAccess);
+	#endif
+	return QByteArray::fromRawData(reinterpret_cast<const char *>(data), static_cast<int>(size));
 }
 
 
 
 
 
-FileIO::~FileIO()
+bool FileIO::isMappingSafe(const QString & aFileName)
 {
-	if (mContext != nullptr)
+	static const QList<QByteArray> networkFileSystems =
 	{
-		avio_context_free(&mContext);
+		"nfs", "nfs4", "cifs", "smb", "smb2", "smbfs", "afpfs", "webdav", "davfs", "9p", "fuse.sshfs",
+	};
+
+	// Constructing a QStorageInfo re-reads the whole mount table, so cache the result per folder:
+	static QMutex mtx;
+	static QHash<QString, bool> safeFolders;
+	auto folder = QFileInfo(aFileName).absolutePath();
+	QMutexLocker lock(&mtx);
+	auto itr = safeFolders.constFind(folder);
+	if (itr != safeFolders.constEnd())
+	{
+		return itr.value();
 	}
+	auto isSafe = !networkFileSystems.contains(QStorageInfo(folder).fileSystemType().toLower());
+	safeFolders.insert(folder, isSafe);
+	return isSafe;
 }
 
 
 
 
 
-bool FileIO::Open(const QString & aFileName)
+FileIO::FileIO():
+	mContext(nullptr)
 {
-	std::unique_ptr<QFile> f(new QFile(aFileName));
-	if (!f->open(QIODevice::ReadOnly))
+}
+
+
+
+
+
+FileIO::~FileIO()
+{
+	if (mContext != nullptr)
 	{
-		return false;
+		avio_context_free(&mContext);
 	}
-
-	std::swap(mFile, f);
-	return true;
 }
 
 
@@ -126,7 +222,7 @@ bool FileIO::Open(const QString & aFileName)
 int FileIO::read(void * aThis, uint8_t * aDst, int aSize)
 {
 	auto This = reinterpret_cast<FileIO *>(aThis);
-	return static_cast<int>(This->mFile->read(reinterpret_cast<char *>(aDst), aSize));
+	return static_cast<int>(This->mDevice->read(reinterpret_cast<char *>(aDst), aSize));
 }
 
 
@@ -141,16 +237,16 @@ int64_t FileIO::seek(void * aThis, int64_t aOffset, int aWhence)
 	{
 		case SEEK_CUR:
 		{
-			if (!This->mFile->seek(This->mFile->pos() + aOffset))
+			if (!This->mDevice->seek(This->mDevice->pos() + aOffset))
 			{
 				qWarning() << "Relative-Seek failed.";
 				return -1;
 			}
-			return This->mFile->pos();
+			return This->mDevice->pos();
 		}
 		case SEEK_SET:
 		{
-			if (!This->mFile->seek(aOffset))
+			if (!This->mDevice->seek(aOffset))
 			{
 				qWarning() << "Absolute-Seek failed.";
 				return -1;
@@ -159,12 +255,12 @@ int64_t FileIO::seek(void * aThis, int64_t aOffset, int aWhence)
 		}
 		case SEEK_END:
 		{
-			if (!This->mFile->seek(This->mFile->size() - aOffset))
+			if (!This->mDevice->seek(This->mDevice->size() - aOffset))
 			{
 				qWarning() << "End-Seek failed.";
 				return -1;
 			}
-			return This->mFile->pos();
+			return This->mDevice->pos();
 		}
 	}
 	// _X 2018-05-11: This seems to happen way too often upon opening a new file, disabling.
@@ -472,20 +568,69 @@ std::pair<uint8_t *, size_t> Resampler::convert(const uint8_t ** aBuffers, int a
 ////////////////////////////////////////////////////////////////////////////////
 // Format:
 
-FormatPtr Format::createContext(const QString & aFileName)
+FormatPtr Format::createContext(const QString & aFileName, bool aShouldMapFile)
 {
 	Initializer::init();
 
 	// Create an IO wrapper:
-	auto io = FileIO::createContext(aFileName);
+	auto io = FileIO::createContext(aFileName, aShouldMapFile);
+	if (io == nullptr)
+	{
+		qWarning() << "IO creation failed (" << aFileName << ")";
+		return nullptr;
+	}
+	return createContext(io, aFileName);
+}
+
+
+
+
+
+FormatPtr Format::createContext(const QByteArray & aData, const QString & aFileName)
+{
+	Initializer::init();
+
+	// Create an IO wrapper:
+	auto io = FileIO::createContext(aData);
+	if (io == nullptr)
+	{
+		qWarning() << "IO creation failed (" << aFileName << ")";
+		return nullptr;
+	}
+	return createContext(io, aFileName);
+}
+
+
+
+
+
+FormatPtr Format::createContext(std::unique_ptr<QIODevice> && aDevice, const QString & aFileName)
+{
+	Initializer::init();
+
+	// Create an IO wrapper:
+	if (!aDevice->seek(0))
+	{
+		qWarning() << "Cannot seek to the start of the data (" << aFileName << ")";
+		return nullptr;
+	}
+	auto io = FileIO::createContext(std::move(aDevice));
 	if (io == nullptr)
 	{
 		qWarning() << "IO creation failed (" << aFileName << ")";
 		return nullptr;
 	}
+	return createContext(io, aFileName);
+}
+
+
 
+
+
+FormatPtr Format::createContext(std::shared_ptr<FileIO> aIO, const QString & aFileName)
+{
 	// Create the context:
-	auto res = std::unique_ptr<Format>(new Format(io));
+	auto res = std::unique_ptr<Format>(new Format(aIO));
 	if ((res == nullptr) || (res->mContext == nullptr))
 	{
 		qWarning() << "Creation failed (" << aFileName << ")";
@@ -642,6 +787,62 @@ bool Format::feedRawAudioDataTo(
 
 
 
+void Format::decodeAndFeedRawAudioDataTo(
+	std::function<void (const void * /* aData */, int /* aSize */)> aFunction,
+	double & aLengthSec
+)
+{
+	assert(mAudioOutput != nullptr);
+	assert(mAudioDecoderContext != nullptr);
+
+	AVPacket packet;
+	AVFrame * frame = av_frame_alloc();
+	bool isDecoding = true;
+	mShouldTerminate = false;
+	qint64 maxPts = 0;
+	while (true)
+	{
+		auto ret = av_read_frame(mContext, &packet);
+		if (ret < 0)
+		{
+			break;
+		}
+
+		if (packet.stream_index == mAudioStreamIdx)
+		{
+			if (packet.size >= 0)
+			{
+				aFunction(packet.data, packet.size);
+			}
+			else
+			{
+				qDebug() << "Negative packet size.";
+			}
+			if (isDecoding)
+			{
+				// Once decoding fails, keep reading the input for the raw data only:
+				isDecoding = decodeAudioPacket(&packet, frame);
+			}
+		}
+		if (packet.pts != AV_NOPTS_VALUE)
+		{
+			maxPts = std::max<qint64>(maxPts, packet.pts);
+		}
+		av_packet_unref(&packet);
+	}
+	av_frame_free(&frame);
+	if (maxPts > 0)
+	{
+		auto stream = mContext->streams[mAudioStreamIdx];
+		aLengthSec = static_cast<double>(maxPts) * stream->time_base.num / stream->time_base.den;
+	}
+	qDebug() << "Decoding and feeding done.";
+}
+
+
+
+
+
 void Format::decode()
 {
 	assert(mAudioOutput != nullptr);
@@ -657,36 +858,23 @@ void Format::decode()
 		{
 			// Normal condition on EOF
 			// qWarning() << "Failed to read frame: " << ret;
+			av_frame_free(&frame);
 			return;
 		}
 
 		if (packet.stream_index == mAudioStreamIdx)
 		{
-			ret = avcodec_send_packet(mAudioDecoderContext->mContext, &packet);
-			if (ret < 0)
-			{
-				qWarning() << "Error while sending a packet to the decoder: " << ret;
-				// return;
-			}
-
-			while (ret >= 0)
+			if (!decodeAudioPacket(&packet, frame) && !mShouldTerminate)
 			{
-				ret = avcodec_receive_frame(mAudioDecoderContext->mContext, frame);
-				if ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF))
-				{
-					// Need more data / explicit EOF found
-					break;
-				}
-				else if (ret < 0)
-				{
-					qWarning() << "Error while receiving a frame from the decoder: " << ret;
-					return;
-				}
-				outputAudioData(frame);
+				// Decoder error
+				av_packet_unref(&packet);
+				av_frame_free(&frame);
+				return;
 			}
 		}
 		av_packet_unref(&packet);
 	}
+	av_frame_free(&frame);
 	qDebug() << "Decoding done.";
 }
 
@@ -694,6 +882,29 @@ void Format::decode()
 
 
 
+bool Format::seekTo(double aSeconds)
+{
+	assert(mAudioStreamIdx >= 0);
+	assert(mAudioDecoderContext != nullptr);
+
+	auto stream = mContext->streams[mAudioStreamIdx];
+	auto timestamp = static_cast<int64_t>(aSeconds * stream->time_base.den / stream->time_base.num);
+	auto ret = av_seek_frame(mContext, mAudioStreamIdx, timestamp, AVSEEK_FLAG_BACKWARD);
+	if (ret < 0)
+	{
+		qWarning() << "Failed to seek to " << aSeconds << " s: " << ret;
+		return false;
+	}
+
+	// Drop any data buffered in the decoder from before the seek:
+	avcodec_flush_buffers(mAudioDecoderContext->mContext);
+	return true;
+}
+
+
+
+
+
 std::shared_ptr<PlaybackBuffer> Format::decodeEntireAudio(const QAudioFormat & aFormat)
 {
 	auto res = std::make_shared<PlaybackBuffer>(aFormat);
@@ -706,6 +917,37 @@ std::shared_ptr<PlaybackBuffer> Format::decodeEntireAudio(const QAudioFormat & a
 
 
 
+bool Format::decodeAudioPacket(AVPacket * aPacket, AVFrame * aFrame)
+{
+	auto ret = avcodec_send_packet(mAudioDecoderContext->mContext, aPacket);
+	if (ret < 0)
+	{
+		qWarning() << "Error while sending a packet to the decoder: " << ret;
+		// Not fatal, continue with the next packet
+		return !mShouldTerminate;
+	}
+
+	while (true)
+	{
+		ret = avcodec_receive_frame(mAudioDecoderContext->mContext, aFrame);
+		if ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF))
+		{
+			// Need more data / explicit EOF found
+			return !mShouldTerminate;
+		}
+		else if (ret < 0)
+		{
+			qWarning() << "Error while receiving a frame from the decoder: " << ret;
+			return false;
+		}
+		outputAudioData(aFrame);
+	}
+}
+
+
+
+
+
 void Format::outputAudioData(AVFrame * aFrame)
 {
 	if (mResampler == nullptr)
@@ -32,12 +32,29 @@ namespace AVPP
 	public:
 
 		/** Creates a new AVIOContext tied to the specified file.
+		If aShouldMapFile is true, the file is memory-mapped (mapFile(), with the sequential access hint) and the reads
+		are served from the mapping; if the mapping fails, falls back to reading through QFile.
+		Only use the mapping for short sequential reads (hashing), never for long-lived contexts (playback): if the file
+		is truncated while it is mapped, the next access to the mapping crashes the program (SIGBUS).
 		Returns nullptr if the file cannot be opened or upon any error. */
-		static std::shared_ptr<FileIO> createContext(const QString & aFileName);
+		static std::shared_ptr<FileIO> createContext(const QString & aFileName, bool aShouldMapFile = false);
+
+		/** Creates a new AVIOContext reading the specified in-memory file data.
+		Returns nullptr upon any error. */
+		static std::shared_ptr<FileIO> createContext(const QByteArray & aData);
 
 		/** Destroyes the instance, freeing up what needs to be freed. */
 		virtual ~FileIO();
 
+		/** Memory-maps the entire opened file, read-only, and returns its contents without copying.
+		If aIsSequentialAccess is true, the OS is hinted that the data will be read sequentially (POSIX only).
+		The returned data is valid only while aFile is open.
+		Files on network filesystems are not mapped, because a connection loss would crash the program
+		on the next access to the mapping. Similarly, the file must not be truncated while the mapping is in use,
+		so the mapping should only be kept for short periods.
+		Returns an empty QByteArray if the file cannot be mapped. */
+		static QByteArray mapFile(QFile & aFile, bool aIsSequentialAccess);
+
 
 	protected:
 		friend class Format;
@@ -46,16 +63,24 @@ namespace AVPP
 		/** The context itself. */
 		AVIOContext * mContext;
 
-		/** The file to which the IO is bound. */
-		std::unique_ptr<QFile> mFile;
+		/** The file that is memory-mapped into mDevice, if mapping is used.
+		The mapping is valid as long as the file object exists, so it needs to outlive mDevice. */
+		std::unique_ptr<QFile> mMappedFile;
+
+		/** The device (file or in-memory buffer) to which the IO is bound. */
+		std::unique_ptr<QIODevice> mDevice;
 
 
 		/** Creates a new empty instance. */
 		FileIO();
 
-		/** Opens the specified file.
-		Returns true on success, false on failure. */
-		bool Open(const QString & aFileName);
+		/** Creates a new AVIOContext tied to the specified opened device.
+		Returns nullptr upon any error. */
+		static std::shared_ptr<FileIO> createContext(std::unique_ptr<QIODevice> && aDevice);
+
+		/** Returns true if the specified file is on a filesystem that is safe to memory-map (not a network one).
+		The result is cached per folder, so that the mount table is not re-parsed for each file. */
+		static bool isMappingSafe(const QString & aFileName);
 
 		/** The IO reading function (AVIO signature). */
 		static int read(void * aThis, uint8_t * aDst, int aSize);
@@ -196,8 +221,20 @@ namespace AVPP
 	{
 	public:
 		/** Creates a new AVFormatContext instance tied to the specified input file.
+		If aShouldMapFile is true, the file is read through a memory mapping (see FileIO::createContext()).
+		Returns nullptr on error. */
+		static FormatPtr createContext(const QString & aFileName, bool aShouldMapFile = false);
+
+		/** Creates a new AVFormatContext instance reading the specified in-memory file data.
+		aFileName is used only for the log messages.
+		Returns nullptr on error. */
+		static FormatPtr createContext(const QByteArray & aData, const QString & aFileName);
+
+		/** Creates a new AVFormatContext instance reading from the specified opened device, from its start.
+		Takes over the ownership of the device.
+		aFileName is used only for the log messages.
 		Returns nullptr on error. */
-		static FormatPtr createContext(const QString & aFileName);
+		static FormatPtr createContext(std::unique_ptr<QIODevice> && aDevice, const QString & aFileName);
 
 		~Format();
 
@@ -216,10 +253,26 @@ namespace AVPP
 			double & aLengthSec
 		);
 
+		/** Reads the input once, passing all raw (compressed) audio data to the specified callback function
+		(exactly the same data as feedRawAudioDataTo()) and decoding it according to routing set with routeAudioTo().
+		If the decoding fails or is aborted by the output, the raw data is still fed until the end of the input.
+		aLengthSec gets filled with the audio data length in seconds, if available.
+		Needs to be called after routeAudioTo(). */
+		void decodeAndFeedRawAudioDataTo(
+			std::function<void (const void * /*aData */, int /* aSize */)> aFunction,
+			double & aLengthSec
+		);
+
 		/** Reads the input and decodes any data found in it, according to routing set with routeAudioTo().
 		Blocks until the entire input is decoded (or seeked out of, using seekTo() from another thread). */
 		void decode();
 
+		/** Seeks the input to the specified position, in seconds, so that the next decode() call starts there.
+		Seeks to the nearest position at or before the requested one that the container allows.
+		Needs to be called after routeAudioTo(), and not while decode() is running.
+		Returns true on success, false on failure (the input position is then undefined). */
+		bool seekTo(double aSeconds);
+
 		/** Decodes the entire audio data in the input file and returns it as a playable buffer.
 		aFormat specifies the output format for the buffer. */
 		std::shared_ptr<PlaybackBuffer> decodeEntireAudio(const QAudioFormat & aFormat);
@@ -253,6 +306,16 @@ namespace AVPP
 		/** Creates a new instance and binds it to the specified IO. */
 		Format(std::shared_ptr<FileIO> aIO);
 
+		/** Creates a new AVFormatContext instance reading from the specified IO.
+		aFileName is used only for the log messages.
+		Returns nullptr on error. */
+		static FormatPtr createContext(std::shared_ptr<FileIO> aIO, const QString & aFileName);
+
+		/** Sends the specified packet to the audio decoder and outputs all the frames decoded from it,
+		using aFrame as the temporary storage.
+		Returns false if the decoding should stop (decoder error or the output requested termination). */
+		bool decodeAudioPacket(AVPacket * aPacket, AVFrame * aFrame);
+
 		/** Outputs the specified audio data frame into mAudioOutput. */
 		void outputAudioData(AVFrame * aFrame);
 	};  // class Format
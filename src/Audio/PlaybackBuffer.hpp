@@ -40,12 +40,13 @@ public:
 	/** Writes the specified data to the buffer.
 	Blocks until all the data can fit into the buffer.
 	Wakes up the output from its initial pause (waitForData()), if needed.
-	Returns true if the decoder should continue, false if it should abort. */
-	bool writeDecodedAudio(const void * aData, size_t aLen);
+	Returns true if the decoder should continue, false if it should abort.
+	Descendants may override this to process the data as it is decoded, instead of buffering it. */
+	virtual bool writeDecodedAudio(const void * aData, size_t aLen);
 
 	/** Sets the buffer duration, in seconds.
 	Allocates the audio buffer. */
-	void setDuration(double aDurationSec);
+	virtual void setDuration(double aDurationSec);
 
 	/** Returns the whole internal buffer for audio data from the decoder.
 	Note that this may be accessed from other threads only after the duration has been set. */
@@ -1,4 +1,5 @@
 #include "BackgroundTempoDetector.hpp"
+#include <algorithm>
 #include <cassert>
 #include "ComponentCollection.hpp"
 #include "DB/Database.hpp"
@@ -11,7 +12,8 @@
 
 BackgroundTempoDetector::BackgroundTempoDetector(ComponentCollection & aComponents):
 	mComponents(aComponents),
-	mIsRunning(false),
+	mNumRunning(0),
+	mMaxConcurrency(1),
 	mShouldAbort(true)
 {
 }
@@ -22,13 +24,24 @@ BackgroundTempoDetector::BackgroundTempoDetector(ComponentCollection & aComponen
 
 void BackgroundTempoDetector::start()
 {
-	if (mIsRunning.load())
+	if (!mShouldAbort.load())
 	{
 		qDebug() << "Already running";
 		return;
 	}
+
+	// Fill the queue with all the eligible songs:
+	{
+		auto db = mComponents.get<Database>();
+		std::lock_guard<std::mutex> lock(mMtx);
+		for (const auto & sd: db->songSharedDataMap())
+		{
+			addToQueue(sd.second);
+		}
+		qDebug() << "Songs queued for background tempo detection: " << mQueue.size();
+	}
 	mShouldAbort = false;
-	enqueueAnother();
+	enqueueMore();
 }
 
 
@@ -44,51 +57,116 @@ void BackgroundTempoDetector::stop()
 
 
 
-Song::SharedDataPtr BackgroundTempoDetector::pickNextSong()
+void BackgroundTempoDetector::setMaxConcurrency(int aMaxConcurrency)
 {
-	// Return the first song that has no MPM set:
-	auto db = mComponents.get<Database>();
-	auto sdm = db->songSharedDataMap();
-	for (auto itr = sdm.cbegin(), end = sdm.cend(); itr != end; ++itr)
+	mMaxConcurrency = std::max(aMaxConcurrency, 1);
+	if (!mShouldAbort.load())
+	{
+		enqueueMore();
+	}
+}
+
+
+
+
+
+void BackgroundTempoDetector::songFileAdded(SongPtr aSong)
+{
+	if (aSong->sharedData() == nullptr)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		addToQueue(aSong->sharedData());
+	}
+	if (!mShouldAbort.load())
+	{
+		enqueueMore();
+	}
+}
+
+
+
+
+
+void BackgroundTempoDetector::songTempoDetected(Song::SharedDataPtr aSongSD)
+{
+	std::lock_guard<std::mutex> lock(mMtx);
+	mQueuedSongs.erase(aSongSD);
+}
+
+
+
+
+
+bool BackgroundTempoDetector::isEligible(const Song::SharedDataPtr & aSongSD)
+{
+	if (
+		aSongSD->mTagManual.mMeasuresPerMinute.isPresent() ||
+		aSongSD->mDetectedTempo.isPresent()
+	)
+	{
+		return false;
+	}
+	auto duplicates = aSongSD->duplicates();
+	if (duplicates.empty())
+	{
+		return false;
+	}
+	for (const auto s: duplicates)
 	{
-		auto sd = itr->second;
-		{
-			std::lock_guard<std::mutex> lock(mMtxFailedSongs);
-			if (mFailedSongs.find(sd) != mFailedSongs.end())
-			{
-				// Has failed recently, skip it
-				continue;
-			}
-		}
 		if (
-			sd->mTagManual.mMeasuresPerMinute.isPresent() ||
-			sd->mDetectedTempo.isPresent()
+			s->tagFileName().mMeasuresPerMinute.isPresent() ||
+			s->tagId3().mMeasuresPerMinute.isPresent()
 		)
 		{
-			continue;
+			return false;
 		}
-		auto duplicates = sd->duplicates();
-		if (duplicates.empty())
+	}  // for s - duplicates[]
+	return true;
+}
+
+
+
+
+
+void BackgroundTempoDetector::addToQueue(const Song::SharedDataPtr & aSongSD)
+{
+	if (
+		(mFailedSongs.find(aSongSD) != mFailedSongs.end()) ||  // Has failed recently, skip it
+		(mQueuedSongs.find(aSongSD) != mQueuedSongs.end()) ||  // Already queued
+		!isEligible(aSongSD)
+	)
+	{
+		return;
+	}
+	mQueuedSongs.insert(aSongSD);
+	mQueue.push_back(aSongSD);
+}
+
+
+
+
+
+Song::SharedDataPtr BackgroundTempoDetector::pickNextSong()
+{
+	// Return the first queued song that still has no MPM set.
+	// Each song is popped only once, so the cost is amortized constant:
+	while (!mQueue.empty())
+	{
+		auto sd = mQueue.front();
+		mQueue.pop_front();
+		if (mQueuedSongs.erase(sd) == 0)
 		{
+			// Removed from the queue meanwhile
 			continue;
 		}
-		bool hasMPM = false;
-		for (const auto s: duplicates)
-		{
-			if (
-				s->tagFileName().mMeasuresPerMinute.isPresent() ||
-				s->tagId3().mMeasuresPerMinute.isPresent()
-			)
-			{
-				hasMPM = true;
-				break;
-			}
-		}  // for s - duplicates[]
-		if (!hasMPM)
+		if (isEligible(sd))  // The song could have received its MPM (such as from a tag rescan) since queued
 		{
 			return sd;
 		}
-	}  // for itr - sdm[]
+	}
 
 	// No eligible song found
 	return nullptr;
@@ -98,31 +176,34 @@ Song::SharedDataPtr BackgroundTempoDetector::pickNextSong()
 
 
 
-void BackgroundTempoDetector::enqueueAnother()
+void BackgroundTempoDetector::enqueueMore()
 {
-	auto sd = pickNextSong();
-	if (sd == nullptr)
-	{
-		return;
-	}
-	mIsRunning = true;
-	auto taskName = SongTempoDetector::createTaskName(sd);
+	std::unique_lock<std::mutex> lock(mMtx);
 	auto td = mComponents.get<SongTempoDetector>();
-	BackgroundTasks::get().enqueue(taskName, [this, sd, td]()
+	while (!mShouldAbort.load() && (mNumRunning.load() < mMaxConcurrency.load()))
+	{
+		auto sd = pickNextSong();
+		if (sd == nullptr)
 		{
-			if (!td->detect(sd))
-			{
-				std::lock_guard<std::mutex> lock(mMtxFailedSongs);
-				mFailedSongs.insert(sd);
-			}
-			if (!mShouldAbort.load())
+			return;
+		}
+		mNumRunning += 1;
+		BackgroundTasks::enqueue(SongTempoDetector::createTaskName(sd),
+			[this, sd, td]()
 			{
-				enqueueAnother();
-			}
-			else
+				if (!td->detect(sd, true))  // The background pass over the whole library uses excerpts, for speed
+				{
+					std::lock_guard<std::mutex> lock(mMtx);
+					mFailedSongs.insert(sd);
+				}
+				mNumRunning -= 1;
+				enqueueMore();
+			},
+			false,
+			[this]()
 			{
-				mIsRunning = false;
+				mNumRunning -= 1;
 			}
-		}
-	);
+		);
+	}
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <set>
 #include <mutex>
 #include <QObject>
@@ -13,7 +14,10 @@
 
 
 /** Class that runs tempo detection in the background for all eligible songs in the DB.
-Only one task is enqueued at a time, to reduce background threads overwhelming the main threads. */
+Only a limited number of tasks is enqueued at a time (one by default), to reduce background threads
+overwhelming the main threads.
+The songs to process are kept in a queue, built once upon start() and then updated as songs are added to the DB
+and their tempo is detected, so that picking the next song takes constant time. */
 class BackgroundTempoDetector:
 	public QObject,
 	public ComponentCollection::Component<ComponentCollection::ckBackgroundTempoDetector>
@@ -27,15 +31,31 @@ public:
 	BackgroundTempoDetector(ComponentCollection & aComponents);
 
 	/** Starts the repeater.
+	Fills the queue with all the eligible songs from the DB.
 	Ignored if already started. */
 	void start();
 
 	/** Stops the repeater.
-	The current detection task, if any, will still keep running. */
+	The current detection tasks, if any, will still keep running. */
 	void stop();
 
 	/** Returns true if there's a task currently being executed. */
-	bool isRunning() { return mIsRunning.load(); }
+	bool isRunning() { return (mNumRunning.load() > 0); }
+
+	/** Sets the maximum number of detections that may run concurrently.
+	If raised while running, the additional detections are started immediately. */
+	void setMaxConcurrency(int aMaxConcurrency);
+
+
+public slots:
+
+	/** Adds the song's shared data to the queue, if it is eligible for detection.
+	Connected to Database::songFileAdded(). */
+	void songFileAdded(SongPtr aSong);
+
+	/** Removes the song's shared data from the queue.
+	Connected to SongTempoDetector::songTempoDetected(). */
+	void songTempoDetected(Song::SharedDataPtr aSongSD);
 
 
 protected:
@@ -43,25 +63,45 @@ protected:
 	/** The components of the entire program. */
 	ComponentCollection & mComponents;
 
-	/** True if there's a TempoDetectTask queued / running in the background. */
-	std::atomic<bool> mIsRunning;
+	/** The number of detection tasks queued / running in the background. */
+	std::atomic<int> mNumRunning;
+
+	/** The maximum number of detection tasks queued / running in the background at the same time. */
+	std::atomic<int> mMaxConcurrency;
 
 	/** If true, the enqueueing loop will not enqueue any more tasks and will terminate after the current
-	detection finishes. */
+	detections finish. */
 	std::atomic<bool> mShouldAbort;
 
+	/** The songs waiting for detection, in the order of processing.
+	May contain songs that are no longer in mQueuedSongs (their tempo got detected meanwhile), these are skipped.
+	Protected against multithreaded access by mMtx. */
+	std::deque<Song::SharedDataPtr> mQueue;
+
+	/** The songs that are in mQueue and still waiting for detection, for quick membership checks.
+	Protected against multithreaded access by mMtx. */
+	std::set<Song::SharedDataPtr> mQueuedSongs;
+
 	/** The songs that have failed to provide a tempo; these will be skipped until program restart.
-	Protected against multithreaded access by mMtxFailedSongs. */
+	Protected against multithreaded access by mMtx. */
 	std::set<Song::SharedDataPtr> mFailedSongs;
 
-	/** Mutex for protecting mFailedSongs agains multithreaded access. */
-	std::mutex mMtxFailedSongs;
+	/** Mutex for protecting mQueue, mQueuedSongs and mFailedSongs agains multithreaded access. */
+	std::mutex mMtx;
+
+
+	/** Returns true if the song needs its tempo detected - it has no MPM from any source. */
+	static bool isEligible(const Song::SharedDataPtr & aSongSD);
 
+	/** Adds the song to mQueue, if it is eligible and not already there, nor failed before.
+	Expects mMtx to be locked by the caller. */
+	void addToQueue(const Song::SharedDataPtr & aSongSD);
 
-	/** Picks a song from the DB that should be processed next.
-	If no eligible song found, returns nullptr. */
+	/** Picks a song from the queue that should be processed next.
+	If no eligible song found, returns nullptr.
+	Expects mMtx to be locked by the caller. */
 	Song::SharedDataPtr pickNextSong();
 
-	/** Picks a song to process and enqueues the detection task. */
-	void enqueueAnother();
+	/** Picks songs to process and enqueues the detection tasks for them, up to the max concurrency. */
+	void enqueueMore();
 };
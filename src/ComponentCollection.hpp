@@ -37,6 +37,8 @@ public:
 		ckInstallConfiguration,
 		ckTempoDetector,
 		ckBackgroundTempoDetector,
+		ckLibraryCrawler,
+		ckLibraryWatcher,
 	};
 
 
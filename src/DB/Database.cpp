@@ -17,9 +17,25 @@
 #include "../Playlist.hpp"
 #include "../PlaylistItemSong.hpp"
 #include "../InstallConfiguration.hpp"
+#include "../Settings.hpp"
 #include "../Exception.hpp"
 #include "DatabaseUpgrade.hpp"
 #include "DatabaseBackup.hpp"
+#include "DatabaseSnapshot.hpp"
+
+
+
+
+
+/** The time between the first change to the song data and writing all the changes to the DB, in msec.
+Bounds the amount of changes that may be lost if the program crashes. */
+static const int FLUSH_DELAY_MSEC = 1000;
+
+/** The journal modes that can be set through the Settings (Database/JournalMode). */
+static const QStringList JOURNAL_MODES = {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"};
+
+/** The synchronous modes that can be set through the Settings (Database/Synchronous). */
+static const QStringList SYNCHRONOUS_MODES = {"OFF", "NORMAL", "FULL", "EXTRA"};
 
 
 
@@ -95,6 +111,52 @@ static Song::Tag tagFromFields(
 
 
 
+/** Constructs a Song::FileFingerprint from the specified SQL record,
+reading the size, modification time and inode from the columns at the specified indices.
+If the size is null (the file hasn't been fingerprinted yet), returns an invalid fingerprint. */
+static Song::FileFingerprint fingerprintFromFields(
+	const QSqlRecord & aRecord,
+	int aIdxSize,
+	int aIdxModified,
+	int aIdxInode
+)
+{
+	Song::FileFingerprint res;
+	auto size = fieldValue(aRecord.field(aIdxSize));
+	if (!size.isValid())
+	{
+		return res;
+	}
+	res.mSize = size.toLongLong();
+	res.mModified = aRecord.value(aIdxModified).toLongLong();
+	res.mInode = static_cast<quint64>(aRecord.value(aIdxInode).toLongLong());
+	return res;
+}
+
+
+
+
+
+/** Adds the bind values for the size, modification time and inode of the specified fingerprint to the query.
+An invalid fingerprint is bound as three nulls. */
+static void addFingerprintBindValues(QSqlQuery & aQuery, const Song::FileFingerprint & aFingerprint)
+{
+	if (!aFingerprint.isValid())
+	{
+		aQuery.addBindValue(QVariant());
+		aQuery.addBindValue(QVariant());
+		aQuery.addBindValue(QVariant());
+		return;
+	}
+	aQuery.addBindValue(aFingerprint.mSize);
+	aQuery.addBindValue(aFingerprint.mModified);
+	aQuery.addBindValue(static_cast<qint64>(aFingerprint.mInode));
+}
+
+
+
+
+
 /** Applies the specified rating, if present, to the song weight. */
 static qint64 applyRating(qint64 aCurrentWeight, const DatedOptional<double> & aRating)
 {
@@ -181,6 +243,26 @@ protected:
 Database::Database(ComponentCollection & aComponents):
 	mComponents(aComponents)
 {
+	mFlushTimer.setSingleShot(true);
+	connect(&mFlushTimer, &QTimer::timeout, this, &Database::flushTimerExpired);
+}
+
+
+
+
+
+Database::~Database()
+{
+	try
+	{
+		flush();
+	}
+	catch (const std::exception & exc)
+	{
+		qWarning() << "Cannot write the pending changes to the DB: " << exc.what();
+	}
+	mPreparedQueries.clear();
+	checkpointJournal();
 }
 
 
@@ -191,6 +273,10 @@ void Database::open(const QString & aDBFileName)
 {
 	assert(!mDatabase.isOpen());  // Opening another DB is not allowed
 
+	// Stamp the DB file before opening, the snapshot is only valid if it was made from the same DB file state:
+	auto snapshotFileName = DatabaseSnapshot::snapshotFileName(aDBFileName);
+	auto snapshotStamp = DatabaseSnapshot::Stamp::fromDBFile(aDBFileName);
+
 	static std::atomic<int> counter(0);
 	auto connName = QString::fromUtf8("DB%1").arg(counter.fetch_add(1));
 	mDatabase = QSqlDatabase::addDatabase("QSQLITE", connName);
@@ -235,16 +321,11 @@ void Database::open(const QString & aDBFileName)
 		}
 	}
 
-	// Turn off synchronous queries (they slow up DB inserts by orders of magnitude):
-	auto query = mDatabase.exec("PRAGMA synchronous = off");
-	if (query.lastError().type() != QSqlError::NoError)
-	{
-		qWarning() << "Turning off synchronous failed: " << query.lastError();
-		// Continue, this is not a hard error, just perf may be bad
-	}
+	// Set the journal and synchronous modes, mmap and cache (they affect the DB inserts' speed by orders of magnitude):
+	applyPragmas();
 
 	// Turn on foreign keys:
-	query = mDatabase.exec("PRAGMA foreign_keys = on");
+	auto query = mDatabase.exec("PRAGMA foreign_keys = on");
 	if (query.lastError().type() != QSqlError::NoError)
 	{
 		qWarning() << "Turning on foreign keys failed: " << query.lastError();
@@ -254,9 +335,51 @@ void Database::open(const QString & aDBFileName)
 	// Upgrade the DB to the latest version:
 	DatabaseUpgrade::upgrade(*this);
 
-	loadSongs();
-	loadFilters();
-	loadTemplates();
+	// Load the data, preferably from the snapshot:
+	if (DatabaseSnapshot::load(*this, snapshotFileName, snapshotStamp))
+	{
+		// The snapshot only describes the DB file state it was made from, and the DB is about to change:
+		QFile::remove(snapshotFileName);
+		enqueueSnapshotSongsProcessing();
+	}
+	else
+	{
+		loadSongs();
+		loadFilters();
+		loadTemplates();
+	}
+}
+
+
+
+
+
+void Database::close()
+{
+	if (!mDatabase.isOpen())
+	{
+		return;
+	}
+	flush();
+	mPreparedQueries.clear();
+	checkpointJournal();
+	auto dbFileName = mDatabase.databaseName();
+	mDatabase.close();
+
+	// Write the snapshot of the data for the next startup:
+	try
+	{
+		DatabaseSnapshot::save(
+			*this,
+			DatabaseSnapshot::snapshotFileName(dbFileName),
+			DatabaseSnapshot::Stamp::fromDBFile(dbFileName)
+		);
+	}
+	catch (const std::exception & exc)
+	{
+		// Not a hard error, the next startup will load from the DB:
+		qWarning() << "Cannot write the DB snapshot: " << exc.what();
+	}
 }
 
 
@@ -265,10 +388,28 @@ void Database::open(const QString & aDBFileName)
 
 void Database::addSongFiles(const QStringList & aFiles)
 {
+	// Insert all the files in a single transaction, it's much faster than a transaction per file:
+	SqlTransaction transaction(mDatabase);
 	for (const auto & f: aFiles)
 	{
 		addSongFile(f);
 	}
+	transaction.commit();
+}
+
+
+
+
+
+void Database::addFoundFiles(const LibraryCrawler::FoundFiles & aFiles)
+{
+	// Process all the files in a single transaction, it's much faster than a transaction per file:
+	SqlTransaction transaction(mDatabase);
+	for (const auto & f: aFiles)
+	{
+		quickRescanFile(f.first, f.second);
+	}
+	transaction.commit();
 }
 
 
@@ -278,33 +419,28 @@ void Database::addSongFiles(const QStringList & aFiles)
 void Database::addSongFile(const QString & aFileName)
 {
 	// Check for duplicates:
-	for (const auto & song: mSongs)
+	if (mSongsByFileName.contains(aFileName))
 	{
-		if (song->fileName() == aFileName)
-		{
-			qDebug() << "Skipping duplicate " << aFileName;
-			return;
-		}
+		qDebug() << "Skipping duplicate " << aFileName;
+		return;
 	}
 
 	// Insert into DB:
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("INSERT OR IGNORE INTO NewFiles (FileName) VALUES(?)"))
+	auto query = preparedQuery(stInsertNewFile);
+	if (query == nullptr)
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, aFileName);
-	if (!query.exec())
+	query->bindValue(0, aFileName);
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
 
 	// Enqueue it in the Hash calculator:
-	// (After the hash is calculated, only then a Song instance is created for the song, in songHashCalculated())
+	// (After the hash is calculated, only then a Song instance is created for the song, in songFileIngested())
 	emit needFileHash(aFileName);
 }
 
@@ -312,6 +448,24 @@ void Database::addSongFile(const QString & aFileName)
 
 
 
+void Database::removeMissingSongFiles(const QStringList & aFileNames)
+{
+	for (const auto & fileName: aFileNames)
+	{
+		auto song = songFromFileName(fileName);
+		if ((song == nullptr) || QFile::exists(fileName))
+		{
+			continue;
+		}
+		qDebug() << "Song file " << fileName << " has been removed, removing the song";
+		removeSong(*song, false);
+	}
+}
+
+
+
+
+
 void Database::removeSong(const Song & aSong, bool aDeleteDiskFile)
 {
 	size_t idx = 0;
@@ -324,6 +478,9 @@ void Database::removeSong(const Song & aSong, bool aDeleteDiskFile)
 		auto song = *itr;
 		emit songRemoving(song, idx);
 		mSongs.erase(itr);
+		mSongsByFileName.remove(song->fileName());
+		unindexSongFingerprint(song);
+		mDirtySongFiles.erase(song);
 		song->sharedData()->delDuplicate(&aSong);
 
 		// Remove from the DB:
@@ -411,14 +568,7 @@ SongPtr Database::songFromHash(const QByteArray & aSongHash)
 
 SongPtr Database::songFromFileName(const QString aSongFileName)
 {
-	for (const auto & song: mSongs)
-	{
-		if (song->fileName() == aSongFileName)
-		{
-			return song;
-		}
-	}
-	return nullptr;
+	return mSongsByFileName.value(aSongFileName);
 }
 
 
@@ -492,26 +642,24 @@ void Database::swapTemplatesByIdx(size_t aIdx1, size_t aIdx2)
 	std::swap(mTemplates[aIdx1], mTemplates[aIdx2]);
 
 	// Swap in the DB:
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("UPDATE Templates SET Position = ? WHERE RowID = ?"))
+	auto query = preparedQuery(stUpdateTemplatePosition);
+	if (query == nullptr)
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, static_cast<qulonglong>(aIdx1));
-	query.bindValue(1, mTemplates[aIdx1]->dbRowId());
-	if (!query.exec())
+	query->bindValue(0, static_cast<qulonglong>(aIdx1));
+	query->bindValue(1, mTemplates[aIdx1]->dbRowId());
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, static_cast<qulonglong>(aIdx2));
-	query.bindValue(1, mTemplates[aIdx2]->dbRowId());
-	if (!query.exec())
+	query->bindValue(0, static_cast<qulonglong>(aIdx2));
+	query->bindValue(1, mTemplates[aIdx2]->dbRowId());
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
@@ -721,26 +869,24 @@ void Database::swapFiltersByIdx(size_t aIdx1, size_t aIdx2)
 	std::swap(mFilters[aIdx1], mFilters[aIdx2]);
 
 	// Swap in the DB:
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("UPDATE Filters SET Position = ? WHERE RowID = ?"))
+	auto query = preparedQuery(stUpdateFilterPosition);
+	if (query == nullptr)
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, static_cast<qulonglong>(aIdx1));
-	query.bindValue(1, mFilters[aIdx1]->dbRowId());
-	if (!query.exec())
+	query->bindValue(0, static_cast<qulonglong>(aIdx1));
+	query->bindValue(1, mFilters[aIdx1]->dbRowId());
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, static_cast<qulonglong>(aIdx2));
-	query.bindValue(1, mFilters[aIdx2]->dbRowId());
-	if (!query.exec())
+	query->bindValue(0, static_cast<qulonglong>(aIdx2));
+	query->bindValue(1, mFilters[aIdx2]->dbRowId());
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
@@ -1147,6 +1293,7 @@ std::vector<Database::HistoryItem> Database::playbackHistory() const
 			query.value(fiHash).toByteArray()
 		});
 	}
+	res.insert(res.end(), mPendingPlaybackHistory.cbegin(), mPendingPlaybackHistory.cend());
 	return res;
 }
 
@@ -1156,25 +1303,24 @@ std::vector<Database::HistoryItem> Database::playbackHistory() const
 
 void Database::addPlaybackHistory(const std::vector<Database::HistoryItem> & aHistory)
 {
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("INSERT INTO PlaybackHistory (Timestamp, SongHash) VALUES(?, ?)"))
+	if (aHistory.empty())
 	{
-		qWarning() << "Cannot prepare query: " << query.lastError();
-		qDebug() << query.lastQuery();
-		assert(!"DB error");
 		return;
 	}
+	auto query = preparedQuery(stInsertPlaybackHistory);
+	if (query == nullptr)
+	{
+		throw RuntimeError("Cannot prepare the PlaybackHistory insert statement");
+	}
 	for (const auto & item: aHistory)
 	{
-		query.addBindValue(item.mTimestamp);
-		query.addBindValue(item.mHash);
-		if (!query.exec())
+		query->addBindValue(item.mTimestamp);
+		query->addBindValue(item.mHash);
+		if (!query->exec())
 		{
-			qWarning() << "Cannot store playback history item "
-				<< item.mTimestamp << ", "
-				<< item.mHash << ": "
-				<< query.lastError();
-			assert(!"DB error");
+			throw RuntimeError("Cannot store playback history item %1, %2: %3",
+				item.mTimestamp, item.mHash, query->lastError()
+			);
 		}
 	}
 }
@@ -1319,12 +1465,148 @@ void Database::addToSharedDataManualTags(const std::map<QByteArray, Song::Tag> &
 
 
 
+void Database::quickRescanFile(const QString & aFileName, const Song::FileFingerprint & aFingerprint)
+{
+	// A known file, check if it changed since the last time:
+	auto song = songFromFileName(aFileName);
+	if (song != nullptr)
+	{
+		if (!aFingerprint.isValid() || song->fileFingerprint().matches(aFingerprint))
+		{
+			return;
+		}
+		if (song->fileFingerprint().isValid())
+		{
+			// The contents may have changed (re-encoded, replaced), hash it again
+			// The new fingerprint is stored only once the hash is known (songFileIngested()), so that an interrupted
+			// rehash is retried upon the next rescan:
+			qDebug() << "Song file " << aFileName << " has changed, rehashing";
+			emit needFileHash(aFileName);
+			return;
+		}
+		// Not fingerprinted yet (DB from an older version), only store the fingerprint
+		setSongFileFingerprint(song, aFingerprint);
+		saveSongFileData(song);
+		return;
+	}
+
+	// An unknown file, check if it is a known song that has been moved:
+	auto movedSong = movedSongFromFingerprint(aFingerprint);
+	if (movedSong != nullptr)
+	{
+		qDebug() << "Song file " << movedSong->fileName() << " has been moved to " << aFileName;
+		moveSongFile(movedSong, aFileName);
+		return;
+	}
+
+	// A new file, needs hashing:
+	addSongFile(aFileName);
+}
+
+
+
+
+
+SongPtr Database::movedSongFromFingerprint(const Song::FileFingerprint & aFingerprint)
+{
+	if (!aFingerprint.isValid())
+	{
+		return nullptr;
+	}
+	const auto key = qMakePair(aFingerprint.mSize, aFingerprint.mModified);
+	for (auto itr = mSongsByFingerprint.constFind(key), end = mSongsByFingerprint.constEnd(); (itr != end) && (itr.key() == key); ++itr)
+	{
+		const auto & song = itr.value();
+		if (
+			song->fileFingerprint().matches(aFingerprint) &&
+			!QFile::exists(song->fileName())  // Only when the file is gone, otherwise it's a copy
+		)
+		{
+			return song;
+		}
+	}
+	return nullptr;
+}
+
+
+
+
+
+void Database::indexSongFingerprint(const SongPtr & aSong)
+{
+	const auto & fp = aSong->fileFingerprint();
+	if (fp.isValid())
+	{
+		mSongsByFingerprint.insert(qMakePair(fp.mSize, fp.mModified), aSong);
+	}
+}
+
+
+
+
+
+void Database::unindexSongFingerprint(const SongPtr & aSong)
+{
+	const auto & fp = aSong->fileFingerprint();
+	if (fp.isValid())
+	{
+		mSongsByFingerprint.remove(qMakePair(fp.mSize, fp.mModified), aSong);
+	}
+}
+
+
+
+
+
+void Database::setSongFileFingerprint(const SongPtr & aSong, const Song::FileFingerprint & aFingerprint)
+{
+	unindexSongFingerprint(aSong);
+	aSong->setFileFingerprint(aFingerprint);
+	indexSongFingerprint(aSong);
+}
+
+
+
+
+
+void Database::moveSongFile(SongPtr aSong, const QString & aNewFileName)
+{
+	auto query = preparedQuery(stUpdateSongFileName);
+	if (query == nullptr)
+	{
+		return;
+	}
+	query->addBindValue(aNewFileName);
+	query->addBindValue(aSong->fileName());
+	if (!query->exec())
+	{
+		qWarning() << "Cannot exec statement: " << query->lastError();
+		assert(!"DB error");
+		return;
+	}
+	mSongsByFileName.remove(aSong->fileName());
+	mSongsByFileName.insert(aNewFileName, aSong);
+	aSong->setFileName(aNewFileName);
+	aSong->setFileNameTag(MetadataScanner::parseFileNameIntoMetadata(aNewFileName));
+	saveSongFileData(aSong);
+	emit songSaved(aSong);
+}
+
+
+
+
+
 bool Database::renameFile(Song & aSong, const QString & aFileName)
 {
 	if (!QFile::rename(aSong.fileName(), aFileName))
 	{
 		return false;
 	}
+	auto song = mSongsByFileName.take(aSong.fileName());
+	if (song != nullptr)
+	{
+		mSongsByFileName.insert(aFileName, song);
+	}
 	aSong.setFileName(aFileName);
 	return true;
 }
@@ -1333,14 +1615,207 @@ bool Database::renameFile(Song & aSong, const QString & aFileName)
 
 
 
+void Database::applyPragmas()
+{
+	// Read the values from the Settings, validate the modes (they cannot be bound as parameters into a PRAGMA):
+	auto journalMode = Settings::loadValue("Database", "JournalMode", "WAL").toString().toUpper();
+	if (!JOURNAL_MODES.contains(journalMode))
+	{
+		qWarning() << "Invalid DB journal mode in the settings: " << journalMode << ", using WAL";
+		journalMode = "WAL";
+	}
+	auto synchronous = Settings::loadValue("Database", "Synchronous", "NORMAL").toString().toUpper();
+	if (!SYNCHRONOUS_MODES.contains(synchronous))
+	{
+		qWarning() << "Invalid DB synchronous mode in the settings: " << synchronous << ", using NORMAL";
+		synchronous = "NORMAL";
+	}
+	auto mmapSizeMiB  = Settings::loadValue("Database", "MmapSizeMiB",  64).toLongLong();
+	auto cacheSizeMiB = Settings::loadValue("Database", "CacheSizeMiB", 16).toLongLong();
+
+	// The journal mode reports the mode actually set, which may differ (in-memory DBs cannot use WAL):
+	auto query = mDatabase.exec("PRAGMA journal_mode = " + journalMode);
+	if (query.lastError().type() != QSqlError::NoError)
+	{
+		qWarning() << "Setting the journal mode failed: " << query.lastError();
+		// Continue, this is not a hard error, just perf may be bad
+	}
+	else if (query.first() && (query.value(0).toString().toUpper() != journalMode))
+	{
+		qWarning() << "The DB refused journal mode " << journalMode << ", using " << query.value(0).toString();
+	}
+
+	// In the WAL mode, NORMAL synchronous is still safe against corruption, only the last commits may be lost on power loss:
+	const std::vector<std::pair<QString, const char *>> pragmas =
+	{
+		{"PRAGMA synchronous = " + synchronous,                       "synchronous mode"},
+		{QString("PRAGMA mmap_size = %1").arg(mmapSizeMiB * 1024 * 1024), "mmap size"},
+		{QString("PRAGMA cache_size = -%1").arg(cacheSizeMiB * 1024),      "cache size"},  // Negative = in KiB
+	};
+	for (const auto & pragma: pragmas)
+	{
+		query = mDatabase.exec(pragma.first);
+		if (query.lastError().type() != QSqlError::NoError)
+		{
+			qWarning() << "Setting the DB " << pragma.second << " failed: " << query.lastError();
+			// Continue, this is not a hard error, just perf may be bad
+		}
+	}
+	qDebug() << "DB journal mode: " << journalMode << ", synchronous: " << synchronous
+		<< ", mmap: " << mmapSizeMiB << " MiB, cache: " << cacheSizeMiB << " MiB";
+}
+
+
+
+
+
+QSqlQuery * Database::preparedQuery(EStatement aStatement)
+{
+	auto itr = mPreparedQueries.find(aStatement);
+	if (itr != mPreparedQueries.end())
+	{
+		return itr->second.get();
+	}
+
+	const char * sql = nullptr;
+	switch (aStatement)
+	{
+		case stInsertNewFile:             sql = "INSERT OR IGNORE INTO NewFiles (FileName) VALUES(?)"; break;
+		case stDeleteNewFile:             sql = "DELETE FROM NewFiles WHERE FileName = ?"; break;
+		case stUpdateSongFileName:        sql = "UPDATE OR REPLACE SongFiles SET FileName = ? WHERE FileName = ?"; break;
+		case stInsertSongSharedData:      sql = "INSERT OR IGNORE INTO SongSharedData (Hash, Length) VALUES (?, ?)"; break;
+		case stInsertPlaybackHistory:     sql = "INSERT INTO PlaybackHistory (Timestamp, SongHash) VALUES(?, ?)"; break;
+		case stUpdateTemplatePosition:    sql = "UPDATE Templates SET Position = ? WHERE RowID = ?"; break;
+		case stUpdateFilterPosition:      sql = "UPDATE Filters SET Position = ? WHERE RowID = ?"; break;
+		case stInsertVoteRhythmClarity:   sql = "INSERT INTO VotesRhythmClarity (SongHash, VoteValue, DateAdded) VALUES(?, ?, ?)"; break;
+		case stInsertVoteGenreTypicality: sql = "INSERT INTO VotesGenreTypicality (SongHash, VoteValue, DateAdded) VALUES(?, ?, ?)"; break;
+		case stInsertVotePopularity:      sql = "INSERT INTO VotesPopularity (SongHash, VoteValue, DateAdded) VALUES(?, ?, ?)"; break;
+		case stAvgVoteRhythmClarity:      sql = "SELECT AVG(VoteValue) FROM VotesRhythmClarity WHERE SongHash = ?"; break;
+		case stAvgVoteGenreTypicality:    sql = "SELECT AVG(VoteValue) FROM VotesGenreTypicality WHERE SongHash = ?"; break;
+		case stAvgVotePopularity:         sql = "SELECT AVG(VoteValue) FROM VotesPopularity WHERE SongHash = ?"; break;
+		case stInsertSongFile:
+		{
+			sql =
+				"INSERT OR IGNORE INTO SongFiles (FileName, Hash, FileSize, FileModified, FileInode) "
+				"VALUES (?, ?, ?, ?, ?)";
+			break;
+		}
+		case stUpdateSongFile:
+		{
+			sql =
+				"UPDATE SongFiles SET "
+				"Hash = ?, "
+				"FileNameAuthor = ?, FileNameTitle = ?, FileNameGenre = ?, FileNameMeasuresPerMinute = ?,"
+				"ID3Author = ?, ID3Title = ?, ID3Genre = ?, ID3MeasuresPerMinute = ?,"
+				"LastTagRescanned = ?,"
+				"NumTagRescanAttempts = ?,"
+				"FileSize = ?, FileModified = ?, FileInode = ? "
+				"WHERE FileName = ?";
+			break;
+		}
+		case stUpdateSongSharedData:
+		{
+			sql =
+				"UPDATE SongSharedData SET "
+				"Length = ?, LastPlayed = ?, LastPlayedLM = ?, "
+				"LocalRating = ?, LocalRatingLM = ?,"
+				"RatingRhythmClarity = ?,   RatingRhythmClarityLM = ?, "
+				"RatingGenreTypicality = ?, RatingGenreTypicalityLM = ?, "
+				"RatingPopularity = ?,      RatingPopularityLM = ?, "
+				"ManualAuthor = ?, ManualAuthorLM = ?,"
+				"ManualTitle = ?, ManualTitleLM = ?,"
+				"ManualGenre = ?, ManualGenreLM = ?,"
+				"ManualMeasuresPerMinute = ?, ManualMeasuresPerMinuteLM = ?,"
+				"SkipStart = ?, SkipStartLM = ?, "
+				"Notes = ?, NotesLM = ?, "
+				"BgColor = ?, BgColorLM = ?, "
+				"DetectedTempo = ?, DetectedTempoLM = ? "
+				"WHERE Hash = ?";
+			break;
+		}
+	}
+	assert(sql != nullptr);  // Missing a case for the statement
+
+	auto query = std::make_unique<QSqlQuery>(mDatabase);
+	if (!query->prepare(sql))
+	{
+		qWarning() << "Cannot prepare statement: " << query->lastError();
+		qDebug() << sql;
+		assert(!"DB error");
+		return nullptr;
+	}
+	auto res = query.get();
+	mPreparedQueries[aStatement] = std::move(query);
+	return res;
+}
+
+
+
+
+
+void Database::checkpointJournal()
+{
+	if (!mDatabase.isOpen())
+	{
+		return;
+	}
+	auto query = mDatabase.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	if (query.lastError().type() != QSqlError::NoError)
+	{
+		qWarning() << "Checkpointing the DB journal failed: " << query.lastError();
+	}
+}
+
+
+
+
+
 void Database::loadSongs()
 {
 	// First load the shared data:
 	loadSongSharedData();
 	loadSongFiles();
 	loadNewFiles();
+	enqueueSongsWithoutLength();
+}
+
+
+
+
 
-	// Enqueue songs with unknown length for length calc (#141):
+void Database::enqueueSnapshotSongsProcessing()
+{
+	// The song files without a hash are not in the snapshot, query them from the DB:
+	QSqlQuery query(mDatabase);
+	query.setForwardOnly(true);
+	if (!query.exec("SELECT FileName FROM SongFiles WHERE Hash IS NULL"))
+	{
+		qWarning() << "Cannot query unhashed song files from the DB: " << query.lastError();
+		assert(!"DB error");
+		return;
+	}
+	while (query.next())
+	{
+		emit needFileHash(query.value(0).toString());
+	}
+
+	for (const auto & song: mSongs)
+	{
+		if (song->needsTagRescan())
+		{
+			emit needSongTagRescan(song);
+		}
+	}
+	loadNewFiles();
+	enqueueSongsWithoutLength();
+}
+
+
+
+
+
+void Database::enqueueSongsWithoutLength()
+{
 	int numForRescan = 0;
 	for (const auto & sd: mSongSharedData)
 	{
@@ -1384,6 +1859,9 @@ void Database::loadSongFiles()
 	auto fiHash                 = query.record().indexOf("Hash");
 	auto fiLastTagRescanned     = query.record().indexOf("LastTagRescanned");
 	auto fiNumTagRescanAttempts = query.record().indexOf("NumTagRescanAttempts");
+	auto fiFileSize             = query.record().indexOf("FileSize");
+	auto fiFileModified         = query.record().indexOf("FileModified");
+	auto fiFileInode            = query.record().indexOf("FileInode");
 	std::array<int, 4> fisFileName
 	{{
 		query.record().indexOf("FileNameAuthor"),
@@ -1428,7 +1906,10 @@ void Database::loadSongFiles()
 			fieldValue(rec.field(fiLastTagRescanned)),
 			fieldValue(rec.field(fiNumTagRescanAttempts))
 		);
+		song->setFileFingerprint(fingerprintFromFields(rec, fiFileSize, fiFileModified, fiFileInode));
 		mSongs.push_back(song);
+		mSongsByFileName.insert(song->fileName(), song);
+		indexSongFingerprint(song);
 		if (song->needsTagRescan())
 		{
 			emit needSongTagRescan(song);
@@ -1546,6 +2027,8 @@ void Database::loadNewFiles()
 
 void Database::loadFilters()
 {
+	STOPWATCH("Loading filters from the DB");
+
 	// Initialize the query:
 	QSqlQuery query(mDatabase);
 	query.setForwardOnly(true);
@@ -1587,37 +2070,27 @@ void Database::loadFilters()
 			DatedOptional<double>(query.value(fiDurationLimit), QDateTime())
 		);
 		mFilters.push_back(filter);
-		loadFilterNodes(*filter);
 	}
+	loadFilterNodes();
 }
 
 
 
 
 
-void Database::loadFilterNodes(Filter & aFilter)
+void Database::loadFilterNodes()
 {
-	// Initialize the query:
+	// Initialize the query, loading the nodes of all filters at once:
 	QSqlQuery query(mDatabase);
 	query.setForwardOnly(true);
-	if (!query.prepare("SELECT RowID, * FROM FilterNodes WHERE FilterID = ?"))
-	{
-		qWarning() << "Cannot query filter nodes from the DB, "
-			<< "filter " << aFilter.displayName()
-			<< ", prep error: " << query.lastError();
-		assert(!"DB error");
-		return;
-	}
-	query.addBindValue(aFilter.dbRowId());
-	if (!query.exec())
+	if (!query.exec("SELECT RowID, * FROM FilterNodes ORDER BY FilterID ASC, RowID ASC"))
 	{
-		qWarning() << "Cannot query filter nodes from the DB, "
-			<< "filter " << aFilter.displayName()
-			<< ", exec error: " << query.lastError();
+		qWarning() << "Cannot query filter nodes from the DB: " << query.lastError();
 		assert(!"DB error");
 		return;
 	}
 	auto fiRowId        = query.record().indexOf("RowID");
+	auto fiFilterId     = query.record().indexOf("FilterID");
 	auto fiParentRowId  = query.record().indexOf("ParentID");
 	auto fiKind         = query.record().indexOf("Kind");
 	auto fiComparison   = query.record().indexOf("Comparison");
@@ -1626,11 +2099,10 @@ void Database::loadFilterNodes(Filter & aFilter)
 
 	/*
 	Load each node.
-	Each filter is loaded into a map of NodeRowID -> (ParentRowID, Node); then all nodes in the map
-	are walked to assign children to the proper parent node. The node without any parent is set as
-	the root node for the filter.
+	The nodes are loaded into a map of FilterRowID -> map of NodeRowID -> (ParentRowID, Node); then the nodes
+	of each filter are walked to assign children to the proper parent node (assignFilterNodes()).
 	*/
-	std::map<qlonglong, std::pair<qlonglong, Filter::NodePtr>> nodes;
+	std::map<qlonglong, std::map<qlonglong, std::pair<qlonglong, Filter::NodePtr>>> nodesByFilter;
 	if (!query.isActive())
 	{
 		qWarning() << "Query not active";
@@ -1647,6 +2119,7 @@ void Database::loadFilterNodes(Filter & aFilter)
 	{
 		Filter::NodePtr node;
 		Filter::Node::Kind kind;
+		auto filterId = query.value(fiFilterId).toLongLong();
 		auto parentRowId = query.value(fiParentRowId).toLongLong();
 		auto rowId = query.value(fiRowId).toLongLong();
 		auto intKind = query.value(fiKind).toInt();
@@ -1657,7 +2130,7 @@ void Database::loadFilterNodes(Filter & aFilter)
 		catch (const RuntimeError & exc)
 		{
 			qWarning() << "Failed to load Kind for filter node for "
-				<< " filter " << aFilter.displayName()
+				<< " filter " << filterId
 				<< ", RowID = " << rowId
 				<< ", err: " << exc.what();
 			continue;
@@ -1677,7 +2150,7 @@ void Database::loadFilterNodes(Filter & aFilter)
 				catch (const RuntimeError & exc)
 				{
 					qWarning() << "Failed to load Comparison for filter node for "
-						<< " filter " << aFilter.displayName()
+						<< " filter " << filterId
 						<< ", RowID = " << rowId
 						<< ", err: " << exc.what();
 					continue;
@@ -1689,7 +2162,7 @@ void Database::loadFilterNodes(Filter & aFilter)
 				catch (const RuntimeError & exc)
 				{
 					qWarning() << "Failed to load SongProperty for filter node for "
-						<< " filter " << aFilter.displayName()
+						<< " filter " << filterId
 						<< ", RowID = " << rowId
 						<< ", err: " << exc.what();
 					continue;
@@ -1705,15 +2178,34 @@ void Database::loadFilterNodes(Filter & aFilter)
 				break;
 			}
 		}
-		nodes[rowId] = std::make_pair(parentRowId, node);
+		nodesByFilter[filterId][rowId] = std::make_pair(parentRowId, node);
 	}
 
-	// Assign nodes to their parents:
+	// Assign the nodes to their filters:
+	for (const auto & filter: mFilters)
+	{
+		auto itr = nodesByFilter.find(filter->dbRowId());
+		if (itr != nodesByFilter.end())
+		{
+			assignFilterNodes(*filter, itr->second);
+		}
+	}
+}
+
+
+
+
+
+void Database::assignFilterNodes(
+	Filter & aFilter,
+	const std::map<qlonglong, std::pair<qlonglong, Filter::NodePtr>> & aNodes
+)
+{
 	bool hasSetRoot = false;
-	for (auto & f: nodes)
+	for (const auto & f: aNodes)
 	{
 		auto parentId = f.second.first;
-		auto & node = f.second.second;
+		const auto & node = f.second.second;
 		if (parentId < 0)
 		{
 			if (hasSetRoot)
@@ -1726,13 +2218,13 @@ void Database::loadFilterNodes(Filter & aFilter)
 		}
 		else
 		{
-			auto parentItr = nodes.find(parentId);
-			if (parentItr == nodes.end())
+			auto parentItr = aNodes.find(parentId);
+			if (parentItr == aNodes.end())
 			{
 				qWarning() << "Invalid filter node parent: " << parentId << " in rowid " << f.first;
 				continue;
 			}
-			auto & parent = parentItr->second.second;
+			const auto & parent = parentItr->second.second;
 			if (!parent->canHaveChildren())
 			{
 				qWarning() << "Bad filter node parent, cannot have child nodes: " << f.first;
@@ -1747,25 +2239,10 @@ void Database::loadFilterNodes(Filter & aFilter)
 
 
 
-FilterPtr Database::filterFromRowId(qlonglong aRowId)
-{
-	for (const auto & filter: mFilters)
-	{
-		if (filter->dbRowId() == aRowId)
-		{
-			return filter;
-		}
-	}
-	qDebug() << "Filter " << aRowId << " not found";
-	return nullptr;
-}
-
-
-
-
-
 void Database::loadTemplates()
 {
+	STOPWATCH("Loading templates from the DB");
+
 	// Initialize the query:
 	QSqlQuery query(mDatabase);
 	query.setForwardOnly(true);
@@ -1806,39 +2283,41 @@ void Database::loadTemplates()
 			tmpl->setBgColor(c);
 		}
 		mTemplates.push_back(tmpl);
-		loadTemplateItems(*tmpl);
 	}
+	loadTemplateItems();
 }
 
 
 
 
 
-void Database::loadTemplateItems(Template & aTemplate)
+void Database::loadTemplateItems()
 {
-	// Initialize the query:
+	// Initialize the query, loading the items of all templates at once:
 	QSqlQuery query(mDatabase);
 	query.setForwardOnly(true);
-	if (!query.prepare("SELECT * FROM TemplateItems WHERE TemplateID = ? ORDER BY IndexInTemplate ASC"))
+	if (!query.exec("SELECT TemplateID, FilterID FROM TemplateItems ORDER BY TemplateID ASC, IndexInTemplate ASC"))
 	{
-		qWarning() << "Cannot query template items from the DB, template "
-			<< aTemplate.displayName()
-			<< ", prep error: " << query.lastError();
+		qWarning() << "Cannot query template items from the DB: " << query.lastError();
 		assert(!"DB error");
 		return;
 	}
-	query.addBindValue(aTemplate.dbRowId());
-	if (!query.exec())
+	auto fiTemplateId = query.record().indexOf("TemplateID");
+	auto fiFilterId   = query.record().indexOf("FilterID");
+
+	// Index the templates and filters by their RowID:
+	std::map<qlonglong, TemplatePtr> templatesByRowId;
+	for (const auto & tmpl: mTemplates)
 	{
-		qWarning() << "Cannot query template items from the DB, template "
-			<< aTemplate.displayName()
-			<< ", exec error: " << query.lastError();
-		assert(!"DB error");
-		return;
+		templatesByRowId[tmpl->dbRowId()] = tmpl;
+	}
+	std::map<qlonglong, FilterPtr> filtersByRowId;
+	for (const auto & filter: mFilters)
+	{
+		filtersByRowId[filter->dbRowId()] = filter;
 	}
-	auto fiFilterId = query.record().indexOf("FilterID");
 
-	// Load each template:
+	// Load each item:
 	if (!query.isActive())
 	{
 		qWarning() << "Query not active";
@@ -1853,15 +2332,22 @@ void Database::loadTemplateItems(Template & aTemplate)
 	}
 	while (query.next())
 	{
+		auto templateId = query.value(fiTemplateId).toLongLong();
+		auto tmpl = templatesByRowId.find(templateId);
+		if (tmpl == templatesByRowId.end())
+		{
+			qDebug() << "Template item references non-existent template " << templateId << ", skipping.";
+			continue;
+		}
 		auto filterId = query.value(fiFilterId).toLongLong();
-		auto filter = filterFromRowId(filterId);
-		if (filter == nullptr)
+		auto filter = filtersByRowId.find(filterId);
+		if (filter == filtersByRowId.end())
 		{
-			qWarning() << "Template " << aTemplate.displayName() << " references non-existent filter "
+			qWarning() << "Template " << tmpl->second->displayName() << " references non-existent filter "
 				<< filterId << ", skipping.";
 			continue;
 		}
-		aTemplate.appendItem(filter);
+		tmpl->second->appendItem(filter->second);
 	}
 }
 
@@ -1987,27 +2473,25 @@ int Database::getSongWeight(const Song & aSong, const Playlist * aPlaylist) cons
 void Database::addVote(
 	const QByteArray & aSongHash,
 	int aVoteValue,
-	const QString & aTableName,
+	EStatement aInsertStatement,
+	EStatement aAvgStatement,
 	DatedOptional<double> Song::Rating::* aDstRating
 )
 {
-	qDebug() << "Adding community vote " << aVoteValue << " for " << aTableName << " to song " << aSongHash;
-
 	// Store the vote in the DB:
 	{
-		QSqlQuery query(mDatabase);
-		if (!query.prepare("INSERT INTO " + aTableName + " (SongHash, VoteValue, DateAdded) VALUES(?, ?, ?)"))
+		auto query = preparedQuery(aInsertStatement);
+		if (query == nullptr)
 		{
-			qWarning() << "Cannot prepare statement: " << query.lastError();
-			assert(!"DB error");
 			return;
 		}
-		query.addBindValue(aSongHash);
-		query.addBindValue(aVoteValue);
-		query.addBindValue(QDateTime::currentDateTimeUtc());
-		if (!query.exec())
+		qDebug() << "Adding community vote " << aVoteValue << " (" << query->lastQuery() << ") to song " << aSongHash;
+		query->addBindValue(aSongHash);
+		query->addBindValue(aVoteValue);
+		query->addBindValue(QDateTime::currentDateTimeUtc());
+		if (!query->exec())
 		{
-			qWarning() << "Cannot exec statement: " << query.lastError();
+			qWarning() << "Cannot exec statement: " << query->lastError();
 			assert(!"DB error");
 			return;
 		}
@@ -2017,27 +2501,26 @@ void Database::addVote(
 	auto sharedData = mSongSharedData.find(aSongHash);
 	if (sharedData != mSongSharedData.end())
 	{
-		QSqlQuery query(mDatabase);
-		if (!query.prepare("SELECT AVG(VoteValue) FROM " + aTableName + " WHERE SongHash = ?"))
+		auto query = preparedQuery(aAvgStatement);
+		if (query == nullptr)
 		{
-			qWarning() << "Cannot prepare statement: " << query.lastError();
-			assert(!"DB error");
 			return;
 		}
-		query.addBindValue(aSongHash);
-		if (!query.exec())
+		query->addBindValue(aSongHash);
+		if (!query->exec())
 		{
-			qWarning() << "Cannot exec statement: " << query.lastError();
+			qWarning() << "Cannot exec statement: " << query->lastError();
 			assert(!"DB error");
 			return;
 		}
-		if (!query.first())
+		if (!query->first())
 		{
-			qWarning() << "Cannot move to first value in statement: " << query.lastError();
+			qWarning() << "Cannot move to first value in statement: " << query->lastError();
 			assert(!"DB error");
 			return;
 		}
-		auto avg = query.value(0).toDouble();
+		auto avg = query->value(0).toDouble();
+		query->finish();  // Release the statement's read lock before it's reused
 		sharedData->second->mRating.*aDstRating = avg;
 		saveSongSharedData(sharedData->second);
 	}
@@ -2063,24 +2546,29 @@ void Database::songPlaybackStarted(SongPtr aSong)
 
 
 
-void Database::songHashCalculated(const QString & aFileName, const QByteArray & aHash, double aLength)
+void Database::songFileIngested(
+	const QString & aFileName,
+	const QByteArray & aHash,
+	double aLength,
+	bool aIsId3TagValid,
+	const MetadataScanner::Tag & aId3Tag,
+	const Song::FileFingerprint & aFingerprint
+)
 {
 	assert(!aFileName.isEmpty());
 	assert(!aHash.isEmpty());
 
 	// Insert the SharedData record, now that we know the song hash:
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("INSERT OR IGNORE INTO SongSharedData (Hash, Length) VALUES (?, ?)"))
+	auto query = preparedQuery(stInsertSongSharedData);
+	if (query == nullptr)
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.bindValue(0, aHash);
-	query.bindValue(1, aLength);
-	if (!query.exec())
+	query->bindValue(0, aHash);
+	query->bindValue(1, aLength);
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
@@ -2103,47 +2591,68 @@ void Database::songHashCalculated(const QString & aFileName, const QByteArray &
 	// Save into the DB:
 	{
 		SqlTransaction transaction(mDatabase);
-		QSqlQuery query(mDatabase);
-		if (!query.prepare("DELETE FROM NewFiles WHERE FileName = ?"))
+		auto query = preparedQuery(stDeleteNewFile);
+		if (query == nullptr)
 		{
-			qWarning() << "Cannot prepare statement: " << query.lastError();
-			assert(!"DB error");
 			return;
 		}
-		query.addBindValue(aFileName);
-		if (!query.exec())
+		query->addBindValue(aFileName);
+		if (!query->exec())
 		{
-			qWarning() << "Cannot exec statement: " << query.lastError();
+			qWarning() << "Cannot exec statement: " << query->lastError();
 			assert(!"DB error");
 			return;
 		}
-		query.finish();
-		query.clear();
 
-		if (!query.prepare("INSERT OR IGNORE INTO SongFiles (FileName, Hash) VALUES (?, ?)"))
+		query = preparedQuery(stInsertSongFile);
+		if (query == nullptr)
 		{
-			qWarning() << "Cannot prepare statement: " << query.lastError();
-			assert(!"DB error");
 			return;
 		}
-		query.addBindValue(aFileName);
-		query.addBindValue(aHash);
-		if (!query.exec())
+		query->addBindValue(aFileName);
+		query->addBindValue(aHash);
+		addFingerprintBindValues(*query, aFingerprint);
+		if (!query->exec())
 		{
-			qWarning() << "Cannot exec statement: " << query.lastError();
+			qWarning() << "Cannot exec statement: " << query->lastError();
 			assert(!"DB error");
 			return;
 		}
 		transaction.commit();
 	}
 
+	// A known file, either changed on the disk (quickRescanFile()) or queued more than once:
+	auto existingSong = songFromFileName(aFileName);
+	if (existingSong != nullptr)
+	{
+		if ((existingSong->sharedData() == sharedData) && existingSong->fileFingerprint().matches(aFingerprint))
+		{
+			qDebug() << "Song file " << aFileName << " has already been added, skipping";
+			return;
+		}
+		if (existingSong->sharedData() != sharedData)
+		{
+			qDebug() << "Song file " << aFileName << " has new contents, rebinding to the new hash";
+			existingSong->setSharedData(sharedData);
+		}
+		setSongFileFingerprint(existingSong, aFingerprint);
+		mComponents.get<MetadataScanner>()->scanSongWithId3Tag(existingSong, std::make_pair(aIsId3TagValid, aId3Tag));
+		saveSongFileData(existingSong);
+		emit songSaved(existingSong);
+		return;
+	}
+
 	// Create the Song object:
 	auto song = std::make_shared<Song>(aFileName, sharedData);
+	song->setFileFingerprint(aFingerprint);
 	mSongs.push_back(song);
-	emit songFileAdded(song);
+	mSongsByFileName.insert(aFileName, song);
+	indexSongFingerprint(song);
 
-	// We finally have the hash, we can scan for tags and other metadata:
-	emit needSongTagRescan(song);
+	// The tag was read together with the hash, set it into the song without reading the file again:
+	// (Before emitting songFileAdded, so that the background tempo detection already knows the genre)
+	mComponents.get<MetadataScanner>()->scanSongWithId3Tag(song, std::make_pair(aIsId3TagValid, aId3Tag));
+	emit songFileAdded(song);
 }
 
 
@@ -2152,17 +2661,15 @@ void Database::songHashCalculated(const QString & aFileName, const QByteArray &
 
 void Database::songHashFailed(const QString & aFileName)
 {
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("DELETE FROM NewFiles WHERE FileName = ?"))
+	auto query = preparedQuery(stDeleteNewFile);
+	if (query == nullptr)
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.addBindValue(aFileName);
-	if (!query.exec())
+	query->addBindValue(aFileName);
+	if (!query->exec())
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
+		qWarning() << "Cannot exec statement: " << query->lastError();
 		assert(!"DB error");
 		return;
 	}
@@ -2201,104 +2708,155 @@ void Database::saveSong(SongPtr aSong)
 
 void Database::saveSongFileData(SongPtr aSong)
 {
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("UPDATE SongFiles SET "
-		"Hash = ?, "
-		"FileNameAuthor = ?, FileNameTitle = ?, FileNameGenre = ?, FileNameMeasuresPerMinute = ?,"
-		"ID3Author = ?, ID3Title = ?, ID3Genre = ?, ID3MeasuresPerMinute = ?,"
-		"LastTagRescanned = ?,"
-		"NumTagRescanAttempts = ? "
-		"WHERE FileName = ?")
-	)
+	mDirtySongFiles.insert(aSong);
+	scheduleFlush();
+}
+
+
+
+
+
+void Database::saveSongSharedData(Song::SharedDataPtr aSharedData)
+{
+	mDirtySharedData.insert(aSharedData);
+	scheduleFlush();
+}
+
+
+
+
+
+void Database::flush()
+{
+	if (mDirtySongFiles.empty() && mDirtySharedData.empty() && mPendingPlaybackHistory.empty())
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
 		return;
 	}
-	query.addBindValue(aSong->hash());
-	query.addBindValue(aSong->tagFileName().mAuthor.toVariant());
-	query.addBindValue(aSong->tagFileName().mTitle.toVariant());
-	query.addBindValue(aSong->tagFileName().mGenre.toVariant());
-	query.addBindValue(aSong->tagFileName().mMeasuresPerMinute.toVariant());
-	query.addBindValue(aSong->tagId3().mAuthor.toVariant());
-	query.addBindValue(aSong->tagId3().mTitle.toVariant());
-	query.addBindValue(aSong->tagId3().mGenre.toVariant());
-	query.addBindValue(aSong->tagId3().mMeasuresPerMinute.toVariant());
-	query.addBindValue(aSong->lastTagRescanned());
-	query.addBindValue(aSong->numTagRescanAttempts());
-	query.addBindValue(aSong->fileName());
-	if (!query.exec())
+	mFlushTimer.stop();
+
+	SqlTransaction transaction(mDatabase);
+	for (const auto & song: mDirtySongFiles)
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
-		assert(!"DB error");
-		return;
+		writeSongFileData(*song);
+	}
+	for (const auto & sd: mDirtySharedData)
+	{
+		writeSongSharedData(*sd);
 	}
+	addPlaybackHistory(mPendingPlaybackHistory);
+	transaction.commit();
+
+	// Only forget the changes once they are committed, so that they are retried upon a failure:
+	mDirtySongFiles.clear();
+	mDirtySharedData.clear();
+	mPendingPlaybackHistory.clear();
 }
 
 
 
 
 
-void Database::saveSongSharedData(Song::SharedDataPtr aSharedData)
+void Database::scheduleFlush()
 {
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("UPDATE SongSharedData SET "
-		"Length = ?, LastPlayed = ?, LastPlayedLM = ?, "
-		"LocalRating = ?, LocalRatingLM = ?,"
-		"RatingRhythmClarity = ?,   RatingRhythmClarityLM = ?, "
-		"RatingGenreTypicality = ?, RatingGenreTypicalityLM = ?, "
-		"RatingPopularity = ?,      RatingPopularityLM = ?, "
-		"ManualAuthor = ?, ManualAuthorLM = ?,"
-		"ManualTitle = ?, ManualTitleLM = ?,"
-		"ManualGenre = ?, ManualGenreLM = ?,"
-		"ManualMeasuresPerMinute = ?, ManualMeasuresPerMinuteLM = ?,"
-		"SkipStart = ?, SkipStartLM = ?, "
-		"Notes = ?, NotesLM = ?, "
-		"BgColor = ?, BgColorLM = ?, "
-		"DetectedTempo = ?, DetectedTempoLM = ? "
-		"WHERE Hash = ?")
-	)
+	if (!mFlushTimer.isActive())
 	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
-		return;
+		mFlushTimer.start(FLUSH_DELAY_MSEC);
 	}
-	query.addBindValue(aSharedData->mLength.toVariant());
-	query.addBindValue(aSharedData->mLastPlayed.toVariant());
-	query.addBindValue(aSharedData->mLastPlayed.lastModification());
-	query.addBindValue(aSharedData->mRating.mLocal.toVariant());
-	query.addBindValue(aSharedData->mRating.mLocal.lastModification());
-	query.addBindValue(aSharedData->mRating.mRhythmClarity.toVariant());
-	query.addBindValue(aSharedData->mRating.mRhythmClarity.lastModification());
-	query.addBindValue(aSharedData->mRating.mGenreTypicality.toVariant());
-	query.addBindValue(aSharedData->mRating.mGenreTypicality.lastModification());
-	query.addBindValue(aSharedData->mRating.mPopularity.toVariant());
-	query.addBindValue(aSharedData->mRating.mPopularity.lastModification());
-	query.addBindValue(aSharedData->mTagManual.mAuthor.toVariant());
-	query.addBindValue(aSharedData->mTagManual.mAuthor.lastModification());
-	query.addBindValue(aSharedData->mTagManual.mTitle.toVariant());
-	query.addBindValue(aSharedData->mTagManual.mTitle.lastModification());
-	query.addBindValue(aSharedData->mTagManual.mGenre.toVariant());
-	query.addBindValue(aSharedData->mTagManual.mGenre.lastModification());
-	query.addBindValue(aSharedData->mTagManual.mMeasuresPerMinute.toVariant());
-	query.addBindValue(aSharedData->mTagManual.mMeasuresPerMinute.lastModification());
-	query.addBindValue(aSharedData->mSkipStart.toVariant());
-	query.addBindValue(aSharedData->mSkipStart.lastModification());
-	query.addBindValue(aSharedData->mNotes.toVariant());
-	query.addBindValue(aSharedData->mNotes.lastModification());
-	query.addBindValue(aSharedData->mBgColor.toVariant());
-	query.addBindValue(aSharedData->mBgColor.lastModification());
-	query.addBindValue(aSharedData->mDetectedTempo.toVariant());
-	query.addBindValue(aSharedData->mDetectedTempo.lastModification());
-	query.addBindValue(aSharedData->mHash);
-	if (!query.exec())
+}
+
+
+
+
+
+void Database::flushTimerExpired()
+{
+	try
 	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
-		assert(!"DB error");
-		return;
+		flush();
 	}
-	if (query.numRowsAffected() != 1)
+	catch (const std::exception & exc)
 	{
+		qWarning() << "Cannot write the pending changes to the DB, will retry later: " << exc.what();
+		scheduleFlush();
+	}
+}
+
+
+
+
+
+void Database::writeSongFileData(const Song & aSong)
+{
+	auto query = preparedQuery(stUpdateSongFile);
+	if (query == nullptr)
+	{
+		throw RuntimeError("Cannot prepare the SongFiles update statement");
+	}
+	query->addBindValue(aSong.hash());
+	query->addBindValue(aSong.tagFileName().mAuthor.toVariant());
+	query->addBindValue(aSong.tagFileName().mTitle.toVariant());
+	query->addBindValue(aSong.tagFileName().mGenre.toVariant());
+	query->addBindValue(aSong.tagFileName().mMeasuresPerMinute.toVariant());
+	query->addBindValue(aSong.tagId3().mAuthor.toVariant());
+	query->addBindValue(aSong.tagId3().mTitle.toVariant());
+	query->addBindValue(aSong.tagId3().mGenre.toVariant());
+	query->addBindValue(aSong.tagId3().mMeasuresPerMinute.toVariant());
+	query->addBindValue(aSong.lastTagRescanned());
+	query->addBindValue(aSong.numTagRescanAttempts());
+	addFingerprintBindValues(*query, aSong.fileFingerprint());
+	query->addBindValue(aSong.fileName());
+	if (!query->exec())
+	{
+		throw RuntimeError("Cannot update the SongFiles row for %1: %2", aSong.fileName(), query->lastError());
+	}
+}
+
+
+
+
+
+void Database::writeSongSharedData(const Song::SharedData & aSharedData)
+{
+	auto query = preparedQuery(stUpdateSongSharedData);
+	if (query == nullptr)
+	{
+		throw RuntimeError("Cannot prepare the SongSharedData update statement");
+	}
+	query->addBindValue(aSharedData.mLength.toVariant());
+	query->addBindValue(aSharedData.mLastPlayed.toVariant());
+	query->addBindValue(aSharedData.mLastPlayed.lastModification());
+	query->addBindValue(aSharedData.mRating.mLocal.toVariant());
+	query->addBindValue(aSharedData.mRating.mLocal.lastModification());
+	query->addBindValue(aSharedData.mRating.mRhythmClarity.toVariant());
+	query->addBindValue(aSharedData.mRating.mRhythmClarity.lastModification());
+	query->addBindValue(aSharedData.mRating.mGenreTypicality.toVariant());
+	query->addBindValue(aSharedData.mRating.mGenreTypicality.lastModification());
+	query->addBindValue(aSharedData.mRating.mPopularity.toVariant());
+	query->addBindValue(aSharedData.mRating.mPopularity.lastModification());
+	query->addBindValue(aSharedData.mTagManual.mAuthor.toVariant());
+	query->addBindValue(aSharedData.mTagManual.mAuthor.lastModification());
+	query->addBindValue(aSharedData.mTagManual.mTitle.toVariant());
+	query->addBindValue(aSharedData.mTagManual.mTitle.lastModification());
+	query->addBindValue(aSharedData.mTagManual.mGenre.toVariant());
+	query->addBindValue(aSharedData.mTagManual.mGenre.lastModification());
+	query->addBindValue(aSharedData.mTagManual.mMeasuresPerMinute.toVariant());
+	query->addBindValue(aSharedData.mTagManual.mMeasuresPerMinute.lastModification());
+	query->addBindValue(aSharedData.mSkipStart.toVariant());
+	query->addBindValue(aSharedData.mSkipStart.lastModification());
+	query->addBindValue(aSharedData.mNotes.toVariant());
+	query->addBindValue(aSharedData.mNotes.lastModification());
+	query->addBindValue(aSharedData.mBgColor.toVariant());
+	query->addBindValue(aSharedData.mBgColor.lastModification());
+	query->addBindValue(aSharedData.mDetectedTempo.toVariant());
+	query->addBindValue(aSharedData.mDetectedTempo.lastModification());
+	query->addBindValue(aSharedData.mHash);
+	if (!query->exec())
+	{
+		throw RuntimeError("Cannot update the SongSharedData row for %1: %2", aSharedData.mHash, query->lastError());
+	}
+	if (query->numRowsAffected() != 1)
+	{
+		// Not a transient error, retrying won't help; only log it
 		qWarning() << "SongSharedData update failed, no such hash row";
 		assert(!"DB_error");
 		return;
@@ -2321,7 +2879,7 @@ void Database::songScanned(SongPtr aSong)
 
 void Database::addVoteRhythmClarity(QByteArray aSongHash, int aVoteValue)
 {
-	addVote(aSongHash, aVoteValue, "VotesRhythmClarity", &Song::Rating::mRhythmClarity);
+	addVote(aSongHash, aVoteValue, stInsertVoteRhythmClarity, stAvgVoteRhythmClarity, &Song::Rating::mRhythmClarity);
 }
 
 
@@ -2330,7 +2888,7 @@ void Database::addVoteRhythmClarity(QByteArray aSongHash, int aVoteValue)
 
 void Database::addVoteGenreTypicality(QByteArray aSongHash, int aVoteValue)
 {
-	addVote(aSongHash, aVoteValue, "VotesGenreTypicality", &Song::Rating::mGenreTypicality);
+	addVote(aSongHash, aVoteValue, stInsertVoteGenreTypicality, stAvgVoteGenreTypicality, &Song::Rating::mGenreTypicality);
 }
 
 
@@ -2339,7 +2897,7 @@ void Database::addVoteGenreTypicality(QByteArray aSongHash, int aVoteValue)
 
 void Database::addVotePopularity(QByteArray aSongHash, int aVoteValue)
 {
-	addVote(aSongHash, aVoteValue, "VotesPopularity", &Song::Rating::mPopularity);
+	addVote(aSongHash, aVoteValue, stInsertVotePopularity, stAvgVotePopularity, &Song::Rating::mPopularity);
 }
 
 
@@ -2348,20 +2906,6 @@ void Database::addVotePopularity(QByteArray aSongHash, int aVoteValue)
 
 void Database::addPlaybackHistory(SongPtr aSong, const QDateTime & aTimestamp)
 {
-	// Add a history playlist record:
-	QSqlQuery query(mDatabase);
-	if (!query.prepare("INSERT INTO PlaybackHistory (SongHash, Timestamp) VALUES (?, ?)"))
-	{
-		qWarning() << "Cannot prepare statement: " << query.lastError();
-		assert(!"DB error");
-		return;
-	}
-	query.bindValue(0, aSong->hash());
-	query.bindValue(1, aTimestamp);
-	if (!query.exec())
-	{
-		qWarning() << "Cannot exec statement: " << query.lastError();
-		assert(!"DB error");
-		return;
-	}
+	mPendingPlaybackHistory.push_back({aTimestamp, aSong->hash()});
+	scheduleFlush();
 }
@@ -2,13 +2,19 @@
 
 #include <vector>
 #include <memory>
+#include <set>
+#include <map>
 #include <QObject>
+#include <QTimer>
+#include <QHash>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include "../Song.hpp"
 #include "../Template.hpp"
 #include "../Filter.hpp"
 #include "../ComponentCollection.hpp"
+#include "../MetadataScanner.hpp"
+#include "../LibraryCrawler.hpp"
 
 
 
@@ -16,6 +22,12 @@
 
 /** The storage for all data that is persisted across sessions.
 Stores the song library, the shared song data, the templates and playback history.
+The frequent song updates (saveSongFileData(), saveSongSharedData(), playback history) are write-behind:
+they only mark the data as dirty, and all the dirty data is written in a single transaction shortly afterwards,
+or upon an explicit flush() call, or upon destruction. Repeated updates of the same song are coalesced.
+The statements executed often are prepared only once and then reused (preparedQuery()).
+Upon a clean shutdown (close()), the in-memory data is written into a binary snapshot next to the DB file,
+so that the next open() can load it instead of reading all the SQL tables, if the DB file hasn't changed since.
 Note that all DB-access functions are not thread-safe. */
 class Database:
 	public QObject,
@@ -57,24 +69,51 @@ public:
 
 	Database(ComponentCollection & aComponents);
 
+	/** Writes all the pending changes to the DB (flush()) and checkpoints the WAL journal into the DB file. */
+	virtual ~Database();
+
 	/** Opens the specified SQLite file and reads its contents into this object.
+	The songs, filters and templates are loaded from the DB's snapshot, if it is still valid (DatabaseSnapshot),
+	otherwise from the SQL tables.
 	Keeps the DB open for subsequent immediate updates.
 	Only one DB can ever be open. */
 	void open(const QString & aDBFileName);
 
+	/** Writes all the pending changes, closes the DB and writes the snapshot of the loaded data next to the DB file.
+	To be called upon a clean shutdown, after all the background tasks have been stopped; no further changes
+	may be made to the DB afterwards.
+	Throws a RuntimeError if the pending changes cannot be written. */
+	void close();
+
+	/** Writes all the pending changes (dirty songs, shared data and playback history) into the DB,
+	in a single transaction, so that the DB always contains either all or none of them.
+	If the transaction fails, the changes are kept pending and a RuntimeError is thrown.
+	Not a slot, the exception mustn't escape into the Qt event loop; the timer uses flushTimerExpired(). */
+	void flush();
+
 	/** Returns all songs currently known in the DB. */
 	const std::vector<SongPtr> & songs() const { return mSongs; }
 
-	/** Adds the specified files to the new files list.
+	/** Adds the specified files to the new files list, in a single DB transaction.
 	Schedules the hash to be calculated; once calculated, the song will be added to mSongs.
 	Skips duplicate entries. */
 	void addSongFiles(const QStringList & aFiles);
 
+	/** Quick-rescans the specified files, found by LibraryCrawler, in a single DB transaction.
+	Uses the file fingerprints to avoid hashing the known files again (quickRescanFile()).
+	Connected to LibraryCrawler::filesFound(). */
+	void addFoundFiles(const LibraryCrawler::FoundFiles & aFiles);
+
 	/** Adds the specified file to the new files list.
 	Schedules the hash to be calculated; once calculated, the song will be added to mSongs.
 	Skips duplicate entries. */
 	void addSongFile(const QString & aFileName);
 
+	/** Removes the songs for the specified files, if the files no longer exist.
+	Files that are not in the library, or that exist again, are skipped.
+	Connected to LibraryWatcher::filesRemoved(). */
+	void removeMissingSongFiles(const QStringList & aFileNames);
+
 	/** Removes the specified song from the song list.
 	If aDeleteDiskFile is true, also deletes the song file from the disk.
 	Assumes (asserts) that the song is contained within this DB.
@@ -86,7 +125,7 @@ public:
 	Returns nullptr if there is no such song. */
 	SongPtr songFromHash(const QByteArray & aSongHash);
 
-	/** Returns the song with the specified filename.
+	/** Returns the song with the specified filename, using the filename index.
 	Returns nullptr if there is no such song. */
 	SongPtr songFromFileName(const QString aSongFileName);
 
@@ -184,12 +223,13 @@ public:
 	/** Returns a map of all SongHash -> SongSharedData in the DB. */
 	const std::map<QByteArray, Song::SharedDataPtr> & songSharedDataMap() const { return mSongSharedData; }
 
-	/** Returns the entire playback history.
+	/** Returns the entire playback history, including the items not yet written to the DB.
 	Returns by-value, since the history is not normally kept in memory, so it needs to be read from DB in this call. */
 	std::vector<HistoryItem> playbackHistory() const;
 
-	/** Adds the items in aHistory to the playback history.
-	Used primarily by the import. */
+	/** Adds the items in aHistory to the playback history, immediately.
+	Used primarily by the import.
+	Throws a RuntimeError if the items cannot be written (so that the enclosing transaction is rolled back). */
 	void addPlaybackHistory(const std::vector<HistoryItem> & aHistory);
 
 	/** Adds the items in aHistory to the song removal history in the DB.
@@ -215,6 +255,7 @@ public:
 	void addToSharedDataManualTags(const std::map<QByteArray /* hash */, Song::Tag> & aTags);
 
 	/** Renames the file represented by the specified song, and updates the song to point to the new file.
+	Updates the filename index.
 	Doesn't update the filename-based tag in the song.
 	Doesn't save the song yet.
 	Returns true if the renaming succeeds, false on failure. */
@@ -224,6 +265,29 @@ public:
 protected:
 
 	friend class DatabaseUpgrade;
+	friend class DatabaseSnapshot;
+
+
+	/** Identifiers of the statements that are cached in mPreparedQueries. */
+	enum EStatement
+	{
+		stInsertNewFile,
+		stDeleteNewFile,
+		stInsertSongFile,
+		stUpdateSongFile,
+		stUpdateSongFileName,
+		stInsertSongSharedData,
+		stUpdateSongSharedData,
+		stInsertPlaybackHistory,
+		stUpdateTemplatePosition,
+		stUpdateFilterPosition,
+		stInsertVoteRhythmClarity,
+		stInsertVoteGenreTypicality,
+		stInsertVotePopularity,
+		stAvgVoteRhythmClarity,
+		stAvgVoteGenreTypicality,
+		stAvgVotePopularity,
+	};
 
 
 	/** The components of the entire program. */
@@ -232,9 +296,22 @@ protected:
 	/** The DB connection .*/
 	QSqlDatabase mDatabase;
 
+	/** The statements that have already been prepared on mDatabase, for reuse (preparedQuery()).
+	Declared after mDatabase, so that the statements are finalized before the connection is destroyed. */
+	std::map<EStatement, std::unique_ptr<QSqlQuery>> mPreparedQueries;
+
 	/** All the known songs. */
 	std::vector<SongPtr> mSongs;
 
+	/** Index of mSongs by their file name, for fast lookups (songFromFileName()).
+	Needs to be kept in sync with mSongs whenever a song is added, removed or its file renamed. */
+	QHash<QString, SongPtr> mSongsByFileName;
+
+	/** Index of mSongs by their file fingerprint's size and modification time, for finding moved files
+	(movedSongFromFingerprint()). Only songs with a valid fingerprint are indexed.
+	Needs to be kept in sync with mSongs whenever a song is added, removed or its fingerprint changed. */
+	QMultiHash<QPair<qint64, qint64>, SongPtr> mSongsByFingerprint;
+
 	/** The data shared among songs with equal hash. */
 	std::map<QByteArray, Song::SharedDataPtr> mSongSharedData;
 
@@ -244,6 +321,30 @@ protected:
 	/** All the templates that can be used for filling the playlist. */
 	std::vector<TemplatePtr> mTemplates;
 
+	/** The songs whose file data has changed since the last flush(). */
+	std::set<SongPtr> mDirtySongFiles;
+
+	/** The shared data that has changed since the last flush(). */
+	std::set<Song::SharedDataPtr> mDirtySharedData;
+
+	/** The playback history items added since the last flush(). */
+	std::vector<HistoryItem> mPendingPlaybackHistory;
+
+	/** Triggers the flush() shortly after the first change since the last flush. */
+	QTimer mFlushTimer;
+
+
+	/** Sets the journal mode, synchronous mode, memory mapping and cache size of the DB connection.
+	Each of the values can be overridden in the Settings ("Database" group). */
+	void applyPragmas();
+
+	/** Returns the query for the specified statement, prepared on mDatabase.
+	The statement is prepared upon first use and then reused, only the values need to be bound for each execution.
+	Returns nullptr (and logs) if the statement cannot be prepared. */
+	QSqlQuery * preparedQuery(EStatement aStatement);
+
+	/** Moves all the changes from the WAL journal into the DB file, so that the file alone is complete. */
+	void checkpointJournal();
 
 	/** Loads all the songs in the DB into mSongs.
 	Note that songs are not checked whether they exists on the disk or if their hash still fits.
@@ -260,23 +361,34 @@ protected:
 	/** The new files stored in the DB are enqueued for hash calculation. */
 	void loadNewFiles();
 
+	/** Enqueues the processing still missing for the loaded songs: the hash calculation of the song files
+	without a hash, the tag rescan and the length calculation.
+	Used after the songs have been loaded from the snapshot, since it contains only the songs with a hash. */
+	void enqueueSnapshotSongsProcessing();
+
+	/** Emits needSongLength() for all the loaded shared data with unknown length (#141). */
+	void enqueueSongsWithoutLength();
+
 	/** Loads all the filters in the DB into mFilters. */
 	void loadFilters();
 
-	/** Loads the nodes belonging to the specified filter. */
-	void loadFilterNodes(Filter & aFilter);
+	/** Loads the nodes of all the filters in mFilters, using a single query. */
+	void loadFilterNodes();
 
-	/** Returns the filter corresponding to the specified DB RowId.
-	Returns nullptr if no such filter. */
-	FilterPtr filterFromRowId(qlonglong aRowId);
+	/** Builds the node tree of the specified filter out of its loaded nodes, NodeRowID -> (ParentRowID, Node).
+	The node without a parent is set as the filter's root node. */
+	void assignFilterNodes(
+		Filter & aFilter,
+		const std::map<qlonglong, std::pair<qlonglong, Filter::NodePtr>> & aNodes
+	);
 
 	/** Loads all the templates in the DB into mTemplates. */
 	void loadTemplates();
 
-	/** Loads the specified template from the DB.
-	The template has its direct members initialized, this loads its items, matching from the available mFilters.
+	/** Loads the items of all the templates in mTemplates, using a single query.
+	The templates have their direct members initialized, this loads their items, matching from the available mFilters.
 	If any filter is not found, the item is skipped. */
-	void loadTemplateItems(Template & aTemplate);
+	void loadTemplateItems();
 
 	/** Recursively saves (inserts) the node subtree from aNode.
 	aFilterRowId is the RowID of the filter to which the node belongs
@@ -287,6 +399,43 @@ protected:
 		qlonglong aParentNodeRowId
 	);
 
+	/** Processes a single file found by a library rescan, based on its fingerprint:
+	A known file that is unchanged is skipped. A known file that has changed is hashed again (songFileIngested()
+	then rebinds it to the new hash, rescans its tags and stores the new fingerprint).
+	An unknown file that matches the fingerprint of a song whose file no longer exists is considered moved,
+	the song is updated to point to the new file (moveSongFile()), without hashing.
+	All other files are added as new files (addSongFile()). */
+	void quickRescanFile(const QString & aFileName, const Song::FileFingerprint & aFingerprint);
+
+	/** Returns the song whose stored fingerprint matches the specified fingerprint and whose file no longer exists.
+	Returns nullptr if there is no such song. */
+	SongPtr movedSongFromFingerprint(const Song::FileFingerprint & aFingerprint);
+
+	/** Adds the song into mSongsByFingerprint, if its fingerprint is valid. */
+	void indexSongFingerprint(const SongPtr & aSong);
+
+	/** Removes the song from mSongsByFingerprint. */
+	void unindexSongFingerprint(const SongPtr & aSong);
+
+	/** Sets the new fingerprint to the song, keeping mSongsByFingerprint in sync. */
+	void setSongFileFingerprint(const SongPtr & aSong, const Song::FileFingerprint & aFingerprint);
+
+	/** Updates the song, whose file has been moved on the disk, to point to the new file.
+	Updates the file name in the DB, as well as the filename-based tag, and saves the song. */
+	void moveSongFile(SongPtr aSong, const QString & aNewFileName);
+
+	/** Starts the flush timer, unless already started.
+	Called after marking any data dirty. */
+	void scheduleFlush();
+
+	/** Writes the song's file-related data into the DB, immediately.
+	Throws a RuntimeError upon a DB error, so that flush() rolls back and keeps the changes pending. */
+	void writeSongFileData(const Song & aSong);
+
+	/** Writes the shared data into the SongSharedData DB table, immediately.
+	Throws a RuntimeError upon a DB error, so that flush() rolls back and keeps the changes pending. */
+	void writeSongSharedData(const Song::SharedData & aSharedData);
+
 	/** Returns the internal Qt DB object.
 	Only used in the DatabaseUpgrade class. */
 	QSqlDatabase & database() { return mDatabase; }
@@ -296,10 +445,13 @@ protected:
 	If aPlaylist is given, songs on the playlist are further reduced. */
 	int getSongWeight(const Song & aSong, const Playlist * aPlaylist = nullptr) const;
 
+	/** Stores a new community vote for the song hash into the DB, using the specified INSERT statement.
+	Updates the aggregated rating, calculated by the specified AVG statement, in the song's SharedData. */
 	void addVote(
 		const QByteArray & aSongHash,
 		int aVoteValue,
-		const QString & aTableName,
+		EStatement aInsertStatement,
+		EStatement aAvgStatement,
 		DatedOptional<double> Song::Rating::* aDstRating
 	);
 
@@ -323,7 +475,7 @@ signals:
 	void needSongLength(Song::SharedDataPtr aSongSharedData);
 
 	/** Emitted when encountering a song with hash but without tag in the DB.
-	This can happen either at DB load time (open()), or when adding new songs (songHashCalculated()). */
+	This can happen at DB load time (open()); new songs get their tag together with the hash (songFileIngested()). */
 	void needSongTagRescan(SongPtr aSong);
 
 	/** Emitted after a song was saved, presumably because its data had changed.
@@ -336,11 +488,20 @@ public slots:
 	/** Indicates that the song has started playing and the DB should store that info. */
 	void songPlaybackStarted(SongPtr aSong);
 
-	/** To be called when the song hash and length has been calculated.
+	/** To be called when a new song file has been ingested (hash, length and ID3 tag read).
 	Moves the song from NewFiles to SongFiles, creates an in-memory Song object for the file.
 	Prepares a row for the song hash in the SharedData table, or assigns an existing row to this song.
+	Sets the song's tags from aId3Tag and the file name, using MetadataScanner, without accessing the file again.
+	Stores aFingerprint for the future quick rescans.
 	Emits the songFileAdded signal. */
-	void songHashCalculated(const QString & aFileName, const QByteArray & aHash, double aLength);
+	void songFileIngested(
+		const QString & aFileName,
+		const QByteArray & aHash,
+		double aLength,
+		bool aIsId3TagValid,
+		const MetadataScanner::Tag & aId3Tag,
+		const Song::FileFingerprint & aFingerprint
+	);
 
 	/** To be called when the hash calculation fails.
 	Removes the specified file from the DB table of new files. */
@@ -353,10 +514,10 @@ public slots:
 	Assumes (doesn't check) that the song is contained within this DB. */
 	void saveSong(SongPtr aSong);
 
-	/** Updates the song's file-related data in the DB. */
+	/** Marks the song's file-related data for updating in the DB (write-behind, see flush()). */
 	void saveSongFileData(SongPtr aSong);
 
-	/** Updates the song's shared data in the SongSharedData DB table. */
+	/** Marks the song's shared data for updating in the SongSharedData DB table (write-behind, see flush()). */
 	void saveSongSharedData(Song::SharedDataPtr aSharedData);
 
 	/** Emitted by mMetadataScanner after metadata is updated for the specified song.
@@ -378,7 +539,11 @@ public slots:
 
 protected slots:
 
-	/** Adds a new entry into the playback history in the DB. */
+	/** Adds a new entry into the playback history (write-behind, see flush()). */
 	void addPlaybackHistory(SongPtr aSong, const QDateTime & aTimestamp);
 
+	/** Called by mFlushTimer, flushes the pending changes.
+	If the flush fails, logs and retries later. */
+	void flushTimerExpired();
+
 };
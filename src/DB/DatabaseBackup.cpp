@@ -37,7 +37,7 @@ void DatabaseBackup::dailyBackupOnStartup(
 	{
 		throw RuntimeError(tr("Cannot create folder for daily backups: %1"), fi.absolutePath());
 	}
-	if (!QFile::copy(aDBFileName, dstFileName))
+	if (!copyDBFile(aDBFileName, dstFileName))
 	{
 		throw RuntimeError(tr("Cannot create a daily DB backup %1"), dstFileName);
 	}
@@ -70,9 +70,33 @@ void DatabaseBackup::backupBeforeUpgrade(
 	{
 		throw RuntimeError(tr("Cannot create the folder for the pre-upgrade backup: %1"), fi.absolutePath());
 	}
-	if (!QFile::copy(aDBFileName, dstFileName))
+	if (!copyDBFile(aDBFileName, dstFileName))
 	{
 		throw RuntimeError(tr("Cannot create the pre-upgrade DB backup %1"), dstFileName);
 	}
 	qDebug() << "Pre-upgrade backup created: " << dstFileName;
 }
+
+
+
+
+
+bool DatabaseBackup::copyDBFile(const QString & aSrcFileName, const QString & aDstFileName)
+{
+	if (!QFile::copy(aSrcFileName, aDstFileName))
+	{
+		return false;
+	}
+
+	// If the DB wasn't closed properly, its latest changes may still be only in the WAL journal, copy it as well:
+	auto srcWalFileName = aSrcFileName + "-wal";
+	if (QFile::exists(srcWalFileName))
+	{
+		if (!QFile::copy(srcWalFileName, aDstFileName + "-wal"))
+		{
+			QFile::remove(aDstFileName);
+			return false;
+		}
+	}
+	return true;
+}
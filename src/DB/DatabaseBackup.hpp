@@ -31,4 +31,11 @@ public:
 		size_t aCurrentVersion,
 		const QString & aBackupFolder
 	);
+
+
+protected:
+
+	/** Copies the DB file, together with its WAL journal, if present.
+	Returns true on success, false on failure. */
+	static bool copyDBFile(const QString & aSrcFileName, const QString & aDstFileName);
 };
@@ -1,4 +1,5 @@
 #include "DatabaseImport.hpp"
+#include <QDebug>
 #include "Database.hpp"
 
 
@@ -156,7 +157,7 @@ void DatabaseImport::importPlaybackHistory()
 	}
 	if (toHistory.empty())
 	{
-		mTo.addPlaybackHistory(fromHistory);
+		addPlaybackHistory(fromHistory);
 		return;
 	}
 
@@ -205,7 +206,23 @@ void DatabaseImport::importPlaybackHistory()
 			toAdd.push_back(*itrF);
 		}
 	}
-	mTo.addPlaybackHistory(toAdd);
+	addPlaybackHistory(toAdd);
+}
+
+
+
+
+
+void DatabaseImport::addPlaybackHistory(const std::vector<Database::HistoryItem> & aHistory)
+{
+	try
+	{
+		mTo.addPlaybackHistory(aHistory);
+	}
+	catch (const std::exception & exc)
+	{
+		qWarning() << "Cannot import the playback history: " << exc.what();
+	}
 }
 
 
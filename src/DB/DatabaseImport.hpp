@@ -52,6 +52,9 @@ private:
 	void importDeletionHistory();
 	void importSongColors();
 
+	/** Adds the items to the playback history in mTo. A DB error is only logged, the rest of the import goes on. */
+	void addPlaybackHistory(const std::vector<Database::HistoryItem> & aHistory);
+
 	/** Imports the votes from aFrom to aTo, regarding the specified votes DB table. */
 	void importVotes(const QString & aTableName);
 
@@ -0,0 +1,537 @@
+#include "DatabaseSnapshot.hpp"
+#include <cassert>
+#include <limits>
+#include <map>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include "../Stopwatch.hpp"
+#include "../Exception.hpp"
+#include "Database.hpp"
+#include "DatabaseUpgrade.hpp"
+
+
+
+
+
+/** The magic bytes at the start of each snapshot file. */
+static const QByteArray SNAPSHOT_MAGIC("SkTnSnap");
+
+/** The version of the snapshot format.
+Needs to be incremented whenever the serialized data changes, so that the older snapshots are ignored. */
+static const quint32 SNAPSHOT_FORMAT_VERSION = 1;
+
+/** The QDataStream version used for serializing the values, fixed so that Qt upgrades don't change the format. */
+static const int STREAM_VERSION = QDataStream::Qt_5_6;
+
+/** The size of the snapshot header, preceding the payload, in bytes:
+magic, format version, DB version, stamp (change counter, size, modified), payload size, payload SHA-1. */
+static const qint64 HEADER_SIZE = 8 + 4 + 8 + 4 + 8 + 8 + 8 + 20;
+
+/** The size of the SQLite DB file header, in bytes. */
+static const qint64 SQLITE_HEADER_SIZE = 100;
+
+/** The offset of the file change counter (big-endian 32-bit) in the SQLite DB file header. */
+static const int SQLITE_CHANGE_COUNTER_OFFSET = 24;
+
+
+
+
+
+/** Writes the DatedOptional value, including its presence flag and the last modification time. */
+template <typename T> static void writeDatedOptional(QDataStream & aStream, const DatedOptional<T> & aValue)
+{
+	aStream << aValue.isPresent() << aValue.valueOrDefault() << aValue.lastModification();
+}
+
+
+
+
+
+/** Reads a DatedOptional value written by writeDatedOptional(). */
+template <typename T> static DatedOptional<T> readDatedOptional(QDataStream & aStream)
+{
+	bool isPresent;
+	T value;
+	QDateTime lastModification;
+	aStream >> isPresent >> value >> lastModification;
+	if (!isPresent)
+	{
+		return DatedOptional<T>(QVariant(), lastModification);
+	}
+	return DatedOptional<T>(value, lastModification);
+}
+
+
+
+
+
+static void writeTag(QDataStream & aStream, const Song::Tag & aTag)
+{
+	writeDatedOptional(aStream, aTag.mAuthor);
+	writeDatedOptional(aStream, aTag.mTitle);
+	writeDatedOptional(aStream, aTag.mGenre);
+	writeDatedOptional(aStream, aTag.mMeasuresPerMinute);
+}
+
+
+
+
+
+static Song::Tag readTag(QDataStream & aStream)
+{
+	Song::Tag res;
+	res.mAuthor            = readDatedOptional<QString>(aStream);
+	res.mTitle             = readDatedOptional<QString>(aStream);
+	res.mGenre             = readDatedOptional<QString>(aStream);
+	res.mMeasuresPerMinute = readDatedOptional<double>(aStream);
+	return res;
+}
+
+
+
+
+
+/** Recursively writes the filter node and its whole subtree. */
+static void writeFilterNode(QDataStream & aStream, const Filter::Node & aNode)
+{
+	aStream << static_cast<qint32>(aNode.kind());
+	if (aNode.canHaveChildren())
+	{
+		const auto & children = aNode.children();
+		aStream << static_cast<quint32>(children.size());
+		for (const auto & child: children)
+		{
+			writeFilterNode(aStream, *child);
+		}
+	}
+	else
+	{
+		aStream
+			<< static_cast<qint32>(aNode.songProperty())
+			<< static_cast<qint32>(aNode.comparison())
+			<< aNode.value();
+	}
+}
+
+
+
+
+
+/** Recursively reads the filter node subtree written by writeFilterNode().
+Throws a RuntimeError if the data is not valid. */
+static Filter::NodePtr readFilterNode(QDataStream & aStream)
+{
+	qint32 intKind;
+	aStream >> intKind;
+	auto kind = Filter::Node::intToKind(intKind);
+	switch (kind)
+	{
+		case Filter::Node::nkComparison:
+		{
+			qint32 intProp, intComparison;
+			QVariant value;
+			aStream >> intProp >> intComparison >> value;
+			return std::make_shared<Filter::Node>(
+				Filter::Node::intToSongProperty(intProp),
+				Filter::Node::intToComparison(intComparison),
+				value
+			);
+		}
+		case Filter::Node::nkAnd:
+		case Filter::Node::nkOr:
+		{
+			auto node = std::make_shared<Filter::Node>(kind);
+			quint32 numChildren;
+			aStream >> numChildren;
+			for (quint32 i = 0; (i < numChildren) && (aStream.status() == QDataStream::Ok); ++i)
+			{
+				node->addChild(readFilterNode(aStream));
+			}
+			return node;
+		}
+	}
+	throw RuntimeError("Unhandled filter node kind: %1", intKind);
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DatabaseSnapshot::Stamp:
+
+DatabaseSnapshot::Stamp DatabaseSnapshot::Stamp::fromDBFile(const QString & aDBFileName)
+{
+	Stamp res;
+
+	// If there are changes still in the WAL journal, the DB file alone doesn't represent the DB:
+	QFileInfo walFile(aDBFileName + "-wal");
+	if (walFile.exists() && (walFile.size() > 0))
+	{
+		return res;
+	}
+
+	QFile f(aDBFileName);
+	if (!f.open(QIODevice::ReadOnly))
+	{
+		return res;
+	}
+	auto header = f.read(SQLITE_HEADER_SIZE);
+	if ((header.size() != SQLITE_HEADER_SIZE) || !header.startsWith(QByteArray("SQLite format 3\0", 16)))
+	{
+		return res;
+	}
+	auto counter = reinterpret_cast<const uchar *>(header.constData()) + SQLITE_CHANGE_COUNTER_OFFSET;
+	res.mChangeCounter =
+		(static_cast<quint32>(counter[0]) << 24) |
+		(static_cast<quint32>(counter[1]) << 16) |
+		(static_cast<quint32>(counter[2]) << 8) |
+		static_cast<quint32>(counter[3]);
+	QFileInfo fi(f);
+	res.mModified = fi.lastModified().toMSecsSinceEpoch();
+	res.mSize = fi.size();
+	return res;
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// DatabaseSnapshot:
+
+QString DatabaseSnapshot::snapshotFileName(const QString & aDBFileName)
+{
+	return aDBFileName + ".snapshot";
+}
+
+
+
+
+
+void DatabaseSnapshot::save(const Database & aDB, const QString & aSnapshotFileName, const Stamp & aDBStamp)
+{
+	STOPWATCH("Saving the DB snapshot");
+
+	if (!aDBStamp.isValid())
+	{
+		throw RuntimeError("The DB file is not in a state that can be snapshotted");
+	}
+
+	// Serialize the model:
+	QByteArray payload;
+	{
+		QDataStream ds(&payload, QIODevice::WriteOnly);
+		ds.setVersion(STREAM_VERSION);
+
+		// Shared data:
+		ds << static_cast<quint32>(aDB.mSongSharedData.size());
+		for (const auto & itr: aDB.mSongSharedData)
+		{
+			const auto & sd = *itr.second;
+			ds << sd.mHash;
+			writeDatedOptional(ds, sd.mLength);
+			writeDatedOptional(ds, sd.mLastPlayed);
+			writeDatedOptional(ds, sd.mRating.mRhythmClarity);
+			writeDatedOptional(ds, sd.mRating.mGenreTypicality);
+			writeDatedOptional(ds, sd.mRating.mPopularity);
+			writeDatedOptional(ds, sd.mRating.mLocal);
+			writeTag(ds, sd.mTagManual);
+			writeDatedOptional(ds, sd.mSkipStart);
+			writeDatedOptional(ds, sd.mNotes);
+			writeDatedOptional(ds, sd.mBgColor);
+			writeDatedOptional(ds, sd.mDetectedTempo);
+		}
+
+		// Songs:
+		ds << static_cast<quint32>(aDB.mSongs.size());
+		for (const auto & song: aDB.mSongs)
+		{
+			ds << song->fileName() << song->hash();
+			writeTag(ds, song->tagFileName());
+			writeTag(ds, song->tagId3());
+			ds << song->lastTagRescanned() << song->numTagRescanAttempts();
+			const auto & fp = song->fileFingerprint();
+			ds << fp.mSize << fp.mModified << fp.mInode;
+		}
+
+		// Filters:
+		ds << static_cast<quint32>(aDB.mFilters.size());
+		for (const auto & filter: aDB.mFilters)
+		{
+			ds << filter->dbRowId() << filter->displayName() << filter->notes() << filter->isFavorite() << filter->bgColor();
+			writeDatedOptional(ds, filter->durationLimit());
+			writeFilterNode(ds, *filter->rootNode());
+		}
+
+		// Templates:
+		ds << static_cast<quint32>(aDB.mTemplates.size());
+		for (const auto & tmpl: aDB.mTemplates)
+		{
+			ds << tmpl->dbRowId() << tmpl->displayName() << tmpl->notes() << tmpl->bgColor();
+			ds << static_cast<quint32>(tmpl->items().size());
+			for (const auto & item: tmpl->items())
+			{
+				ds << item->dbRowId();
+			}
+		}
+
+		if (ds.status() != QDataStream::Ok)
+		{
+			throw RuntimeError("Cannot serialize the DB snapshot");
+		}
+	}
+
+	// Prepend the header:
+	QByteArray header;
+	{
+		QDataStream ds(&header, QIODevice::WriteOnly);
+		ds.setVersion(STREAM_VERSION);
+		ds.writeRawData(SNAPSHOT_MAGIC.constData(), SNAPSHOT_MAGIC.size());
+		ds << SNAPSHOT_FORMAT_VERSION;
+		ds << static_cast<quint64>(DatabaseUpgrade::currentVersion());
+		ds << aDBStamp.mChangeCounter << aDBStamp.mSize << aDBStamp.mModified;
+		ds << static_cast<quint64>(payload.size());
+		auto checksum = QCryptographicHash::hash(payload, QCryptographicHash::Sha1);
+		ds.writeRawData(checksum.constData(), checksum.size());
+	}
+	assert(header.size() == HEADER_SIZE);
+
+	// Write the file, atomically:
+	QSaveFile f(aSnapshotFileName);
+	if (
+		!f.open(QIODevice::WriteOnly) ||
+		(f.write(header) != header.size()) ||
+		(f.write(payload) != payload.size()) ||
+		!f.commit()
+	)
+	{
+		throw RuntimeError("Cannot write the DB snapshot %1: %2", aSnapshotFileName, f.errorString());
+	}
+	qDebug() << "DB snapshot written: " << aDB.mSongs.size() << " songs, " << payload.size() << " bytes";
+}
+
+
+
+
+
+bool DatabaseSnapshot::load(Database & aDB, const QString & aSnapshotFileName, const Stamp & aDBStamp)
+{
+	STOPWATCH("Loading the DB snapshot");
+
+	if (!aDBStamp.isValid())
+	{
+		qDebug() << "The DB file has pending changes in its journal, not using the snapshot";
+		return false;
+	}
+	QFile f(aSnapshotFileName);
+	if (!f.open(QIODevice::ReadOnly))
+	{
+		qDebug() << "There's no DB snapshot, loading from the DB";
+		return false;
+	}
+	auto fileSize = f.size();
+	if ((fileSize < HEADER_SIZE) || (fileSize > std::numeric_limits<int>::max()))
+	{
+		qWarning() << "The DB snapshot has an invalid size, ignoring it";
+		return false;
+	}
+	auto mapped = f.map(0, fileSize);
+	if (mapped == nullptr)
+	{
+		qWarning() << "Cannot map the DB snapshot, ignoring it: " << f.errorString();
+		return false;
+	}
+	auto data = QByteArray::fromRawData(reinterpret_cast<const char *>(mapped), static_cast<int>(fileSize));
+
+	// Check the header:
+	QDataStream hs(data);
+	hs.setVersion(STREAM_VERSION);
+	QByteArray magic(SNAPSHOT_MAGIC.size(), '\0');
+	hs.readRawData(magic.data(), magic.size());
+	quint32 formatVersion;
+	quint64 dbVersion, payloadSize;
+	Stamp stamp;
+	hs >> formatVersion >> dbVersion >> stamp.mChangeCounter >> stamp.mSize >> stamp.mModified >> payloadSize;
+	QByteArray checksum(20, '\0');
+	hs.readRawData(checksum.data(), checksum.size());
+	if (
+		(hs.status() != QDataStream::Ok) ||
+		(magic != SNAPSHOT_MAGIC) ||
+		(formatVersion != SNAPSHOT_FORMAT_VERSION) ||
+		(dbVersion != DatabaseUpgrade::currentVersion())
+	)
+	{
+		qDebug() << "The DB snapshot is from a different program version, ignoring it";
+		return false;
+	}
+	if (!stamp.matches(aDBStamp))
+	{
+		qDebug() << "The DB has changed since the snapshot was made, ignoring the snapshot";
+		return false;
+	}
+	if (payloadSize != static_cast<quint64>(fileSize - HEADER_SIZE))
+	{
+		qWarning() << "The DB snapshot has an invalid size, ignoring it";
+		return false;
+	}
+	auto payload = QByteArray::fromRawData(data.constData() + HEADER_SIZE, static_cast<int>(payloadSize));
+	if (QCryptographicHash::hash(payload, QCryptographicHash::Sha1) != checksum)
+	{
+		qWarning() << "The DB snapshot is corrupted, ignoring it";
+		return false;
+	}
+
+	// Deserialize the model into local containers, so that aDB is only modified upon success:
+	std::map<QByteArray, Song::SharedDataPtr> sharedDataMap;
+	std::vector<SongPtr> songs;
+	std::vector<FilterPtr> filters;
+	std::vector<TemplatePtr> templates;
+	QDataStream ds(payload);
+	ds.setVersion(STREAM_VERSION);
+	try
+	{
+		// Shared data:
+		quint32 numSharedData;
+		ds >> numSharedData;
+		for (quint32 i = 0; (i < numSharedData) && (ds.status() == QDataStream::Ok); ++i)
+		{
+			QByteArray hash;
+			ds >> hash;
+			auto length          = readDatedOptional<double>(ds);
+			auto lastPlayed      = readDatedOptional<QDateTime>(ds);
+			auto rhythmClarity   = readDatedOptional<double>(ds);
+			auto genreTypicality = readDatedOptional<double>(ds);
+			auto popularity      = readDatedOptional<double>(ds);
+			auto local           = readDatedOptional<double>(ds);
+			auto tagManual       = readTag(ds);
+			auto skipStart       = readDatedOptional<double>(ds);
+			auto notes           = readDatedOptional<QString>(ds);
+			auto bgColor         = readDatedOptional<QColor>(ds);
+			auto detectedTempo   = readDatedOptional<double>(ds);
+			sharedDataMap[hash] = std::make_shared<Song::SharedData>(
+				hash,
+				std::move(length),
+				std::move(lastPlayed),
+				Song::Rating({
+					std::move(rhythmClarity),
+					std::move(genreTypicality),
+					std::move(popularity),
+					std::move(local)
+				}),
+				std::move(tagManual),
+				std::move(skipStart),
+				std::move(notes),
+				std::move(bgColor),
+				std::move(detectedTempo)
+			);
+		}
+
+		// Songs:
+		quint32 numSongs;
+		ds >> numSongs;
+		songs.reserve(numSongs);
+		for (quint32 i = 0; (i < numSongs) && (ds.status() == QDataStream::Ok); ++i)
+		{
+			QString fileName;
+			QByteArray hash;
+			ds >> fileName >> hash;
+			auto tagFileName = readTag(ds);
+			auto tagId3 = readTag(ds);
+			QVariant lastTagRescanned, numTagRescanAttempts;
+			Song::FileFingerprint fp;
+			ds >> lastTagRescanned >> numTagRescanAttempts >> fp.mSize >> fp.mModified >> fp.mInode;
+			auto sharedData = sharedDataMap.find(hash);
+			if (sharedData == sharedDataMap.end())
+			{
+				throw RuntimeError("Song %1 references non-existent shared data", fileName);
+			}
+			auto song = std::make_shared<Song>(
+				std::move(fileName),
+				sharedData->second,
+				std::move(tagFileName),
+				std::move(tagId3),
+				std::move(lastTagRescanned),
+				std::move(numTagRescanAttempts)
+			);
+			song->setFileFingerprint(fp);
+			songs.push_back(song);
+		}
+
+		// Filters:
+		quint32 numFilters;
+		ds >> numFilters;
+		std::map<qlonglong, FilterPtr> filtersByRowId;
+		for (quint32 i = 0; (i < numFilters) && (ds.status() == QDataStream::Ok); ++i)
+		{
+			qlonglong rowId;
+			QString displayName, notes;
+			bool isFavorite;
+			QColor bgColor;
+			ds >> rowId >> displayName >> notes >> isFavorite >> bgColor;
+			auto durationLimit = readDatedOptional<double>(ds);
+			auto filter = std::make_shared<Filter>(rowId, displayName, notes, isFavorite, bgColor, durationLimit);
+			filter->setRootNode(readFilterNode(ds));
+			filters.push_back(filter);
+			filtersByRowId[rowId] = filter;
+		}
+
+		// Templates:
+		quint32 numTemplates;
+		ds >> numTemplates;
+		for (quint32 i = 0; (i < numTemplates) && (ds.status() == QDataStream::Ok); ++i)
+		{
+			qlonglong rowId;
+			QString displayName, notes;
+			QColor bgColor;
+			quint32 numItems;
+			ds >> rowId >> displayName >> notes >> bgColor >> numItems;
+			auto tmpl = std::make_shared<Template>(rowId, std::move(displayName), std::move(notes));
+			tmpl->setBgColor(bgColor);
+			for (quint32 j = 0; (j < numItems) && (ds.status() == QDataStream::Ok); ++j)
+			{
+				qlonglong filterRowId;
+				ds >> filterRowId;
+				auto itr = filtersByRowId.find(filterRowId);
+				if (itr == filtersByRowId.end())
+				{
+					throw RuntimeError("Template %1 references non-existent filter %2", tmpl->displayName(), filterRowId);
+				}
+				tmpl->appendItem(itr->second);
+			}
+			templates.push_back(tmpl);
+		}
+	}
+	catch (const std::exception & exc)
+	{
+		qWarning() << "The DB snapshot contains invalid data, ignoring it: " << exc.what();
+		return false;
+	}
+	if ((ds.status() != QDataStream::Ok) || !ds.atEnd())
+	{
+		qWarning() << "The DB snapshot contains invalid data, ignoring it";
+		return false;
+	}
+
+	// Success, move the data into the DB:
+	aDB.mSongSharedData = std::move(sharedDataMap);
+	aDB.mSongs = std::move(songs);
+	aDB.mFilters = std::move(filters);
+	aDB.mTemplates = std::move(templates);
+	aDB.mSongsByFileName.clear();
+	aDB.mSongsByFileName.reserve(static_cast<int>(aDB.mSongs.size()));
+	aDB.mSongsByFingerprint.clear();
+	aDB.mSongsByFingerprint.reserve(static_cast<int>(aDB.mSongs.size()));
+	for (const auto & song: aDB.mSongs)
+	{
+		aDB.mSongsByFileName.insert(song->fileName(), song);
+		aDB.indexSongFingerprint(song);
+	}
+	qDebug() << "Loaded the DB snapshot: " << aDB.mSongs.size() << " songs, "
+		<< aDB.mFilters.size() << " filters, " << aDB.mTemplates.size() << " templates";
+	return true;
+}
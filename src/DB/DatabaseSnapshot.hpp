@@ -0,0 +1,81 @@
+#pragma once
+
+#include <QString>
+
+
+
+
+
+// fwd:
+class Database;
+
+
+
+
+
+/** A namespace-class for storing the in-memory model of the Database (songs, shared data, filters, templates)
+into a binary snapshot file, and loading it back, bypassing the SQL load.
+The snapshot is written upon a clean shutdown; upon startup, it is only used if the DB file hasn't changed since,
+as detected by comparing the DB file's Stamp stored in the snapshot against the current one.
+The snapshot is versioned and checksummed, a snapshot that is not valid is ignored and the DB is loaded from SQL. */
+class DatabaseSnapshot
+{
+public:
+
+	/** Identifies a specific state of the DB file, without reading the DB contents. */
+	struct Stamp
+	{
+		/** The file change counter from the SQLite DB header.
+		Note that in the WAL journal mode SQLite doesn't increment it on each transaction,
+		hence the file size and the modification time are checked as well. */
+		quint32 mChangeCounter;
+
+		/** The DB file size, in bytes. Negative if the stamp is not valid. */
+		qint64 mSize;
+
+		/** The DB file's last modification time, in msec since epoch. */
+		qint64 mModified;
+
+
+		Stamp():
+			mChangeCounter(0),
+			mSize(-1),
+			mModified(0)
+		{
+		}
+
+		/** Returns true if the stamp has been read from a quiescent DB file. */
+		bool isValid() const { return (mSize >= 0); }
+
+		/** Returns true if both stamps are valid and identify the same state of the DB file. */
+		bool matches(const Stamp & aOther) const
+		{
+			return (
+				isValid() &&
+				(mChangeCounter == aOther.mChangeCounter) &&
+				(mSize == aOther.mSize) &&
+				(mModified == aOther.mModified)
+			);
+		}
+
+		/** Returns the stamp of the specified DB file.
+		Returns an invalid stamp if the file cannot be read, is not an SQLite DB, or has a non-empty WAL journal
+		(the DB wasn't closed properly, or is in use, so the file alone doesn't represent the DB contents). */
+		static Stamp fromDBFile(const QString & aDBFileName);
+	};
+
+
+	/** Returns the file name of the snapshot belonging to the specified DB file. */
+	static QString snapshotFileName(const QString & aDBFileName);
+
+	/** Writes the in-memory model of aDB into the specified snapshot file, marked with aDBStamp.
+	The file is replaced atomically, a failed write keeps the previous file.
+	Throws a RuntimeError on failure. */
+	static void save(const Database & aDB, const QString & aSnapshotFileName, const Stamp & aDBStamp);
+
+	/** Loads the in-memory model of aDB (songs, shared data, filters and templates) from the specified snapshot file.
+	The file is memory-mapped. The snapshot is used only if it has the current format and DB version,
+	its checksum matches and it was made from the DB file state identified by aDBStamp.
+	Returns true if the model was loaded; returns false and leaves aDB untouched otherwise. */
+	static bool load(Database & aDB, const QString & aSnapshotFileName, const Stamp & aDBStamp);
+};
@@ -784,6 +784,15 @@ static const std::vector<VersionScript> g_VersionScripts =
 		"ALTER TABLE SongSharedData ADD COLUMN DetectedTempo   TEXT",
 		"ALTER TABLE SongSharedData ADD COLUMN DetectedTempoLM DATETIME",
 	}),  // Version 15 to Version 16
+
+
+	// Version 16 to Version 17
+	// Quick rescan: store the file fingerprint (size, modification time in msec since epoch, inode)
+	VersionScript({
+		"ALTER TABLE SongFiles ADD COLUMN FileSize     INTEGER",
+		"ALTER TABLE SongFiles ADD COLUMN FileModified INTEGER",
+		"ALTER TABLE SongFiles ADD COLUMN FileInode    INTEGER",
+	}),  // Version 16 to Version 17
 };
 
 
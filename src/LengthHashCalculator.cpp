@@ -4,13 +4,65 @@
 #include <QDebug>
 #include <QCryptographicHash>
 #include "Audio/AVPP.hpp"
+#include "Audio/PlaybackBuffer.hpp"
 #include "BackgroundTasks.hpp"
+#include "SongTempoDetector.hpp"
 
 
 
 
 
-LengthHashCalculator::LengthHashCalculator():
+/** Receives the decoded audio data and stores all of it, for the tempo detection. */
+class AnalysisAudioCollector:
+	public PlaybackBuffer
+{
+	using Super = PlaybackBuffer;
+
+public:
+
+	AnalysisAudioCollector(const QAudioFormat & aFormat):
+		Super(aFormat)
+	{
+	}
+
+
+	/** Returns the audio data collected so far, moving it out of this object. */
+	std::vector<Int16> takeAudio() { return std::move(mAudio); }
+
+
+	// PlaybackBuffer overrides:
+	virtual void setDuration(double aDurationSec) override
+	{
+		// No playback buffer is needed, only the samples are stored
+		if (aDurationSec > 0)
+		{
+			mAudio.reserve(static_cast<size_t>(format().bytesForDuration(static_cast<qint64>(aDurationSec * 1000000))) / sizeof(Int16));
+		}
+	}
+
+	virtual bool writeDecodedAudio(const void * aData, size_t aLen) override
+	{
+		auto samples = reinterpret_cast<const Int16 *>(aData);
+		mAudio.insert(mAudio.end(), samples, samples + aLen / sizeof(Int16));
+		return !shouldAbort();
+	}
+
+
+protected:
+
+	/** The audio data collected so far. */
+	std::vector<Int16> mAudio;
+};
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LengthHashCalculator:
+
+LengthHashCalculator::LengthHashCalculator(ComponentCollection & aComponents):
+	mComponents(aComponents),
 	mQueueLength(0)
 {
 }
@@ -19,9 +71,95 @@ LengthHashCalculator::LengthHashCalculator():
 
 
 
+LengthHashCalculator::IngestResult LengthHashCalculator::ingestFile(const QString & aFileName, int aAnalysisSampleRate)
+{
+	IngestResult res;
+
+	// Map the whole file, all the processing is then done from memory:
+	// (The fingerprint is taken first, so that a change during the read is detected by the next rescan)
+	// Note that the mapped data is valid only while f is open, f must outlive all the processing
+	res.mFingerprint = Song::FileFingerprint::fromFile(QFileInfo(aFileName));
+	std::unique_ptr<QFile> f(new QFile(aFileName));
+	if (!f->open(QIODevice::ReadOnly))
+	{
+		qWarning() << "Cannot open song file for ingesting: " << aFileName;
+		return res;
+	}
+	auto data = AVPP::FileIO::mapFile(*f, true);
+
+	// Read the tag; if the file cannot be mapped (network FS), stream it instead of reading it whole into memory:
+	if (!data.isEmpty())
+	{
+		res.mId3Tag = MetadataScanner::readTagFromData(data, aFileName);
+	}
+	else
+	{
+		res.mId3Tag = MetadataScanner::readTagFromDevice(*f, aFileName);
+	}
+
+	// Decode the audio only if a tempo detection is going to need it:
+	auto shouldDecode = (aAnalysisSampleRate > 0);
+	if (shouldDecode)
+	{
+		if (
+			(res.mId3Tag.first && MetadataScanner::parseId3Tag(res.mId3Tag.second).mMeasuresPerMinute.isPresent()) ||
+			MetadataScanner::parseFileNameIntoMetadata(aFileName).mMeasuresPerMinute.isPresent()
+		)
+		{
+			shouldDecode = false;
+		}
+	}
+
+	// Hash the raw audio data and decode it, in a single pass:
+	auto context = data.isEmpty() ?
+		AVPP::Format::createContext(std::move(f), aFileName) :
+		AVPP::Format::createContext(data, aFileName);
+	if (context == nullptr)
+	{
+		qWarning() << "Cannot open song file for hash calculation: " << aFileName;
+		return res;
+	}
+	QCryptographicHash ch(QCryptographicHash::Sha1);
+	auto hashFn = [&](const void * aData, int aSize)
+	{
+		assert(aSize >= 0);
+		ch.addData(reinterpret_cast<const char *>(aData), aSize);
+	};
+	double length = 0;
+	std::unique_ptr<AnalysisAudioCollector> collector;
+	if (shouldDecode)
+	{
+		collector.reset(new AnalysisAudioCollector(SongTempoDetector::detectionFormat(aAnalysisSampleRate)));
+	}
+	if ((collector != nullptr) && context->routeAudioTo(collector.get()))
+	{
+		context->decodeAndFeedRawAudioDataTo(hashFn, length);
+		if (!collector->shouldAbort())
+		{
+			res.mAnalysisAudio = collector->takeAudio();
+		}
+	}
+	else
+	{
+		// The audio is not needed or cannot be decoded, calculate only the hash and length from the raw data:
+		if (!context->feedRawAudioDataTo(hashFn, length))
+		{
+			qWarning() << "Cannot read song data for hash calculation: " << aFileName;
+			return res;
+		}
+	}
+	res.mHash = ch.result();
+	res.mLengthSec = length;
+	return res;
+}
+
+
+
+
+
 std::pair<QByteArray, double> LengthHashCalculator::calculateSongHashAndLength(const QString & aFileName)
 {
-	auto context = AVPP::Format::createContext(aFileName);
+	auto context = AVPP::Format::createContext(aFileName, true);
 	if (context == nullptr)
 	{
 		qWarning() << "Cannot open song file for hash calculation: " << aFileName;
@@ -49,7 +187,7 @@ std::pair<QByteArray, double> LengthHashCalculator::calculateSongHashAndLength(c
 
 double LengthHashCalculator::calculateSongLength(const QString & aFileName)
 {
-	auto context = AVPP::Format::createContext(aFileName);
+	auto context = AVPP::Format::createContext(aFileName, true);
 	if (context == nullptr)
 	{
 		qWarning() << "Cannot open song file for length calculation: " << aFileName;
@@ -68,20 +206,27 @@ double LengthHashCalculator::calculateSongLength(const QString & aFileName)
 
 
 
-void LengthHashCalculator::queueHashFile(const QString & aFileName)
+void LengthHashCalculator::queueIngestFile(const QString & aFileName)
 {
 	mQueueLength += 1;
 	QString fileName(aFileName);
-	BackgroundTasks::enqueue(tr("Calculate hash: %1").arg(aFileName), [this, fileName]()
+	BackgroundTasks::enqueue(tr("Ingest file: %1").arg(aFileName), [this, fileName]()
 		{
-			auto hashAndLength = calculateSongHashAndLength(fileName);
+			// Decode the analysis audio only if it can be cached for the tempo detection:
+			auto tempoDetector = mComponents.get<SongTempoDetector>();
+			auto sampleRate = ((tempoDetector != nullptr) && tempoDetector->audioCache().isEnabled()) ? SongTempoDetector::detectionSampleRate() : 0;
+			auto res = ingestFile(fileName, sampleRate);
 			mQueueLength -= 1;
-			if (hashAndLength.first.isEmpty())
+			if (res.mHash.isEmpty())
 			{
 				emit this->fileHashFailed(fileName);
 				return;
 			}
-			emit this->fileHashCalculated(fileName, hashAndLength.first, hashAndLength.second);
+			if ((tempoDetector != nullptr) && !res.mAnalysisAudio.empty())
+			{
+				tempoDetector->audioCache().store(res.mHash, sampleRate, res.mAnalysisAudio);
+			}
+			emit this->fileIngested(fileName, res.mHash, res.mLengthSec, res.mId3Tag.first, res.mId3Tag.second, res.mFingerprint);
 		}
 	);
 }
@@ -89,6 +234,7 @@ void LengthHashCalculator::queueHashFile(const QString & aFileName)
 
 
 
+
 void LengthHashCalculator::queueLengthSong(Song::SharedDataPtr aSharedData)
 {
 	auto duplicates = aSharedData->duplicates();
@@ -4,6 +4,7 @@
 #include <QObject>
 #include "Song.hpp"
 #include "ComponentCollection.hpp"
+#include "MetadataScanner.hpp"
 
 
 
@@ -12,6 +13,8 @@
 /** Calculates the length and hash of a song file.
 The hash used is a SHA1 checksum of the raw audio data in the file's audio track. This is considered immune
 against changes in the ID3 tag.
+New files are ingested: the file is read only once, and the hash, length, ID3 tag and the decoded audio
+for tempo detection are all extracted from that single read.
 The actual hashing takes place in a background task. */
 class LengthHashCalculator:
 	public QObject,
@@ -24,11 +27,47 @@ class LengthHashCalculator:
 
 public:
 
-	LengthHashCalculator();
+	/** The data extracted from a song file by ingestFile(). */
+	struct IngestResult
+	{
+		/** The hash of the raw audio data, as calculated by calculateSongHashAndLength().
+		Empty if it cannot be calculated. */
+		QByteArray mHash;
+
+		/** The length of the song, in seconds. Negative if it cannot be calculated. */
+		double mLengthSec;
+
+		/** The ID3 tag, as returned by MetadataScanner::readTagFromFile(). */
+		std::pair<bool, MetadataScanner::Tag> mId3Tag;
+
+		/** The audio decoded in SongTempoDetector::detectionFormat(), for the tempo detection.
+		Empty if the audio cannot be decoded or is not needed. */
+		std::vector<Int16> mAnalysisAudio;
+
+		/** The fingerprint of the file, taken before reading it. */
+		Song::FileFingerprint mFingerprint;
+
+		IngestResult():
+			mLengthSec(-1),
+			mId3Tag(false, MetadataScanner::Tag())
+		{
+		}
+	};
+
+
+	LengthHashCalculator(ComponentCollection & aComponents);
 
 	/** Returns the number of songs that are queued for hashing. */
 	int queueLength() { return mQueueLength.load(); }
 
+	/** Reads the specified song file once and extracts all the data needed for adding it into the DB:
+	the hash and length, the ID3 tag and the audio for tempo detection, decoded at aAnalysisSampleRate.
+	The audio is decoded only if aAnalysisSampleRate is positive and the song has no MPM in its ID3 tag
+	or file name (otherwise no tempo detection will run for it); decoding is much slower than hashing.
+	The file is opened only once and memory-mapped, the data is then processed from memory. Where mapping isn't
+	possible (network filesystems), the file is streamed instead, so that it is never held whole in memory. */
+	static IngestResult ingestFile(const QString & aFileName, int aAnalysisSampleRate);
+
 	/** Calculates the hash and length of the specified song file.
 	Returns the hash and length (in seconds).
 	If either cannot be calculated, returns an empty QByteArray / negative length. */
@@ -41,15 +80,20 @@ public:
 
 protected:
 
+	/** The components of the app, used for storing the analysis audio into SongTempoDetector's cache. */
+	ComponentCollection & mComponents;
+
 	/** The number of songs that are queued for hashing. */
 	std::atomic<int> mQueueLength;
 
 
 public slots:
 
-	/** Queues the specified file for length and hash in a background task.
-	After the hash has been calculated, either fileHashCalculated() or fileHashFailed() is emitted. */
-	void queueHashFile(const QString & aFileName);
+	/** Queues the specified new file for ingesting (ingestFile()) in a background task.
+	If SongTempoDetector's audio cache is enabled, the decoded analysis audio is stored into it, so that the tempo
+	detection doesn't need to decode the file again. With the cache disabled, the audio is not decoded at all.
+	After the file has been ingested, either fileIngested() or fileHashFailed() is emitted. */
+	void queueIngestFile(const QString & aFileName);
 
 	/** Queues the specified song for length calculation in a background task.
 	Tries the first "duplicate" that actually exists in the filesystem.
@@ -59,8 +103,16 @@ public slots:
 
 signals:
 
-	/** Emitted after successfully lengthing and hashing the song file. */
-	void fileHashCalculated(const QString & aFileName, const QByteArray & aHash, double aLengthSec);
+	/** Emitted after successfully ingesting the song file.
+	aIsId3TagValid specifies whether the ID3 tag could be read, aId3Tag is the raw tag read from the file. */
+	void fileIngested(
+		const QString & aFileName,
+		const QByteArray & aHash,
+		double aLengthSec,
+		bool aIsId3TagValid,
+		const MetadataScanner::Tag & aId3Tag,
+		const Song::FileFingerprint & aFingerprint
+	);
 
 	/** Emitted after encountering a problem while lengthing or hashing a file. */
 	void fileHashFailed(const QString & aFile);
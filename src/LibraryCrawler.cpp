@@ -0,0 +1,156 @@
+#include "LibraryCrawler.hpp"
+#include <QDebug>
+#include <QDir>
+#include "BackgroundTasks.hpp"
+
+
+
+
+
+/** The extensions (lowercase) of the files that are considered songs. */
+static const QStringList AUDIO_EXTENSIONS =
+{
+	"aac", "aif", "aiff", "ape", "flac", "m4a", "mp2", "mp3", "mpc", "oga", "ogg", "opus", "wav", "wma", "wv",
+};
+
+/** The max number of files reported in a single filesFound() signal.
+Limits the time the DB spends adding a single batch, so that the UI stays responsive. */
+static const size_t FILES_BATCH_SIZE = 100;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LibraryCrawler:
+
+LibraryCrawler::LibraryCrawler():
+	mShouldAbort(std::make_shared<std::atomic<bool>>(false)),
+	mNumFoldersPending(0),
+	mNumFoldersCrawled(0),
+	mNumFilesFound(0)
+{
+}
+
+
+
+
+
+void LibraryCrawler::crawlFolder(const QString & aPath)
+{
+	if (!isCrawling())
+	{
+		// A new crawl, reset the progress:
+		mNumFoldersCrawled = 0;
+		mNumFilesFound = 0;
+	}
+	enqueueFolder(aPath, mShouldAbort);
+}
+
+
+
+
+
+bool LibraryCrawler::isAudioFileName(const QString & aFileName)
+{
+	auto idxDot = aFileName.lastIndexOf('.');
+	if (idxDot < 0)
+	{
+		return false;
+	}
+	return AUDIO_EXTENSIONS.contains(aFileName.mid(idxDot + 1).toLower());
+}
+
+
+
+
+
+void LibraryCrawler::enqueueFolder(const QString & aPath, AbortFlag aShouldAbort)
+{
+	mNumFoldersPending += 1;
+	BackgroundTasks::enqueue(tr("Search folder: %1").arg(aPath),
+		[this, aPath, aShouldAbort]()
+		{
+			crawl(aPath, aShouldAbort);
+			folderDone(true);
+		},
+		true,  // Prioritize, so that the files are found before the hashing of the already found files
+		[this]()
+		{
+			folderDone(false);
+		}
+	);
+}
+
+
+
+
+
+void LibraryCrawler::crawl(const QString & aPath, AbortFlag aShouldAbort)
+{
+	if (aShouldAbort->load())
+	{
+		return;
+	}
+	QDir dir(aPath + "/");
+	FoundFiles songs;
+	for (const auto & item: dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot))
+	{
+		if (aShouldAbort->load())
+		{
+			return;
+		}
+		if (item.isDir())
+		{
+			enqueueFolder(item.absoluteFilePath(), aShouldAbort);
+			continue;
+		}
+		if (!item.isFile() || !isAudioFileName(item.fileName()))
+		{
+			continue;
+		}
+		songs.emplace_back(item.absoluteFilePath(), Song::FileFingerprint::fromFile(item));
+		if (songs.size() >= FILES_BATCH_SIZE)
+		{
+			mNumFilesFound += static_cast<int>(songs.size());
+			emit filesFound(songs);
+			songs.clear();
+		}
+	}
+	mNumFoldersCrawled += 1;
+	if (songs.empty())
+	{
+		return;
+	}
+	qDebug() << "Found " << songs.size() << " songs in folder " << aPath;
+	mNumFilesFound += static_cast<int>(songs.size());
+	emit filesFound(songs);
+}
+
+
+
+
+
+void LibraryCrawler::folderDone(bool aShouldEmitFinished)
+{
+	if ((--mNumFoldersPending == 0) && aShouldEmitFinished)
+	{
+		qDebug() << "Folder crawl finished, " << mNumFoldersCrawled.load() << " folders, " << mNumFilesFound.load() << " songs";
+		emit crawlFinished();
+	}
+}
+
+
+
+
+
+void LibraryCrawler::cancel()
+{
+	if (!isCrawling())
+	{
+		return;
+	}
+	qDebug() << "Cancelling the folder crawl";
+	mShouldAbort->store(true);
+	mShouldAbort = std::make_shared<std::atomic<bool>>(false);
+}
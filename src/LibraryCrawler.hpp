@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <QObject>
+#include <QStringList>
+#include "ComponentCollection.hpp"
+#include "Song.hpp"
+
+
+
+
+
+/** Searches folders for song files to be added into the library, in the background.
+Each folder is listed in a separate BackgroundTasks task, and the subfolders found are queued as new tasks,
+so that multiple folders are listed in parallel. This keeps the UI responsive even on slow network shares.
+Only files with a known audio extension are reported, in batches, through the filesFound() signal,
+together with their fingerprints, so that the DB can skip the unchanged files without touching them again.
+The progress can be polled using the numXYZ() functions; the crawl can be cancelled at any time. */
+class LibraryCrawler:
+	public QObject,
+	public ComponentCollection::Component<ComponentCollection::ckLibraryCrawler>
+{
+	Q_OBJECT
+	using Super = QObject;
+
+
+public:
+
+	/** The files found by the crawl, each with its fingerprint, as reported by filesFound(). */
+	using FoundFiles = std::vector<std::pair<QString, Song::FileFingerprint>>;
+
+
+	LibraryCrawler();
+
+	/** Starts searching the specified folder, recursively, in the background.
+	If a crawl is already in progress, the folder is added to it.
+	The found files are reported through the filesFound() signal, once the whole crawl is finished,
+	crawlFinished() is emitted. */
+	void crawlFolder(const QString & aPath);
+
+	/** Returns true if there are any folders being searched or queued for searching. */
+	bool isCrawling() const { return (mNumFoldersPending.load() > 0); }
+
+	/** Returns the number of folders that are queued for searching. */
+	int numFoldersPending() const { return mNumFoldersPending.load(); }
+
+	/** Returns the number of folders searched so far in the current (or last) crawl. */
+	int numFoldersCrawled() const { return mNumFoldersCrawled.load(); }
+
+	/** Returns the number of song files found so far in the current (or last) crawl. */
+	int numFilesFound() const { return mNumFilesFound.load(); }
+
+	/** Returns true if the specified file name has an extension of a known audio format. */
+	static bool isAudioFileName(const QString & aFileName);
+
+
+protected:
+
+	/** Flag shared by all the tasks of a single crawl; when set, the tasks terminate as soon as possible.
+	Each crawl has its own flag, so that cancelling doesn't affect crawls started afterwards. */
+	using AbortFlag = std::shared_ptr<std::atomic<bool>>;
+
+
+	/** The abort flag for the current crawl.
+	Only accessed from the main thread, the tasks receive their own copy of the pointer. */
+	AbortFlag mShouldAbort;
+
+	/** The number of folders that are queued for searching or being searched. */
+	std::atomic<int> mNumFoldersPending;
+
+	/** The number of folders searched in the current (or last) crawl. */
+	std::atomic<int> mNumFoldersCrawled;
+
+	/** The number of song files found in the current (or last) crawl. */
+	std::atomic<int> mNumFilesFound;
+
+
+	/** Queues the specified folder for searching in a background task, as part of the crawl with the specified abort flag. */
+	void enqueueFolder(const QString & aPath, AbortFlag aShouldAbort);
+
+	/** Lists the specified folder, reports the files found and queues all its subfolders.
+	Called from the background task. */
+	void crawl(const QString & aPath, AbortFlag aShouldAbort);
+
+	/** Marks a single queued folder as done.
+	Emits crawlFinished() if it was the last folder queued. */
+	void folderDone(bool aShouldEmitFinished);
+
+
+public slots:
+
+	/** Cancels the crawl in progress.
+	The folders currently being listed are finished, but no more files are reported and no more folders are queued. */
+	void cancel();
+
+
+signals:
+
+	/** Emitted from the background tasks with a batch of song files found. */
+	void filesFound(const LibraryCrawler::FoundFiles & aFiles);
+
+	/** Emitted after the last folder of the crawl has been searched (or the crawl was cancelled). */
+	void crawlFinished();
+};
+
+Q_DECLARE_METATYPE(LibraryCrawler::FoundFiles);
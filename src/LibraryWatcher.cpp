@@ -0,0 +1,406 @@
+#include "LibraryWatcher.hpp"
+#include <QDebug>
+#include <QDir>
+#include "BackgroundTasks.hpp"
+#include "Settings.hpp"
+
+
+
+
+
+/** The time without any further changes, after which the changed folders are processed, in msec.
+Copying a whole album generates a burst of changes, these get coalesced into a single listing of the folder. */
+static const int DEBOUNCE_MSEC = 2000;
+
+/** The max time from the first unprocessed change until the changes are processed, in msec.
+Limits the debouncing, so that a continuous stream of changes doesn't postpone the processing indefinitely. */
+static const int MAX_DELAY_MSEC = 10000;
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// LibraryWatcher:
+
+LibraryWatcher::LibraryWatcher():
+	mIsEnabled(Settings::loadValue("LibraryWatcher", "IsEnabled", false).toBool()),
+	mRoots(Settings::loadValue("LibraryWatcher", "Roots").toStringList()),
+	mGeneration(0)
+{
+	mDebounceTimer.setSingleShot(true);
+	connect(&mWatcher,       &QFileSystemWatcher::directoryChanged, this, &LibraryWatcher::folderChanged);
+	connect(&mDebounceTimer, &QTimer::timeout,                      this, &LibraryWatcher::processChangedFolders);
+}
+
+
+
+
+
+void LibraryWatcher::start()
+{
+	if (!mIsEnabled)
+	{
+		return;
+	}
+	qDebug() << "Starting to watch library folders: " << mRoots;
+	for (const auto & root: mRoots)
+	{
+		enqueueListFolder(root);
+	}
+}
+
+
+
+
+
+void LibraryWatcher::setEnabled(bool aIsEnabled)
+{
+	if (aIsEnabled == mIsEnabled)
+	{
+		return;
+	}
+	mIsEnabled = aIsEnabled;
+	Settings::saveValue("LibraryWatcher", "IsEnabled", mIsEnabled);
+	if (mIsEnabled)
+	{
+		start();
+	}
+	else
+	{
+		stopWatching();
+	}
+}
+
+
+
+
+
+void LibraryWatcher::addRoot(const QString & aPath)
+{
+	auto path = QDir::cleanPath(QDir(aPath).absolutePath());
+	if (mRoots.contains(path))
+	{
+		return;
+	}
+	mRoots.append(path);
+	Settings::saveValue("LibraryWatcher", "Roots", mRoots);
+	if (mIsEnabled)
+	{
+		enqueueListFolder(path);
+	}
+}
+
+
+
+
+
+void LibraryWatcher::removeRoot(const QString & aPath)
+{
+	if (!mRoots.removeOne(aPath))
+	{
+		return;
+	}
+	Settings::saveValue("LibraryWatcher", "Roots", mRoots);
+	if (mIsEnabled)
+	{
+		// The roots may overlap, so restart the watching with the remaining roots instead of removing the folders:
+		stopWatching();
+		start();
+	}
+}
+
+
+
+
+
+void LibraryWatcher::stopWatching()
+{
+	mGeneration += 1;
+	auto folders = mWatcher.directories();
+	if (!folders.isEmpty())
+	{
+		mWatcher.removePaths(folders);
+	}
+	mFolders.clear();
+	mPendingFolders.clear();
+	mPendingRemovedFiles.clear();
+	mChangedFolders.clear();
+	mDebounceTimer.stop();
+}
+
+
+
+
+
+void LibraryWatcher::enqueueListFolder(const QString & aFolder)
+{
+	if (mPendingFolders.contains(aFolder))
+	{
+		return;
+	}
+	mPendingFolders.insert(aFolder);
+	auto generation = mGeneration;
+	BackgroundTasks::enqueue(tr("Watch folder: %1").arg(aFolder),
+		[this, aFolder, generation]()
+		{
+			listFolder(aFolder, generation);
+		}
+	);
+}
+
+
+
+
+
+void LibraryWatcher::listFolder(const QString & aFolder, int aGeneration)
+{
+	QDir dir(aFolder + "/");
+	if (!dir.exists())
+	{
+		QMetaObject::invokeMethod(this, "folderGone",
+			Q_ARG(QString, aFolder),
+			Q_ARG(int, aGeneration)
+		);
+		return;
+	}
+	LibraryCrawler::FoundFiles files;
+	QStringList subfolders;
+	for (const auto & item: dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot))
+	{
+		if (item.isDir())
+		{
+			subfolders.append(item.absoluteFilePath());
+			continue;
+		}
+		if (!item.isFile() || !LibraryCrawler::isAudioFileName(item.fileName()))
+		{
+			continue;
+		}
+		files.emplace_back(item.absoluteFilePath(), Song::FileFingerprint::fromFile(item));
+	}
+	QMetaObject::invokeMethod(this, "folderListed",
+		Q_ARG(QString, aFolder),
+		Q_ARG(LibraryCrawler::FoundFiles, files),
+		Q_ARG(QStringList, subfolders),
+		Q_ARG(int, aGeneration)
+	);
+}
+
+
+
+
+
+void LibraryWatcher::forgetFolderTree(const QString & aFolder, QStringList & aRemovedFiles)
+{
+	// Forgets a single folder, given its iterator in mFolders; returns the iterator to the next folder:
+	auto forget = [this, &aRemovedFiles](std::map<QString, FolderContents>::iterator aItr)
+	{
+		for (auto itr = aItr->second.cbegin(), end = aItr->second.cend(); itr != end; ++itr)
+		{
+			aRemovedFiles.append(itr.key());
+		}
+		mWatcher.removePath(aItr->first);
+		return mFolders.erase(aItr);
+	};
+
+	auto itr = mFolders.find(aFolder);
+	if (itr != mFolders.end())
+	{
+		forget(itr);
+	}
+
+	// All the subfolders are stored in a single continuous range of mFolders, since they share the prefix:
+	auto prefix = aFolder + "/";
+	itr = mFolders.lower_bound(prefix);
+	while ((itr != mFolders.end()) && itr->first.startsWith(prefix))
+	{
+		itr = forget(itr);
+	}
+}
+
+
+
+
+
+bool LibraryWatcher::isRootAccessible(const QString & aFolder) const
+{
+	for (const auto & root: mRoots)
+	{
+		if ((aFolder == root) || aFolder.startsWith(root + "/"))
+		{
+			return QDir(root).exists();
+		}
+	}
+	return false;
+}
+
+
+
+
+
+void LibraryWatcher::folderListed(
+	const QString & aFolder,
+	const LibraryCrawler::FoundFiles & aFiles,
+	const QStringList & aSubfolders,
+	int aGeneration
+)
+{
+	if (aGeneration != mGeneration)
+	{
+		// A stale listing from before the watching was restarted
+		return;
+	}
+	mPendingFolders.remove(aFolder);
+
+	// Start watching the folder, if not already watched:
+	auto itrFolder = mFolders.find(aFolder);
+	if (itrFolder == mFolders.end())
+	{
+		if (!mWatcher.addPath(aFolder))
+		{
+			qWarning() << "Cannot watch folder " << aFolder << ", changes in it will not be detected.";
+		}
+		itrFolder = mFolders.emplace(aFolder, FolderContents()).first;
+	}
+
+	// Compare with the previous listing, collect the new and changed files:
+	auto & lastContents = itrFolder->second;
+	LibraryCrawler::FoundFiles changedFiles;
+	FolderContents contents;
+	contents.reserve(static_cast<int>(aFiles.size()));
+	for (const auto & file: aFiles)
+	{
+		auto itr = lastContents.constFind(file.first);
+		if ((itr == lastContents.cend()) || !itr->matches(file.second))
+		{
+			changedFiles.push_back(file);
+		}
+		contents.insert(file.first, file.second);
+	}
+
+	// Collect the removed files:
+	QStringList removedFiles;
+	for (auto itr = lastContents.cbegin(), end = lastContents.cend(); itr != end; ++itr)
+	{
+		if (!contents.contains(itr.key()))
+		{
+			removedFiles.append(itr.key());
+		}
+	}
+	lastContents = std::move(contents);
+
+	// Forget the known direct subfolders that are no longer present (moved away or removed):
+	auto prefix = aFolder + "/";
+	QStringList goneSubfolders;
+	for (auto itr = mFolders.lower_bound(prefix); (itr != mFolders.end()) && itr->first.startsWith(prefix); ++itr)
+	{
+		if (
+			(itr->first.indexOf('/', prefix.size()) < 0) &&  // A direct subfolder
+			!aSubfolders.contains(itr->first)
+		)
+		{
+			goneSubfolders.append(itr->first);
+		}
+	}
+	for (const auto & subfolder: goneSubfolders)
+	{
+		forgetFolderTree(subfolder, removedFiles);
+	}
+
+	// Queue the new subfolders for listing:
+	for (const auto & subfolder: aSubfolders)
+	{
+		if (mFolders.find(subfolder) == mFolders.end())
+		{
+			enqueueListFolder(subfolder);
+		}
+	}
+
+	// Report the changes; the removals only once all the pending listings are done:
+	if (!changedFiles.empty())
+	{
+		emit filesFound(changedFiles);
+	}
+	mPendingRemovedFiles.append(removedFiles);
+	reportRemovedFilesIfDone();
+}
+
+
+
+
+
+void LibraryWatcher::folderGone(const QString & aFolder, int aGeneration)
+{
+	if (aGeneration != mGeneration)
+	{
+		// A stale listing from before the watching was restarted
+		return;
+	}
+	mPendingFolders.remove(aFolder);
+	QStringList removedFiles;
+	forgetFolderTree(aFolder, removedFiles);
+	if (!isRootAccessible(aFolder))
+	{
+		// The whole root is gone, most likely a network share or a removable drive got disconnected.
+		// Keep the songs in the library, they'll be found again once the watching is restarted.
+		qWarning() << "Library root of folder " << aFolder << " is not accessible, stopped watching it.";
+		reportRemovedFilesIfDone();
+		return;
+	}
+	mPendingRemovedFiles.append(removedFiles);
+	reportRemovedFilesIfDone();
+}
+
+
+
+
+
+void LibraryWatcher::reportRemovedFilesIfDone()
+{
+	if (!mPendingFolders.isEmpty() || mPendingRemovedFiles.isEmpty())
+	{
+		return;
+	}
+	QStringList removedFiles;
+	removedFiles.swap(mPendingRemovedFiles);
+	emit filesRemoved(removedFiles);
+}
+
+
+
+
+
+void LibraryWatcher::folderChanged(const QString & aFolder)
+{
+	mChangedFolders.insert(aFolder);
+	if (!mDebounceTimer.isActive())
+	{
+		mFirstChangeTimer.start();
+	}
+	if (mFirstChangeTimer.elapsed() < MAX_DELAY_MSEC)
+	{
+		// (Re)start the debounce period:
+		mDebounceTimer.start(DEBOUNCE_MSEC);
+	}
+}
+
+
+
+
+
+void LibraryWatcher::processChangedFolders()
+{
+	auto changedFolders = std::move(mChangedFolders);
+	mChangedFolders.clear();
+	for (const auto & folder: changedFolders)
+	{
+		if (mPendingFolders.contains(folder))
+		{
+			// The folder is being listed right now, the listing may have missed the change; list it again later:
+			folderChanged(folder);
+			continue;
+		}
+		enqueueListFolder(folder);
+	}
+}
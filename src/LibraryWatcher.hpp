@@ -0,0 +1,162 @@
+#pragma once
+
+#include <map>
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QFileSystemWatcher>
+#include "ComponentCollection.hpp"
+#include "LibraryCrawler.hpp"
+
+
+
+
+
+/** Watches the configured library root folders for changes, and reports the changed song files to the DB.
+The watching is optional, it is enabled / disabled and the roots are configured in the Settings.
+When started, all the folders under the roots are listed (in background tasks) and watched.
+Changes reported by the OS are debounced and coalesced per folder; after a while with no more changes,
+each changed folder is listed again and compared to its previous listing. Only the new or changed files
+(filesFound()) and the removed files (filesRemoved()) are reported. The removed files are reported only after
+all the listings in progress are finished, after all their new files, so that moves between folders are followed.
+Note that the initial listing reports all the files, so that the changes made while the program wasn't running
+are picked up by the DB's quick rescan. */
+class LibraryWatcher:
+	public QObject,
+	public ComponentCollection::Component<ComponentCollection::ckLibraryWatcher>
+{
+	Q_OBJECT
+	using Super = QObject;
+
+
+public:
+
+	/** Creates the instance, loads the configuration from the Settings.
+	The watching doesn't start until start() is called. */
+	LibraryWatcher();
+
+	/** Starts watching all the roots, if the watching is enabled.
+	To be called once the DB is loaded, since all the files in the roots are reported. */
+	void start();
+
+	/** Returns true if the library watching is enabled in the Settings. */
+	bool isEnabled() const { return mIsEnabled; }
+
+	/** Enables or disables the watching, stores the setting.
+	Starts or stops the watching accordingly. */
+	void setEnabled(bool aIsEnabled);
+
+	/** Returns the root folders to be watched. */
+	const QStringList & roots() const { return mRoots; }
+
+	/** Adds a new root folder to be watched, stores the setting.
+	If the watching is enabled, starts watching the folder immediately. */
+	void addRoot(const QString & aPath);
+
+	/** Removes a root folder from the watched ones, stores the setting.
+	The songs from the folder are kept in the library. */
+	void removeRoot(const QString & aPath);
+
+	/** Returns the number of folders currently being watched. */
+	int numWatchedFolders() const { return static_cast<int>(mFolders.size()); }
+
+
+protected:
+
+	/** The last known song files in a single folder, FullFileName -> Fingerprint. */
+	using FolderContents = QHash<QString, Song::FileFingerprint>;
+
+
+	/** The OS-level watcher of the individual folders. */
+	QFileSystemWatcher mWatcher;
+
+	/** Specifies whether the watching is enabled. */
+	bool mIsEnabled;
+
+	/** The root folders to be watched. */
+	QStringList mRoots;
+
+	/** All the watched folders, with their last known song files. */
+	std::map<QString, FolderContents> mFolders;
+
+	/** The folders whose listing has been queued in a background task, but not finished yet. */
+	QSet<QString> mPendingFolders;
+
+	/** The removed song files found by the listings so far, not reported yet.
+	The removals are reported only after all the pending listings finish (reportRemovedFilesIfDone()),
+	so that a file moved between two watched folders is first found in its new folder (and the song follows it),
+	rather than removed from the library when its old folder's listing finishes first. */
+	QStringList mPendingRemovedFiles;
+
+	/** The folders that have been reported as changed, but not processed yet. */
+	QSet<QString> mChangedFolders;
+
+	/** Postpones processing the changes until no more changes come for a while. */
+	QTimer mDebounceTimer;
+
+	/** Measures the time since the first unprocessed change, so that the debouncing doesn't postpone indefinitely. */
+	QElapsedTimer mFirstChangeTimer;
+
+	/** Incremented each time the watching is stopped.
+	The background listings from a previous generation are ignored when they finish. */
+	int mGeneration;
+
+
+	/** Stops watching all the folders, drops all the pending changes and listings. */
+	void stopWatching();
+
+	/** Queues the specified folder for listing in a background task (listFolder()).
+	Ignored if the folder is already queued. */
+	void enqueueListFolder(const QString & aFolder);
+
+	/** Lists the song files and subfolders of the specified folder, non-recursively.
+	Called in the background task, reports the results to folderListed() / folderGone() in the main thread. */
+	void listFolder(const QString & aFolder, int aGeneration);
+
+	/** Stops watching the specified folder and all its subfolders.
+	The songs files known in those folders are appended to aRemovedFiles. */
+	void forgetFolderTree(const QString & aFolder, QStringList & aRemovedFiles);
+
+	/** Returns true if the root folder containing the specified folder is accessible.
+	Used to avoid reporting the whole library as removed when a network share or a removable drive goes away. */
+	bool isRootAccessible(const QString & aFolder) const;
+
+	/** Emits filesRemoved() with mPendingRemovedFiles, if there are no more pending listings. */
+	void reportRemovedFilesIfDone();
+
+	/** Called in the main thread after a folder has been listed in the background.
+	Starts watching the folder, if not already watched. Reports the new, changed and removed files,
+	queues any new subfolders for listing and forgets the subfolders that are gone. */
+	Q_INVOKABLE void folderListed(
+		const QString & aFolder,
+		const LibraryCrawler::FoundFiles & aFiles,
+		const QStringList & aSubfolders,
+		int aGeneration
+	);
+
+	/** Called in the main thread after a folder couldn't be listed, because it no longer exists.
+	Stops watching the folder and its subfolders, reports their files as removed. */
+	Q_INVOKABLE void folderGone(const QString & aFolder, int aGeneration);
+
+
+protected slots:
+
+	/** Called by mWatcher when a folder's contents change.
+	Marks the folder as changed and (re)starts the debounce timer. */
+	void folderChanged(const QString & aFolder);
+
+	/** Called by mDebounceTimer after the changes settle down.
+	Queues all the changed folders for listing. */
+	void processChangedFolders();
+
+
+signals:
+
+	/** Emitted with the song files that are new or have changed since the last listing. */
+	void filesFound(const LibraryCrawler::FoundFiles & aFiles);
+
+	/** Emitted with the song files that have been removed since the last listing. */
+	void filesRemoved(const QStringList & aFileNames);
+};
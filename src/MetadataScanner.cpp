@@ -8,6 +8,8 @@
 #include <taglib/mp4file.h>
 #include <taglib/apefile.h>
 #include <taglib/mpegfile.h>
+#include <taglib/tbytevectorstream.h>
+#include <taglib/tiostream.h>
 #include <taglib/tpropertymap.h>
 #include "Song.hpp"
 #include "BackgroundTasks.hpp"
@@ -17,6 +19,174 @@
 
 
 
+/** The file name of a TagLib stream, stored in the format TagLib expects on the current platform.
+Used by the custom streams to report the original file name, so that TagLib can detect the file type
+by its extension. */
+class TagStreamFileName
+{
+public:
+
+	TagStreamFileName(const QString & aFileName):
+		#ifdef _WIN32
+			mFileName(aFileName)
+		#else
+			mFileName(aFileName.toUtf8())
+		#endif
+	{
+	}
+
+
+	/** Returns the file name to be reported by TagLib::IOStream::name(). */
+	TagLib::FileName tagLibFileName() const
+	{
+		#ifdef _WIN32
+			// TagLib on Windows needs UTF16-BE filenames (#134):
+			return TagLib::FileName(reinterpret_cast<const wchar_t *>(mFileName.constData()));
+		#else
+			return mFileName.constData();
+		#endif
+	}
+
+
+protected:
+
+	/** The file name reported to TagLib, in the format TagLib expects on the current platform. */
+	#ifdef _WIN32
+		QString mFileName;
+	#else
+		QByteArray mFileName;
+	#endif
+};
+
+
+
+
+
+/** TagLib stream that reads the file contents from memory.
+Reports the original file name, so that TagLib can detect the file type by its extension. */
+class MemoryTagStream:
+	public TagLib::ByteVectorStream
+{
+	using Super = TagLib::ByteVectorStream;
+
+public:
+
+	MemoryTagStream(const QByteArray & aData, const QString & aFileName):
+		Super(TagLib::ByteVector(aData.constData(), static_cast<unsigned>(aData.size()))),
+		mFileName(aFileName)
+	{
+	}
+
+
+	// TagLib::IOStream overrides:
+	virtual TagLib::FileName name() const override
+	{
+		return mFileName.tagLibFileName();
+	}
+
+
+protected:
+
+	/** The file name reported to TagLib. */
+	TagStreamFileName mFileName;
+};
+
+
+
+
+
+/** Read-only TagLib stream that reads the file contents from an opened QIODevice, as needed.
+Reports the original file name, so that TagLib can detect the file type by its extension. */
+class DeviceTagStream:
+	public TagLib::IOStream
+{
+public:
+
+	DeviceTagStream(QIODevice & aDevice, const QString & aFileName):
+		mDevice(aDevice),
+		mFileName(aFileName)
+	{
+	}
+
+
+	// TagLib::IOStream overrides:
+	virtual TagLib::FileName name() const override
+	{
+		return mFileName.tagLibFileName();
+	}
+
+	virtual TagLib::ByteVector readBlock(unsigned long aLength) override
+	{
+		auto data = mDevice.read(static_cast<qint64>(aLength));
+		return TagLib::ByteVector(data.constData(), static_cast<unsigned>(data.size()));
+	}
+
+	virtual void writeBlock(const TagLib::ByteVector &) override
+	{
+		// Read-only
+	}
+
+	virtual void insert(const TagLib::ByteVector &, unsigned long, unsigned long) override
+	{
+		// Read-only
+	}
+
+	virtual void removeBlock(unsigned long, unsigned long) override
+	{
+		// Read-only
+	}
+
+	virtual bool readOnly() const override
+	{
+		return true;
+	}
+
+	virtual bool isOpen() const override
+	{
+		return mDevice.isOpen();
+	}
+
+	virtual void seek(long aOffset, Position aPosition) override
+	{
+		qint64 base = 0;
+		switch (aPosition)
+		{
+			case Beginning: base = 0; break;
+			case Current:   base = mDevice.pos(); break;
+			case End:       base = mDevice.size(); break;
+		}
+		mDevice.seek(base + aOffset);
+	}
+
+	virtual long tell() const override
+	{
+		return static_cast<long>(mDevice.pos());
+	}
+
+	virtual long length() override
+	{
+		return static_cast<long>(mDevice.size());
+	}
+
+	virtual void truncate(long) override
+	{
+		// Read-only
+	}
+
+
+protected:
+
+	/** The device from which the data is read. */
+	QIODevice & mDevice;
+
+	/** The file name reported to TagLib. */
+	TagStreamFileName mFileName;
+};
+
+
+
+
+
 /** Sets the property in the TagLib property map to the specified value.
 If the value is not present, clears the property value instead. */
 static void setOrClearProp(TagLib::PropertyMap & aProps, const char * aPropName, const DatedOptional<QString> & aValue)
@@ -556,41 +726,30 @@ void MetadataScanner::writeTagToSong(SongPtr aSong, const Tag & aTag)
 
 std::pair<bool, MetadataScanner::Tag> MetadataScanner::readTagFromFile(const QString & aFileName) noexcept
 {
-	MetadataScanner::Tag res;
 	auto fr = openTagFile(aFileName);
-	if (fr.isNull())
-	{
-		// File format not recognized
-		qDebug() << "Unable to parse file " << aFileName;
-		return std::make_pair(false, res);
-	}
-	auto tag = fr.tag();
-	if (tag == nullptr)
-	{
-		qDebug() << "No TagLib-extractable information found in " << aFileName;
-		return std::make_pair(false, res);
-	}
+	return readTag(fr, aFileName);
+}
 
-	// Extract the tag:
-	res.mAuthor = QString::fromStdString(tag->artist().to8Bit(true));
-	res.mTitle = QString::fromStdString(tag->title().to8Bit(true));
-	res.mComment = QString::fromStdString(tag->comment().to8Bit(true));
-	res.mGenre = QString::fromStdString(tag->genre().to8Bit(true));
 
-	// Extract the MPM from BPM in the extended properties:
-	for (const auto & prop: fr.file()->properties())
-	{
-		if (prop.first == "BPM")
-		{
-			bool isOK;
-			auto bpm = QString::fromStdString(prop.second.toString().to8Bit(true)).toDouble(&isOK);
-			if (isOK)
-			{
-				res.mMeasuresPerMinute = bpm;
-			}
-		}
-	}
-	return std::make_pair(true, res);
+
+
+
+std::pair<bool, MetadataScanner::Tag> MetadataScanner::readTagFromData(const QByteArray & aData, const QString & aFileName) noexcept
+{
+	MemoryTagStream stream(aData, aFileName);
+	TagLib::FileRef fr(&stream, false);
+	return readTag(fr, aFileName);
+}
+
+
+
+
+
+std::pair<bool, MetadataScanner::Tag> MetadataScanner::readTagFromDevice(QIODevice & aDevice, const QString & aFileName) noexcept
+{
+	DeviceTagStream stream(aDevice, aFileName);
+	TagLib::FileRef fr(&stream, false);
+	return readTag(fr, aFileName);
 }
 
 
@@ -727,6 +886,48 @@ TagLib::FileRef MetadataScanner::openTagFile(const QString & aFileName)
 
 
 
+std::pair<bool, MetadataScanner::Tag> MetadataScanner::readTag(TagLib::FileRef & aFileRef, const QString & aFileName)
+{
+	MetadataScanner::Tag res;
+	if (aFileRef.isNull())
+	{
+		// File format not recognized
+		qDebug() << "Unable to parse file " << aFileName;
+		return std::make_pair(false, res);
+	}
+	auto tag = aFileRef.tag();
+	if (tag == nullptr)
+	{
+		qDebug() << "No TagLib-extractable information found in " << aFileName;
+		return std::make_pair(false, res);
+	}
+
+	// Extract the tag:
+	res.mAuthor = QString::fromStdString(tag->artist().to8Bit(true));
+	res.mTitle = QString::fromStdString(tag->title().to8Bit(true));
+	res.mComment = QString::fromStdString(tag->comment().to8Bit(true));
+	res.mGenre = QString::fromStdString(tag->genre().to8Bit(true));
+
+	// Extract the MPM from BPM in the extended properties:
+	for (const auto & prop: aFileRef.file()->properties())
+	{
+		if (prop.first == "BPM")
+		{
+			bool isOK;
+			auto bpm = QString::fromStdString(prop.second.toString().to8Bit(true)).toDouble(&isOK);
+			if (isOK)
+			{
+				res.mMeasuresPerMinute = bpm;
+			}
+		}
+	}
+	return std::make_pair(true, res);
+}
+
+
+
+
+
 void MetadataScanner::queueScanSong(SongPtr aSong)
 {
 	enqueueScan(aSong, false);
@@ -747,10 +948,18 @@ void MetadataScanner::queueScanSongPriority(SongPtr aSong)
 
 void MetadataScanner::scanSong(SongPtr aSong)
 {
-	auto id3Tag = readTagFromFile(aSong->fileName());
-	if (id3Tag.first)
+	scanSongWithId3Tag(aSong, readTagFromFile(aSong->fileName()));
+}
+
+
+
+
+
+void MetadataScanner::scanSongWithId3Tag(SongPtr aSong, const std::pair<bool, Tag> & aId3Tag)
+{
+	if (aId3Tag.first)
 	{
-		auto parsedId3Tag = parseId3Tag(id3Tag.second);
+		auto parsedId3Tag = parseId3Tag(aId3Tag.second);
 		validateSongTag(parsedId3Tag);
 		aSong->setId3Tag(parsedId3Tag);
 	}
@@ -12,6 +12,7 @@
 
 
 // fwd:
+class QIODevice;
 namespace TagLib
 {
 	class FileRef;
@@ -89,6 +90,17 @@ public:
 	The first value indicates whether the tag could be read, false means failure. */
 	static std::pair<bool, Tag> readTagFromFile(const QString & aFileName) noexcept;
 
+	/** Reads the tag from the specified in-memory contents of the file aFileName, without accessing the file.
+	The file name is used to detect the file type by its extension.
+	The first value indicates whether the tag could be read, false means failure. */
+	static std::pair<bool, Tag> readTagFromData(const QByteArray & aData, const QString & aFileName) noexcept;
+
+	/** Reads the tag from the specified opened device containing the file aFileName, streaming the data
+	as TagLib needs it (the device is not read whole). The device position is undefined afterwards.
+	The file name is used to detect the file type by its extension.
+	The first value indicates whether the tag could be read, false means failure. */
+	static std::pair<bool, Tag> readTagFromDevice(QIODevice & aDevice, const QString & aFileName) noexcept;
+
 	/** Parses the raw ID3 tag into song tag.
 	Detects BPM, MPM and genre substrings in aFileTag's values and moves the to the appropriate value. */
 	static Song::Tag parseId3Tag(const Tag & aFileTag);
@@ -115,6 +127,11 @@ protected:
 	/** Opens the specified file for reading / writing the tag using TagLib. */
 	static TagLib::FileRef openTagFile(const QString & aFileName);
 
+	/** Extracts the tag from the specified opened TagLib file.
+	aFileName is used only for the log messages.
+	The first value indicates whether the tag could be read, false means failure. */
+	static std::pair<bool, Tag> readTag(TagLib::FileRef & aFileRef, const QString & aFileName);
+
 
 signals:
 
@@ -136,4 +153,11 @@ public slots:
 	/** Scans the song synchronously.
 	Once the song is scanned, the songScanned() signal is emitted, as part of this call. */
 	void scanSong(SongPtr aSong);
+
+	/** Scans the song synchronously, using the ID3 tag that has already been read from the file
+	(as returned by readTagFromFile() or readTagFromData()), so that the file isn't accessed again.
+	Once the song is scanned, the songScanned() signal is emitted, as part of this call. */
+	void scanSongWithId3Tag(SongPtr aSong, const std::pair<bool, Tag> & aId3Tag);
 };
+
+Q_DECLARE_METATYPE(MetadataScanner::Tag);
@@ -2,6 +2,10 @@
 #include <cassert>
 #include <QVariant>
 #include <QDebug>
+#include <QFile>
+#ifndef _WIN32
+	#include <sys/stat.h>
+#endif
 #include "Utils.hpp"
 
 
@@ -60,6 +64,22 @@ Song::~Song()
 
 
 
+void Song::setSharedData(SharedDataPtr aSharedData)
+{
+	assert(aSharedData != nullptr);
+	if (aSharedData == mSharedData)
+	{
+		return;
+	}
+	mSharedData->delDuplicate(this);
+	mSharedData = aSharedData;
+	mSharedData->addDuplicate(this);
+}
+
+
+
+
+
 const DatedOptional<QString> & Song::primaryAuthor() const
 {
 	return primaryValue(
@@ -440,3 +460,29 @@ std::vector<Song *> Song::SharedData::duplicates() const
 	QMutexLocker lock(&mMtx);
 	return mDuplicates;
 }
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Song::FileFingerprint:
+
+Song::FileFingerprint Song::FileFingerprint::fromFile(const QFileInfo & aFileInfo)
+{
+	FileFingerprint res;
+	if (!aFileInfo.exists())
+	{
+		return res;
+	}
+	res.mSize = aFileInfo.size();
+	res.mModified = aFileInfo.lastModified().toMSecsSinceEpoch();
+	#ifndef _WIN32
+		struct stat st;
+		if (::stat(QFile::encodeName(aFileInfo.absoluteFilePath()).constData(), &st) == 0)
+		{
+			res.mInode = static_cast<quint64>(st.st_ino);
+		}
+	#endif
+	return res;
+}
@@ -8,6 +8,7 @@
 #include <QCoreApplication>
 #include <QMutex>
 #include <QColor>
+#include <QFileInfo>
 #include "DatedOptional.hpp"
 
 
@@ -95,6 +96,44 @@ public:
 	};
 
 
+	/** Identifies a specific version of the disk file cheaply, without reading its contents.
+	Consists of the file size, its last modification time and its inode number (where the OS provides one).
+	Used by the quick rescan to skip the unchanged files and to recognize moved files without hashing them. */
+	struct FileFingerprint
+	{
+		qint64 mSize;      ///< The file size, in bytes; negative if not known
+		qint64 mModified;  ///< The last modification time, in msec since epoch
+		quint64 mInode;    ///< The inode number, 0 if not available (Windows)
+
+		FileFingerprint():
+			mSize(-1),
+			mModified(0),
+			mInode(0)
+		{
+		}
+
+		/** Returns true if the fingerprint has been set from an actual file. */
+		bool isValid() const { return (mSize >= 0); }
+
+		/** Returns true if both fingerprints are valid and identify the same version of the same file.
+		The inodes are compared only if both are known. */
+		bool matches(const FileFingerprint & aOther) const
+		{
+			return (
+				isValid() &&
+				(mSize == aOther.mSize) &&
+				(mModified == aOther.mModified) &&
+				((mInode == 0) || (aOther.mInode == 0) || (mInode == aOther.mInode))
+			);
+		}
+
+		/** Returns the fingerprint of the specified file.
+		Uses the size and modification time cached in aFileInfo, queries the OS only for the inode.
+		Returns an invalid fingerprint if the file doesn't exist. */
+		static FileFingerprint fromFile(const QFileInfo & aFileInfo);
+	};
+
+
 	/** Rating in various categories (#100) */
 	struct Rating
 	{
@@ -195,6 +234,7 @@ public:
 	const Tag & tagId3() const { return mTagId3; }
 	const QVariant & lastTagRescanned() const { return mLastTagRescanned; }
 	const QVariant & numTagRescanAttempts() const { return mNumTagRescanAttempts; }
+	const FileFingerprint & fileFingerprint() const { return mFileFingerprint; }
 	const SharedDataPtr & sharedData() const { return mSharedData; }
 	const DatedOptional<QString> & notes() const { return mSharedData->mNotes; }
 
@@ -249,6 +289,11 @@ public:
 	// Basic setters:
 	void setLastTagRescanned(const QDateTime & aLastTagRescanned) { mLastTagRescanned = aLastTagRescanned; }
 	void setNumTagRescanAttempts(int aNumTagRescanAttempts) { mNumTagRescanAttempts = aNumTagRescanAttempts; }
+	void setFileFingerprint(const FileFingerprint & aFingerprint) { mFileFingerprint = aFingerprint; }
+
+	/** Binds the song to different SharedData, used when the file contents change (new hash).
+	Updates the duplicates of both the old and the new SharedData. */
+	void setSharedData(SharedDataPtr aSharedData);
 	void setNotes(const QString & aNotes) { mSharedData->mNotes = aNotes; }
 
 	// Setters that preserve the date information:
@@ -328,6 +373,9 @@ protected:
 	QVariant mLastTagRescanned;
 	QVariant mNumTagRescanAttempts;
 
+	/** The fingerprint of the disk file when it was last hashed or rescanned. */
+	FileFingerprint mFileFingerprint;
+
 	/** An empty variant returned when there's no shared data for a song */
 	static QVariant mEmpty;
 
@@ -337,3 +385,4 @@ protected:
 
 Q_DECLARE_METATYPE(SongPtr);
 Q_DECLARE_METATYPE(Song::SharedDataPtr);
+Q_DECLARE_METATYPE(Song::FileFingerprint);
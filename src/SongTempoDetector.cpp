@@ -1,5 +1,7 @@
 #include "SongTempoDetector.hpp"
-#include <QAudioFormat>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include "Audio/AVPP.hpp"
 #include "Audio/PlaybackBuffer.hpp"
 #include "BackgroundTasks.hpp"
@@ -11,11 +13,15 @@
 
 
 /** Returns a vector of TempoDetector Options to be used for detecting in the specified tempo range. */
-static std::vector<SongTempoDetector::Options> optimalOptions(const std::pair<int, int> & aTempoRange)
+static std::vector<SongTempoDetector::Options> optimalOptions(
+	const std::pair<int, int> & aTempoRange,
+	TempoDetector::ETempoAlgorithm aTempoAlgorithm
+)
 {
 	SongTempoDetector::Options opt;
-	opt.mSampleRate = 500;
+	opt.mSampleRate = SongTempoDetector::detectionSampleRate();
 	opt.mLevelAlgorithm = TempoDetector::laSumDistMinMax;
+	opt.mTempoAlgorithm = aTempoAlgorithm;
 	opt.mMinTempo = aTempoRange.first;
 	opt.mMaxTempo = aTempoRange.second;
 	opt.mShouldNormalizeLevels = true;
@@ -35,11 +41,198 @@ static std::vector<SongTempoDetector::Options> optimalOptions(const std::pair<in
 
 
 
+/** Where the excerpt for detecting from an excerpt starts, in seconds after the song's skip-start. */
+static const double EXCERPT_OFFSET = 30;
+
+/** The lengths of the excerpts used for detecting from an excerpt, in seconds.
+If the detection on an excerpt isn't confident enough, the next (wider) excerpt is tried; after the last one,
+the whole song is scanned. */
+static const double EXCERPT_LENGTHS[] = {30, 60, 120};
+
+/** The minimum confidence of the detection on an excerpt to be accepted.
+Compared to the confidence normalized to 0 .. 100 (TempoDetector::normalizedConfidence()), so that the threshold
+doesn't depend on the number of options. */
+static const double EXCERPT_MIN_CONFIDENCE = 70;
+
+
+
+
+
+/** Returns the number of seconds elapsed since the specified time point. */
+static double secondsSince(std::chrono::steady_clock::time_point aStart)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - aStart).count();
+}
+
+
+
+
+
+/** Receives the decoded audio data and feeds it into a TempoDetector scanner as it comes,
+instead of storing the whole song in memory.
+If requested (for the analysis audio cache), or if any of the options asks for debug audio output,
+a copy of the whole audio data is kept, too. */
+class ScannerFeeder:
+	public PlaybackBuffer
+{
+	using Super = PlaybackBuffer;
+
+public:
+
+	ScannerFeeder(
+		const QAudioFormat & aFormat,
+		const std::vector<SongTempoDetector::Options> & aOptions,
+		bool aShouldKeepAudio
+	):
+		Super(aFormat),
+		mScanner(scannerOptions(aFormat, aOptions)),
+		mShouldKeepAudio(aShouldKeepAudio)
+	{
+		for (const auto & opt: aOptions)
+		{
+			if (!opt.mDebugAudioBeatsFileName.isEmpty() || !opt.mDebugAudioLevelsFileName.isEmpty())
+			{
+				mShouldKeepAudio = true;
+			}
+		}
+	}
+
+
+	/** Finishes the scan, returns the results for all the options, in the same order as the options given
+	in the constructor. The options are processed in parallel, on up to aNumThreads threads. */
+	std::vector<TempoDetector::ResultPtr> finish(size_t aNumThreads)
+	{
+		return mScanner.finish(aNumThreads);
+	}
+
+
+	/** Feeds the whole song's audio data, loaded from the analysis audio cache instead of decoding, into the scanner. */
+	void feedCachedAudio(std::vector<Int16> && aAudio)
+	{
+		mScanner.feed(aAudio.data(), aAudio.size());
+		if (mShouldKeepAudio)
+		{
+			mAudio = std::move(aAudio);
+		}
+	}
+
+
+	/** Returns the whole decoded audio data, if it was kept. */
+	const std::vector<Int16> & audio() const { return mAudio; }
+
+
+	/** Returns the options to be used for the scanner.
+	The samplerate in all options is set to the actual samplerate of the decoded audio. */
+	static std::vector<TempoDetector::Options> scannerOptions(
+		const QAudioFormat & aFormat,
+		const std::vector<SongTempoDetector::Options> & aOptions
+	)
+	{
+		std::vector<TempoDetector::Options> res(aOptions.cbegin(), aOptions.cend());
+		for (auto & opt: res)
+		{
+			opt.mSampleRate = aFormat.sampleRate();
+		}
+		return res;
+	}
+
+
+	// PlaybackBuffer overrides:
+	virtual void setDuration(double aDurationSec) override
+	{
+		// No buffer for the whole song is needed, the audio is processed as it comes
+		if (mShouldKeepAudio)
+		{
+			mAudio.reserve(static_cast<size_t>(format().bytesForDuration(static_cast<qint64>(aDurationSec * 1000000))) / sizeof(Int16));
+		}
+	}
+
+	virtual bool writeDecodedAudio(const void * aData, size_t aLen) override
+	{
+		auto samples = reinterpret_cast<const Int16 *>(aData);
+		auto numSamples = aLen / sizeof(Int16);
+		mScanner.feed(samples, numSamples);
+		if (mShouldKeepAudio)
+		{
+			mAudio.insert(mAudio.end(), samples, samples + numSamples);
+		}
+		return !shouldAbort();
+	}
+
+
+protected:
+
+	/** The scanner calculating the levels for all the options in a single pass. */
+	TempoDetector::Scanner mScanner;
+
+	/** If true, the whole audio data is kept in mAudio, for the debug output. */
+	bool mShouldKeepAudio;
+
+	/** The whole audio data, if mShouldKeepAudio is true. */
+	std::vector<Int16> mAudio;
+};
+
+
+
+
+
+/** Receives the decoded audio data and stores it, until the specified number of samples is collected;
+then it stops the decoder. Decoding the same input again continues right where it was stopped,
+so the collected excerpt can be extended. */
+class ExcerptCollector:
+	public PlaybackBuffer
+{
+	using Super = PlaybackBuffer;
+
+public:
+
+	ExcerptCollector(const QAudioFormat & aFormat):
+		Super(aFormat),
+		mLimit(0)
+	{
+	}
+
+
+	/** Sets the number of samples after which the decoder is stopped. */
+	void setLimit(size_t aNumSamples) { mLimit = aNumSamples; }
+
+	/** Returns the audio data collected so far. */
+	const std::vector<Int16> & audio() const { return mAudio; }
+
+
+	// PlaybackBuffer overrides:
+	virtual void setDuration(double aDurationSec) override
+	{
+		// No buffer for the whole song is needed, only the excerpt is stored
+		Q_UNUSED(aDurationSec);
+	}
+
+	virtual bool writeDecodedAudio(const void * aData, size_t aLen) override
+	{
+		auto samples = reinterpret_cast<const Int16 *>(aData);
+		mAudio.insert(mAudio.end(), samples, samples + aLen / sizeof(Int16));
+		return (mAudio.size() < mLimit) && !shouldAbort();
+	}
+
+
+protected:
+
+	/** The number of samples after which the decoder is stopped. */
+	size_t mLimit;
+
+	/** The audio data collected so far. */
+	std::vector<Int16> mAudio;
+};
+
+
+
+
+
 /** Outputs a debug audio file with one channel of the original audio data and the other channel
 of the detected levels. */
 void debugLevelsInAudioData(
 	const SongTempoDetector::Options & aOptions,
-	const PlaybackBuffer & aBuf,
+	const std::vector<Int16> & aAudio,
 	const std::vector<qint32> & aLevels
 )
 {
@@ -62,7 +255,7 @@ void debugLevelsInAudioData(
 			maxLevel = lev;
 		}
 	}
-	auto audio = reinterpret_cast<const qint16 *>(aBuf.audioData().data());
+	auto audio = aAudio.data();
 	std::vector<qint16> interlaced;
 	interlaced.resize(aOptions.mStride * 2);
 	for (size_t i = 0; i < maxIdx; ++i)
@@ -88,7 +281,7 @@ void debugLevelsInAudioData(
 /** Outputs the debug audio data with mixed-in beats. */
 static void debugBeatsInAudioData(
 	const SongTempoDetector::Options & aOptions,
-	const PlaybackBuffer & aBuf,
+	const std::vector<Int16> & aAudio,
 	const std::vector<std::pair<size_t, qint32>> & aBeats
 )
 {
@@ -123,7 +316,7 @@ static void debugBeatsInAudioData(
 			mixStrength = static_cast<qint16>(aBeats[lastBeatIdx].second * levelCoeff);
 			lastBeatIdx += 1;
 		}
-		auto audio = reinterpret_cast<const qint16 *>(aBuf.audioData().data()) + i * aOptions.mStride;
+		auto audio = aAudio.data() + i * aOptions.mStride;
 		for (size_t j = 0; j < aOptions.mStride; ++j)
 		{
 			interlaced[2 * j] = audio[j];
@@ -146,7 +339,8 @@ static void debugBeatsInAudioData(
 // SongTempoDetector:
 
 SongTempoDetector::SongTempoDetector():
-	mScanQueueLength(0)
+	mScanQueueLength(0),
+	mTempoAlgorithm(TempoDetector::taBeatSimilarity)
 {
 }
 
@@ -154,7 +348,24 @@ SongTempoDetector::SongTempoDetector():
 
 
 
-std::shared_ptr<TempoDetector::Result> SongTempoDetector::scanSong(SongPtr aSong, const std::vector<Options> & aOptions)
+std::shared_ptr<TempoDetector::Result> SongTempoDetector::scanSong(
+	SongPtr aSong,
+	const std::vector<Options> & aOptions,
+	size_t aNumThreads
+)
+{
+	return scanSongWithTimings(aSong, aOptions, TempoDetector::Result::Timings(), aNumThreads);
+}
+
+
+
+
+
+TempoDetector::ResultPtr SongTempoDetector::scanSongExcerpt(
+	SongPtr aSong,
+	const std::vector<Options> & aOptions,
+	size_t aNumThreads
+)
 {
 	if (aOptions.empty())
 	{
@@ -163,64 +374,175 @@ std::shared_ptr<TempoDetector::Result> SongTempoDetector::scanSong(SongPtr aSong
 		return nullptr;
 	}
 
-	// Decode the entire file into memory:
-	auto context = AVPP::Format::createContext(aSong->fileName());
-	if (context == nullptr)
+	// If the whole song's audio is in the cache, take the excerpts from there, otherwise decode only the excerpts:
+	auto fmt = detectionFormat(aOptions[0].mSampleRate);
+	auto sampleRate = static_cast<size_t>(fmt.sampleRate());
+	auto excerptStart = static_cast<size_t>((aSong->skipStart().valueOr(0) + EXCERPT_OFFSET) * sampleRate);
+	TempoDetector::Result::Timings timings;
+	auto startTime = std::chrono::steady_clock::now();
+	std::vector<Int16> cachedAudio;
+	bool isCached = mAudioCache.load(aSong->hash(), fmt.sampleRate(), cachedAudio);
+	timings.mDecode = secondsSince(startTime);
+	ExcerptCollector collector(fmt);
+	AVPP::FormatPtr context;
+	if (!isCached)
 	{
-		qWarning() << "Cannot open file " << aSong->fileName();
-		return nullptr;
+		startTime = std::chrono::steady_clock::now();
+		context = AVPP::Format::createContext(aSong->fileName());
+		if (context == nullptr)
+		{
+			qWarning() << "Cannot open file " << aSong->fileName();
+			return nullptr;
+		}
+		if (!context->routeAudioTo(&collector))
+		{
+			qWarning() << "Cannot route audio from file " << aSong->fileName();
+			return nullptr;
+		}
+		auto canSeek = context->seekTo(static_cast<double>(excerptStart) / sampleRate);
+		timings.mOpen = secondsSince(startTime);
+		if (!canSeek)
+		{
+			// Cannot seek in this file, analyze the whole song instead:
+			return scanSongWithTimings(aSong, aOptions, timings, aNumThreads);
+		}
 	}
-	QAudioFormat fmt;
-	fmt.setSampleRate(aOptions[0].mSampleRate);
-	fmt.setChannelCount(1);
-	fmt.setSampleSize(16);
-	fmt.setSampleType(QAudioFormat::SignedInt);
-	fmt.setByteOrder(QAudioFormat::Endian(QSysInfo::ByteOrder));
-	fmt.setCodec("audio/pcm");
-	PlaybackBuffer buf(fmt);
-	if (!context->routeAudioTo(&buf))
+
+	// Detect on progressively wider excerpts, until the detection is confident enough:
+	auto scannerOptions = ScannerFeeder::scannerOptions(fmt, aOptions);
+	for (auto length: EXCERPT_LENGTHS)
 	{
-		qWarning() << "Cannot route audio from file " << aSong->fileName();
-		return nullptr;
+		auto numSamples = static_cast<size_t>(length * sampleRate);
+		std::vector<Int16> excerpt;
+		if (isCached)
+		{
+			if (excerptStart + numSamples > cachedAudio.size())
+			{
+				break;
+			}
+			excerpt.assign(cachedAudio.cbegin() + static_cast<std::ptrdiff_t>(excerptStart), cachedAudio.cbegin() + static_cast<std::ptrdiff_t>(excerptStart + numSamples));
+		}
+		else
+		{
+			startTime = std::chrono::steady_clock::now();
+			collector.setLimit(numSamples);
+			context->decode();
+			timings.mDecode += secondsSince(startTime);
+			if (collector.shouldAbort())
+			{
+				qDebug() << "Decoding audio failed: " << aSong->fileName();
+				return nullptr;
+			}
+			if (collector.audio().size() < numSamples)
+			{
+				// The song ended before the excerpt did
+				break;
+			}
+			excerpt.assign(collector.audio().cbegin(), collector.audio().cbegin() + static_cast<std::ptrdiff_t>(numSamples));
+		}
+		auto results = TempoDetector::scan(excerpt.data(), excerpt.size(), scannerOptions, aNumThreads);
+		// (The confidence needs to be calculated before aggregateResults() overwrites the first result)
+		auto confidence = TempoDetector::normalizedConfidence(results, TempoDetector::aggregateResults(results).first);
+		auto res = aggregateResults(aOptions, std::move(results), excerpt, timings);
+		if (confidence >= EXCERPT_MIN_CONFIDENCE)
+		{
+			emit songScanned(aSong, res);
+			return res;
+		}
+		timings = res->mTimings;
 	}
-	context->decode();
-	if (buf.shouldAbort())
+
+	// The song is too short, or none of the excerpts gave a confident result, analyze the whole song:
+	// (The whole song is decoded from its start again, including the excerpts decoded above. Reusing them would need
+	// a sample-exact seek back and forth; this case is rare enough that the repeated decode is accepted)
+	qDebug() << "Excerpt detection not confident enough, scanning the whole song " << aSong->fileName();
+	return scanSongWithTimings(aSong, aOptions, timings, aNumThreads);
+}
+
+
+
+
+
+TempoDetector::ResultPtr SongTempoDetector::scanSongWithTimings(
+	SongPtr aSong,
+	const std::vector<Options> & aOptions,
+	const TempoDetector::Result::Timings & aPreviousTimings,
+	size_t aNumThreads
+)
+{
+	if (aOptions.empty())
 	{
-		qDebug() << "Decoding audio failed: " << aSong->fileName();
+		qWarning() << "Tempo detection started with no options given.";
+		assert(!"Tempo detection started with no options given.");
 		return nullptr;
 	}
 
-	// Scan the song using all the options:
-	std::vector<TempoDetector::ResultPtr> res;
-	auto samples = reinterpret_cast<const Int16 *>(buf.audioData().data());
-	auto numSamples = buf.audioData().size() / sizeof(Int16);
-	for (const auto & opt: aOptions)
+	auto fmt = detectionFormat(aOptions[0].mSampleRate);
+	const auto & hash = aSong->hash();
+	// Keep the decoded audio only if it is going to be stored in the cache, otherwise the memory use stays flat:
+	ScannerFeeder feeder(fmt, aOptions, !hash.isEmpty() && mAudioCache.isEnabled());
+	auto timings = aPreviousTimings;
+	auto startTime = std::chrono::steady_clock::now();
+	double decodeTime = 0;
+	std::vector<Int16> cachedAudio;
+	if (mAudioCache.load(hash, fmt.sampleRate(), cachedAudio))
 	{
-		auto result = TempoDetector::scan(samples, numSamples, opt);
-		res.push_back(result);
-		debugBeatsInAudioData(opt, buf, result->mBeats);
-		debugLevelsInAudioData(opt, buf, result->mLevels);
+		// The audio has been decoded before, use the cached data:
+		feeder.feedCachedAudio(std::move(cachedAudio));
+		decodeTime = secondsSince(startTime);
+	}
+	else
+	{
+		// Decode the file, feeding the audio data into the scanners as it comes:
+		auto context = AVPP::Format::createContext(aSong->fileName());
+		if (context == nullptr)
+		{
+			qWarning() << "Cannot open file " << aSong->fileName();
+			return nullptr;
+		}
+		if (!context->routeAudioTo(&feeder))
+		{
+			qWarning() << "Cannot route audio from file " << aSong->fileName();
+			return nullptr;
+		}
+		timings.mOpen += secondsSince(startTime);
+		startTime = std::chrono::steady_clock::now();
+		context->decode();
+		if (feeder.shouldAbort())
+		{
+			qDebug() << "Decoding audio failed: " << aSong->fileName();
+			return nullptr;
+		}
+		mAudioCache.store(hash, fmt.sampleRate(), feeder.audio());
+		decodeTime = secondsSince(startTime);
 	}
 
-	// Aggregate the detection results into a single one:
-	std::tie(res[0]->mTempo, res[0]->mConfidence) = TempoDetector::aggregateResults(res);
-	emit songScanned(aSong, res[0]);
-	return res[0];
+	// Finish the scans for all the options:
+	auto results = feeder.finish(aNumThreads);
+	for (const auto & r: results)
+	{
+		// The levels were calculated while decoding, don't count them twice:
+		decodeTime -= r->mTimings.mLevels;
+	}
+	timings.mDecode += std::max(decodeTime, 0.0);
+	auto res = aggregateResults(aOptions, std::move(results), feeder.audio(), timings);
+	emit songScanned(aSong, res);
+	return res;
 }
 
 
 
 
 
-void SongTempoDetector::queueScanSong(SongPtr aSong, const std::vector<Options> & aOptions)
+void SongTempoDetector::queueScanSong(SongPtr aSong, const std::vector<Options> & aOptions, size_t aNumThreads)
 {
 	auto options = aOptions;  // Make a copy for the background thread
 	mScanQueueLength += 1;
 	BackgroundTasks::enqueue(tr("Detect tempo: %1").arg(aSong->fileName()),
-		[this, aSong, options]()
+		[this, aSong, options, aNumThreads]()
 		{
 			mScanQueueLength -= 1;
-			scanSong(aSong, options);
+			scanSong(aSong, options, aNumThreads);
 		}
 	);
 }
@@ -247,7 +569,41 @@ QString SongTempoDetector::createTaskName(Song::SharedDataPtr aSongSD)
 
 
 
-bool SongTempoDetector::detect(Song::SharedDataPtr aSongSD)
+size_t SongTempoDetector::maxDetectionThreads()
+{
+	return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+
+
+
+
+int SongTempoDetector::detectionSampleRate()
+{
+	return 500;
+}
+
+
+
+
+
+QAudioFormat SongTempoDetector::detectionFormat(int aSampleRate)
+{
+	QAudioFormat fmt;
+	fmt.setSampleRate(aSampleRate);
+	fmt.setChannelCount(1);
+	fmt.setSampleSize(16);
+	fmt.setSampleType(QAudioFormat::SignedInt);
+	fmt.setByteOrder(QAudioFormat::Endian(QSysInfo::ByteOrder));
+	fmt.setCodec("audio/pcm");
+	return fmt;
+}
+
+
+
+
+
+bool SongTempoDetector::detect(Song::SharedDataPtr aSongSD, bool aShouldUseExcerpt, size_t aNumThreads)
 {
 	// Prepare the detection options, esp. the tempo range, if genre is known:
 	auto tempoRange = Song::detectionTempoRangeForGenre("unknown");
@@ -261,13 +617,14 @@ bool SongTempoDetector::detect(Song::SharedDataPtr aSongSD)
 			break;
 		}
 	}
-	auto opts = optimalOptions(tempoRange);
+	auto opts = optimalOptions(tempoRange, mTempoAlgorithm);
 
 	// Detect from the first available duplicate:
 	STOPWATCH("Detect tempo")
 	for (auto s: duplicates)
 	{
-		auto res = scanSong(s->shared_from_this(), opts);
+		auto song = s->shared_from_this();
+		auto res = aShouldUseExcerpt ? scanSongExcerpt(song, opts, aNumThreads) : scanSong(song, opts, aNumThreads);
 		if (res == nullptr)
 		{
 			// Reading the audio data failed, try another file (perhaps the file was removed):
@@ -291,6 +648,32 @@ bool SongTempoDetector::detect(Song::SharedDataPtr aSongSD)
 
 
 
+TempoDetector::ResultPtr SongTempoDetector::aggregateResults(
+	const std::vector<Options> & aOptions,
+	std::vector<TempoDetector::ResultPtr> && aResults,
+	const std::vector<Int16> & aAudio,
+	const TempoDetector::Result::Timings & aExtraTimings
+)
+{
+	auto timings = aExtraTimings;
+	for (size_t i = 0; i < aResults.size(); ++i)
+	{
+		if (!aResults[i]->mBeats.empty())
+		{
+			debugBeatsInAudioData(aOptions[i], aAudio, aResults[i]->mBeats);
+		}
+		debugLevelsInAudioData(aOptions[i], aAudio, aResults[i]->mLevels);
+		timings += aResults[i]->mTimings;
+	}
+	std::tie(aResults[0]->mTempo, aResults[0]->mConfidence) = TempoDetector::aggregateResults(aResults);
+	aResults[0]->mTimings = timings;
+	return aResults[0];
+}
+
+
+
+
+
 void SongTempoDetector::queueDetect(Song::SharedDataPtr aSongSD)
 {
 	assert(aSongSD != nullptr);
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <atomic>
+#include <QAudioFormat>
 #include <QObject>
+#include "AnalysisAudioCache.hpp"
 #include "ComponentCollection.hpp"
 #include "Song.hpp"
 #include "TempoDetector.hpp"
@@ -60,20 +62,45 @@ public:
 	Each item in aOptions is used to scan the song, and the individual results are then aggregated into a single tempo value.
 	Note that samplerate is only taken from the first item in aOptions, the other items' samplerates
 	are ignored (can't change the samplerate once the song is decoded).
+	The levels for all the options are calculated in a single pass over the audio data, while decoding;
+	the tempo for the individual options is then detected in parallel, using up to aNumThreads threads.
+	Only the interactive scans should use more than one thread (maxDetectionThreads()), the background detection
+	shouldn't compete with the UI and playback.
+	If the song's decoded audio is in the analysis audio cache, the file isn't decoded at all.
 	Returns a Result that is a combination of the result from the first aOptions scan and the aggregated tempo / confidence.
 	Emits the songScanned() signal upon successful scan, but doesn't store the detected tempo in aSong. */
-	TempoDetector::ResultPtr scanSong(SongPtr aSong, const std::vector<Options> & aOptions = {Options()});
+	TempoDetector::ResultPtr scanSong(
+		SongPtr aSong,
+		const std::vector<Options> & aOptions = {Options()},
+		size_t aNumThreads = 1
+	);
+
+	/** Scans the specified song synchronously, using the specified options, on an excerpt of the song only.
+	The excerpt starts a while after the song's skip-start; if the aggregated confidence on the excerpt is too low,
+	the excerpt is widened, and finally the whole song is scanned, using scanSong().
+	Only the excerpt is decoded, unless the song's audio is in the analysis audio cache.
+	Returns the same kind of Result as scanSong(), and emits the songScanned() signal the same way. */
+	TempoDetector::ResultPtr scanSongExcerpt(
+		SongPtr aSong,
+		const std::vector<Options> & aOptions = {Options()},
+		size_t aNumThreads = 1
+	);
 
 	/** Queues the specified song for scanning in a background task.
 	Each item in aOptions is used to scan the song, and the individual results are then aggregated into a single tempo value.
 	Note that samplerate is only taken from the first item in aOptions, the other items' samplerates
 	are ignored (can't change the samplerate once the song is decoded).
+	The task uses up to aNumThreads threads (see scanSong()).
 	Once the song is scanned, the songScanned() signal is emitted, but the detected tempo is NOT stored in aSong. */
-	void queueScanSong(SongPtr aSong, const std::vector<Options> & aOptions = {Options()});
+	void queueScanSong(SongPtr aSong, const std::vector<Options> & aOptions = {Options()}, size_t aNumThreads = 1);
 
 	/** Returns the number of songs that are queued for scanning. */
 	int scanQueueLength() { return mScanQueueLength.load(); }
 
+	/** Returns the cache of the decoded audio, used by scanSong() to skip decoding songs that have been scanned before.
+	The cache is disabled until its folder is set. */
+	AnalysisAudioCache & audioCache() { return mAudioCache; }
+
 
 	////////////////////////////////////////////////////////////////////////////////
 	// High-level interface: Single scan using optimal options:
@@ -81,30 +108,76 @@ public:
 	/** Returns a name to be used for the background detection task on the specified song. */
 	static QString createTaskName(Song::SharedDataPtr aSongSD);
 
+	/** Returns the number of threads that an interactive scan can use (the number of CPU cores). */
+	static size_t maxDetectionThreads();
+
+	/** Returns the samplerate of the audio analyzed by detect() and queueDetect().
+	Audio decoded with detectionFormat(detectionSampleRate()) can be stored into audioCache() in advance,
+	so that the detection doesn't need to decode the song. */
+	static int detectionSampleRate();
+
+	/** Returns the audio format used for the decoded audio for detection, with the specified samplerate. */
+	static QAudioFormat detectionFormat(int aSampleRate);
+
 	/** Runs the detection synchronously on the specified song.
 	Called internally from this class, and externally from the task repeater.
+	If aShouldUseExcerpt is true, the detection runs on an excerpt of the song first, using scanSongExcerpt(),
+	which is several times faster for songs with a steady tempo.
+	The options are detected using up to aNumThreads threads (see scanSong()).
 	The detected tempo is set directly into the song upon success (but not saved in the DB).
 	Returns true if detection was successful, false on failure.
 	Emits the songScanned() and songTempoDetected() signals. */
-	bool detect(Song::SharedDataPtr aSongSD);
+	bool detect(Song::SharedDataPtr aSongSD, bool aShouldUseExcerpt = false, size_t aNumThreads = 1);
 
 	/** Queues the detection on the specified song to be run asynchronously in a BackgroundTask.
 	The detected tempo is set directly into the song upon success (but not saved in the DB).
 	Emits the songScanned() and songTempoDetected() signals upon success, nothing on failure. */
 	void queueDetect(Song::SharedDataPtr aSongSD);
 
+	/** Sets the tempo algorithm used by detect() and queueDetect().
+	Not thread-safe, should only be called before any detection is started. */
+	void setTempoAlgorithm(TempoDetector::ETempoAlgorithm aTempoAlgorithm) { mTempoAlgorithm = aTempoAlgorithm; }
+
 
 protected:
 
 	/** The number of songs that are queued for scanning. */
 	std::atomic<int> mScanQueueLength;
 
+	/** The tempo algorithm used by detect() and queueDetect(). */
+	TempoDetector::ETempoAlgorithm mTempoAlgorithm;
+
+	/** The cache of the decoded audio, keyed by the song hash. */
+	AnalysisAudioCache mAudioCache;
+
+
+	/** Implements scanSong().
+	aPreviousTimings are the timings of the work already done on the song before (the excerpts in scanSongExcerpt()),
+	they are added to the timings of the returned Result. */
+	TempoDetector::ResultPtr scanSongWithTimings(
+		SongPtr aSong,
+		const std::vector<Options> & aOptions,
+		const TempoDetector::Result::Timings & aPreviousTimings,
+		size_t aNumThreads
+	);
+
+	/** Outputs the debug audio files for the results of scanning aAudio using aOptions, and aggregates the results.
+	Returns a Result that is a combination of the result for the first options item and the aggregated tempo / confidence.
+	The timings of the returned Result are the sum of aExtraTimings and the timings of all the results. */
+	TempoDetector::ResultPtr aggregateResults(
+		const std::vector<Options> & aOptions,
+		std::vector<TempoDetector::ResultPtr> && aResults,
+		const std::vector<Int16> & aAudio,
+		const TempoDetector::Result::Timings & aExtraTimings
+	);
+
 
 signals:
 
 	/** Emitted after a song has been scanned.
 	If the song was scanned using multiple results, the aResult is a combination of the Result for the first
-	options item and the aggregated tempo and confidence. */
+	options item and the aggregated tempo and confidence.
+	The timings in aResult are the totals over all the options, including the file opening and decoding. */
 	void songScanned(SongPtr aSong, TempoDetector::ResultPtr aResult);
 
 	/** Emitted after a song has been scanned and its tempo was stored. */
@@ -0,0 +1,61 @@
+#include "SpectralBands.hpp"
+#include <cmath>
+
+
+
+
+
+/** The number of radians in a full circle. */
+static const double TWO_PI = 6.283185307179586476925286766559;
+
+
+
+
+
+SpectralBands::SpectralBands(const std::vector<double> & aFrequencies)
+{
+	mBands.reserve(aFrequencies.size());
+	for (auto freq: aFrequencies)
+	{
+		mBands.push_back({freq, 2 * std::cos(freq), std::polar(1.0, freq)});
+	}
+}
+
+
+
+
+
+void SpectralBands::correlate(
+	const Int16 * aSamples,
+	size_t aWindowSize,
+	size_t aFirstSampleIndex,
+	std::complex<double> * aOut
+) const
+{
+	for (const auto & band: mBands)
+	{
+		// Goertzel recurrence: s[n] = x[n] + 2 * cos(freq) * s[n - 1] - s[n - 2]
+		double s1 = 0, s2 = 0;
+		for (size_t i = 0; i < aWindowSize; ++i)
+		{
+			auto s0 = aSamples[i] + band.mCoeff * s1 - s2;
+			s2 = s1;
+			s1 = s0;
+		}
+
+		// (s1 - exp(i * freq) * s2) is the correlation with the phase relative to the last sample in the window,
+		// rotate it to be relative to the song start (reduce the angle first, to keep the precision in long songs):
+		auto phase = std::fmod(band.mFrequency * static_cast<double>(aFirstSampleIndex + aWindowSize - 1), TWO_PI);
+		*aOut = std::polar(1.0, phase) * (s1 - band.mRotation * s2);
+		++aOut;
+	}
+}
+
+
+
+
+
+double SpectralBands::radiansPerSample(double aFrequency, int aSampleRate)
+{
+	return TWO_PI * aFrequency / aSampleRate;
+}
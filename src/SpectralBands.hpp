@@ -0,0 +1,61 @@
+#pragma once
+
+#include <complex>
+#include <vector>
+#include "TempoDetector.hpp"
+
+
+
+
+
+/** A bank of narrow-band filters, extracting the strength of a few fixed frequencies from windows of audio.
+Used by the laDiscreetSineTransform level algorithm of TempoDetector and by the FreqExtract experiment.
+Uses the Goertzel recurrence for each band, with the coefficients precomputed in the constructor, so the cost is
+a single multiply-add per sample and band, instead of evaluating sin and cos for each sample. */
+class SpectralBands
+{
+public:
+
+	/** Creates the filter bank for the specified band frequencies, in radians per sample. */
+	explicit SpectralBands(const std::vector<double> & aFrequencies);
+
+	/** Returns the number of bands. */
+	size_t numBands() const { return mBands.size(); }
+
+	/** Correlates the window of samples with each band's frequency.
+	aSamples points to aWindowSize samples, aFirstSampleIndex is the index of the first one within the whole song;
+	the phase of the results is relative to the song start, rather than to the window start.
+	aOut needs space for numBands() items; item k is set to
+	sum(aSamples[j] * exp(i * freq[k] * (aFirstSampleIndex + j))) over j in [0, aWindowSize).
+	The real part is the correlation with cos, the imaginary part is the correlation with sin,
+	the magnitude is the band's strength in the window, regardless of the phase. */
+	void correlate(
+		const Int16 * aSamples,
+		size_t aWindowSize,
+		size_t aFirstSampleIndex,
+		std::complex<double> * aOut
+	) const;
+
+	/** Returns the band frequency in radians per sample, for the specified frequency (in Hz) at the specified samplerate. */
+	static double radiansPerSample(double aFrequency, int aSampleRate);
+
+
+protected:
+
+	/** The precomputed values for a single band. */
+	struct Band
+	{
+		/** The frequency, in radians per sample. */
+		double mFrequency;
+
+		/** The Goertzel recurrence coefficient, 2 * cos(mFrequency). */
+		double mCoeff;
+
+		/** exp(i * mFrequency), used for converting the recurrence state into the correlation. */
+		std::complex<double> mRotation;
+	};
+
+
+	/** The precomputed values for all the bands. */
+	std::vector<Band> mBands;
+};
@@ -1,6 +1,8 @@
 --[[
 Tests the tempo detection by running it on multiple files and comparing the detected tempo with the tempo
 stored in the files' tags
+Each file list is processed once with each of the tempo algorithms, the algorithms are then compared for both
+the accuracy and the speed.
 
 Expects the location of TempoDetectCmd on command line, as well as a filelist.
 Usage:
@@ -17,6 +19,13 @@ If -l is not given, processes filelist.txt by default
 local isWindows = (string.sub(package.config or "", 1, 1) == "\\")
 local tempoDetectCmdExe = isWindows and "TempoDetectCmd.exe" or "TempoDetectCmd"
 
+--- The tempo algorithms to compare, as passed to TempoDetectCmd's "-t" param:
+local tempoAlgorithms =
+{
+	{ id = 0, name = "BeatSimilarity" },
+	{ id = 1, name = "Autocorrelation" },
+}
+
 
 
 
@@ -37,16 +46,17 @@ end
 
 
 
---- Processes the specified list file
+--- Processes the specified list file using the specified tempo algorithm
 -- Runs the detection on each file specified in the list
--- Stores entries in aResults, a dict table of fileName -> { tempo = ..., id3Tag = ..., }, as returned from TempoDetectCmd
-local function processListFile(aListFileName, aResults, aFnDetectMPM)
+-- Stores entries in aResults, a dict table of fileName -> { tempo = ..., detectionTime = ..., id3Tag = ..., }, as returned from TempoDetectCmd
+local function processListFile(aListFileName, aResults, aTempoAlgorithm)
 	assert(type(aListFileName) == "string")
 	assert(type(aResults) == "table")
+	assert(type(aTempoAlgorithm) == "table")
 
 	-- Run the detection:
-	print("Running detection on list file " .. aListFileName)
-	local cmdLine = tempoDetectCmdExe .. " -i -l \"" .. aListFileName .. "\""
+	print("Running detection on list file " .. aListFileName .. " using the " .. aTempoAlgorithm.name .. " algorithm")
+	local cmdLine = tempoDetectCmdExe .. " -i -t " .. aTempoAlgorithm.id .. " -l \"" .. aListFileName .. "\""
 	local detectionResult = assert(io.popen(cmdLine)):read("*a")
 	if (not(detectionResult) or (detectionResult == "")) then
 		error("Received empty detection result from TempoDetectCmd")
@@ -68,9 +78,22 @@ end
 
 
 
+--- Processes the specified list file using each of the tempo algorithms
+-- aResults is a dict table of algorithmName -> <processListFile() results>
+local function processListFileAllAlgorithms(aListFileName, aResults)
+	for _, alg in ipairs(tempoAlgorithms) do
+		aResults[alg.name] = aResults[alg.name] or {}
+		processListFile(aListFileName, aResults[alg.name], alg)
+	end
+end
+
+
+
+
+
 --- Processes the command line parameters
--- For each "-l" param the filelist is processed using the most recently specified BeatDetectCmd executable
--- Returns a dict table of fileName -> { summary = ..., {windowSize = ..., stride = ...} -> <BeatDetectCmd results> } for each song processed
+-- For each "-l" param the filelist is processed using the most recently specified TempoDetectCmd executable
+-- Returns a dict table of algorithmName -> { fileName -> <TempoDetectCmd results> } for each song processed
 local function processParams(aParams)
 	local numParams = #aParams
 	local i = 1
@@ -91,13 +114,13 @@ local function processParams(aParams)
 				print("Invalid commandline argument: -l requires a following argument specifying the listfile location.")
 				return res
 			end
-			processListFile(aParams[i], res)
+			processListFileAllAlgorithms(aParams[i], res)
 			hasHadFileList = true
 		end
 		i = i + 1
 	end
 	if not(hasHadFileList) then
-		processListFile("filelist.txt", res)
+		processListFileAllAlgorithms("filelist.txt", res)
 	end
 	return res
 end
@@ -116,8 +139,10 @@ local function collectStatistics(aResults)
 	local numUnknown = 0
 	local failedFiles = {}
 	local unknownFiles = {}
+	local totalTime = 0
 	for fnam, res in pairs(aResults) do
 		numFiles = numFiles + 1
+		totalTime = totalTime + (res.detectionTime or 0)
 		local mpmTag = tonumber(res.parsedID3Tag.mpm)
 		if (isCloseEnoughTempo(mpmTag, res.tempo)) then
 			numSucceeded = numSucceeded + 1
@@ -138,6 +163,7 @@ local function collectStatistics(aResults)
 		numUnknown = numUnknown,
 		failedFiles = failedFiles,
 		unknownFiles = unknownFiles,
+		totalTime = totalTime,
 	}
 end
 
@@ -156,6 +182,7 @@ local function printStatistics(aStats, aResults)
 	print("Successful detections: " .. aStats.numSucceeded .. "(" .. succPct    .. " %)")
 	print("Failed detections:     " .. aStats.numFailed ..    "(" .. failedPct  .. " %)")
 	print("Unknown detections:    " .. aStats.numUnknown ..   "(" .. unknownPct .. " %)")
+	print("Total detection time:  " .. string.format("%.2f", aStats.totalTime) .. " s")
 
 	if (aStats.numFailed > 0) then
 		print("Failed files:")
@@ -178,6 +205,62 @@ end
 
 
 
+--- Prints the side-by-side comparison of the tempo algorithms
+-- aStats is a dict table of algorithmName -> <collectStatistics() results>
+-- aResults is a dict table of algorithmName -> <processListFile() results>
+local function printComparison(aStats, aResults)
+	print("")
+	print("Algorithm comparison:")
+	print(string.format("  %-16s %8s %8s %10s %14s", "Algorithm", "Files", "Success", "Time [s]", "Per file [ms]"))
+	for _, alg in ipairs(tempoAlgorithms) do
+		local stats = aStats[alg.name]
+		if (stats and (stats.numFiles > 0)) then
+			print(string.format("  %-16s %8d %7.1f%% %10.2f %14.1f",
+				alg.name,
+				stats.numFiles,
+				100 * stats.numSucceeded / stats.numFiles,
+				stats.totalTime,
+				1000 * stats.totalTime / stats.numFiles
+			))
+		end
+	end
+
+	-- List the files where only one of the algorithms got the tempo right:
+	for _, alg in ipairs(tempoAlgorithms) do
+		for _, otherAlg in ipairs(tempoAlgorithms) do
+			if (alg ~= otherAlg) then
+				local results = aResults[alg.name] or {}
+				local otherResults = aResults[otherAlg.name] or {}
+				local hasPrintedHeader = false
+				for fnam, res in pairs(results) do
+					local other = otherResults[fnam]
+					local mpmTag = tonumber(res.parsedID3Tag.mpm)
+					if (other and isCloseEnoughTempo(mpmTag, res.tempo) and not(isCloseEnoughTempo(mpmTag, other.tempo))) then
+						if not(hasPrintedHeader) then
+							print("Files detected only by " .. alg.name .. ", not by " .. otherAlg.name .. ":")
+							hasPrintedHeader = true
+						end
+						print("  " .. fnam)
+						print("    Tag: " .. tostring(mpmTag) .. "; " .. otherAlg.name .. " detected: " .. other.tempo)
+					end
+				end
+			end
+		end
+	end
+end
+
+
+
+
+
 local res = processParams({...})
-local stats = collectStatistics(res)
-printStatistics(stats, res)
+local stats = {}
+for _, alg in ipairs(tempoAlgorithms) do
+	if (res[alg.name]) then
+		print("")
+		print("Results for the " .. alg.name .. " algorithm:")
+		stats[alg.name] = collectStatistics(res[alg.name])
+		printStatistics(stats[alg.name], res[alg.name])
+	end
+end
+printComparison(stats, res)
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -5,6 +6,12 @@
 #include <mutex>
 #include <QString>
 #include <QFile>
+#ifdef _WIN32
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+#endif
 #include "../SongTempoDetector.hpp"
 #include "../Song.hpp"
 #include "../MetadataScanner.hpp"
@@ -24,6 +31,12 @@ struct Results
 	/** The detected tempo. */
 	double mTempo;
 
+	/** The time it took to decode the file and detect the tempo, in seconds. */
+	double mDetectionTime;
+
+	/** The time spent in the individual stages of the detection, summed over all the detection options. */
+	TempoDetector::Result::Timings mTimings;
+
 	/** The raw ID3 tag as read from the file. */
 	MetadataScanner::Tag mRawTag;
 
@@ -39,6 +52,14 @@ struct Results
 Settable through the "-i" cmdline param. */
 static bool g_ShouldIncludeID3 = false;
 
+/** Specifies whether the detection should run on an excerpt of each song first, widening it only if not confident.
+Settable through the "-e" cmdline param. */
+static bool g_ShouldUseExcerpt = false;
+
+/** Specifies whether the performance should be benchmarked; outputs the timings as JSON instead of the Lua results.
+Settable through the "--bench" cmdline param. */
+static bool g_ShouldBenchmark = false;
+
 /** The global instance of the tempo detector. */
 static SongTempoDetector g_TempoDetector;
 
@@ -54,6 +75,10 @@ static map<QString, unique_ptr<Results>> g_Results;
 /** The mutex protecting g_FileNames and g_Results against multithreaded access. */
 static mutex g_Mtx;
 
+/** The last result of g_TempoDetector's songScanned() signal, emitted in the current thread.
+Each worker thread detects one file at a time, so this is the result for the file being currently processed. */
+static thread_local TempoDetector::ResultPtr g_LastScanResult;
+
 
 
 
@@ -69,6 +94,73 @@ static std::ostream & operator <<(std::ostream & aStream, const QString & aValue
 
 
 
+/** Returns the input string, escaped so that it can be embedded in JSON in a doublequote. */
+static std::string jsonEscapeString(const QString & aInput)
+{
+	std::string res;
+	for (auto ch: aInput.toStdString())
+	{
+		switch (ch)
+		{
+			case '"':  res.append("\\\""); break;
+			case '\\': res.append("\\\\"); break;
+			case '\n': res.append("\\n"); break;
+			case '\r': res.append("\\r"); break;
+			case '\t': res.append("\\t"); break;
+			default:
+			{
+				if (static_cast<unsigned char>(ch) < 0x20)
+				{
+					static const char hexDigits[] = "0123456789abcdef";
+					res.append("\\u00");
+					res.push_back(hexDigits[(ch >> 4) & 0x0f]);
+					res.push_back(hexDigits[ch & 0x0f]);
+				}
+				else
+				{
+					res.push_back(ch);
+				}
+				break;
+			}
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** Returns the peak resident set size of this process, in KiB. */
+static unsigned long long peakRssKiB()
+{
+	#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS pmc;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		{
+			return 0;
+		}
+		return pmc.PeakWorkingSetSize / 1024;
+	#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+		{
+			return 0;
+		}
+		#ifdef __APPLE__
+			// macOS reports the value in bytes
+			return static_cast<unsigned long long>(usage.ru_maxrss) / 1024;
+		#else
+			// Linux and BSDs report the value in KiB
+			return static_cast<unsigned long long>(usage.ru_maxrss);
+		#endif
+	#endif
+}
+
+
+
+
+
 /** Returns the input string, escaped so that it can be embedded in Lua code in a doublequote. */
 static std::string luaEscapeString(const QString & aInput)
 {
@@ -99,7 +191,13 @@ static void printUsage()
 	cerr << "TempoDetectCmd [options] [filename] [filename] ..." << endl;
 	cerr << endl;
 	cerr << "Available options:" << endl;
-	cerr << "  -i ... Include the ID3 information from the file in the output" << endl;
+	cerr << "  --bench .. Benchmark the detection, output the per-stage timings, files/sec and peak RSS as JSON" << endl;
+	cerr << "  -e     ... Detect from an excerpt of each song, widen the excerpt only if not confident" << endl;
+	cerr << "  -i     ... Include the ID3 information from the file in the output" << endl;
+	cerr << "  -l <F> ... Process all the files listed in list file F" << endl;
+	cerr << "  -t <N> ... Use tempo algorithm N (default: " << TempoDetector::taBeatSimilarity << ")" << endl;
+	cerr << "               0: BeatSimilarity" << endl;
+	cerr << "               1: Autocorrelation" << endl;
 }
 
 
@@ -146,12 +244,19 @@ static unique_ptr<Results> runDetectionOnFile(const QString & aFileName)
 	}
 
 	// Run the tempo detection:
-	if (!g_TempoDetector.detect(songSD))
+	auto startTime = chrono::steady_clock::now();
+	g_LastScanResult.reset();
+	if (!g_TempoDetector.detect(songSD, g_ShouldUseExcerpt))
 	{
 		cerr << "Detection failed: " << aFileName << endl;
 		return nullptr;
 	}
+	res->mDetectionTime = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
 	res->mTempo = song->detectedTempo().valueOr(-1);
+	if (g_LastScanResult != nullptr)
+	{
+		res->mTimings = g_LastScanResult->mTimings;
+	}
 	return res;
 }
 
@@ -242,6 +347,11 @@ static bool processArgs(const vector<string> & aArgs)
 	vector<QString> files;
 	for (size_t i = 0; i < argc; ++i)
 	{
+		if (aArgs[i] == "--bench")
+		{
+			g_ShouldBenchmark = true;
+			continue;
+		}
 		if (aArgs[i][0] == '-')
 		{
 			switch (aArgs[i][1])
@@ -253,6 +363,12 @@ static bool processArgs(const vector<string> & aArgs)
 					printUsage();
 					break;
 				}
+				case 'e':
+				case 'E':
+				{
+					g_ShouldUseExcerpt = true;
+					break;
+				}
 				case 'i':
 				case 'I':
 				{
@@ -269,6 +385,15 @@ static bool processArgs(const vector<string> & aArgs)
 					break;
 				}
 
+				case 't':
+				case 'T':
+				{
+					NEED_ARGS(1);
+					g_TempoDetector.setTempoAlgorithm(static_cast<TempoDetector::ETempoAlgorithm>(stoi(aArgs[i + 1])));
+					i += 1;
+					break;
+				}
+
 			}  // switch (arg)
 			continue;
 		}  // if ('-')
@@ -346,6 +471,7 @@ static void outputResults()
 		cout << "\t{" << endl;
 		cout << "\t\tfileName = \"" << luaEscapeString(fileName) << "\"," << endl;
 		cout << "\t\ttempo = " << results->mTempo << "," << endl;
+		cout << "\t\tdetectionTime = " << results->mDetectionTime << "," << endl;
 		if (g_ShouldIncludeID3)
 		{
 			outputId3Tag(*results);
@@ -359,6 +485,67 @@ static void outputResults()
 
 
 
+/** Outputs the specified stage timings to stdout, as the members of a JSON object, with the specified indent. */
+static void outputTimingsJson(const TempoDetector::Result::Timings & aTimings, const char * aIndent)
+{
+	cout << aIndent << "\"open\": "   << aTimings.mOpen   << "," << endl;
+	cout << aIndent << "\"decode\": " << aTimings.mDecode << "," << endl;
+	cout << aIndent << "\"levels\": " << aTimings.mLevels << "," << endl;
+	cout << aIndent << "\"beats\": "  << aTimings.mBeats  << "," << endl;
+	cout << aIndent << "\"tempo\": "  << aTimings.mTempo  << "," << endl;
+	cout << aIndent << "\"total\": "  << aTimings.total() << endl;
+}
+
+
+
+
+
+/** Outputs the benchmark results to stdout, as JSON.
+The per-file stage timings are CPU times summed over all the detection options (each worker thread detects
+a single file, the options of a file are processed one after another),
+the detectionTime is the wallclock time of the whole detection on the file. */
+static void outputBenchmark(size_t aNumFiles, double aWallTime)
+{
+	TempoDetector::Result::Timings totalTimings;
+	double totalDetectionTime = 0;
+	cout << "{" << endl;
+	cout << "\t\"files\": [" << endl;
+	size_t idx = 0;
+	for (const auto & res: g_Results)
+	{
+		const auto & results = res.second;
+		totalTimings += results->mTimings;
+		totalDetectionTime += results->mDetectionTime;
+		cout << "\t\t{" << endl;
+		cout << "\t\t\t\"fileName\": \"" << jsonEscapeString(res.first) << "\"," << endl;
+		cout << "\t\t\t\"tempo\": " << results->mTempo << "," << endl;
+		cout << "\t\t\t\"detectionTime\": " << results->mDetectionTime << "," << endl;
+		cout << "\t\t\t\"stages\": {" << endl;
+		outputTimingsJson(results->mTimings, "\t\t\t\t");
+		cout << "\t\t\t}" << endl;
+		idx += 1;
+		cout << ((idx < g_Results.size()) ? "\t\t}," : "\t\t}") << endl;
+	}
+	cout << "\t]," << endl;
+	cout << "\t\"summary\": {" << endl;
+	cout << "\t\t\"numFiles\": " << aNumFiles << "," << endl;
+	cout << "\t\t\"numDetected\": " << g_Results.size() << "," << endl;
+	cout << "\t\t\"numThreads\": " << thread::hardware_concurrency() << "," << endl;
+	cout << "\t\t\"wallTime\": " << aWallTime << "," << endl;
+	cout << "\t\t\"filesPerSec\": " << ((aWallTime > 0) ? static_cast<double>(aNumFiles) / aWallTime : 0) << "," << endl;
+	cout << "\t\t\"detectionTime\": " << totalDetectionTime << "," << endl;
+	cout << "\t\t\"peakRssKiB\": " << peakRssKiB() << "," << endl;
+	cout << "\t\t\"stages\": {" << endl;
+	outputTimingsJson(totalTimings, "\t\t\t");
+	cout << "\t\t}" << endl;
+	cout << "\t}" << endl;
+	cout << "}" << endl;
+}
+
+
+
+
+
 int main(int argc, char *argv[])
 {
 	vector<string> args;
@@ -370,7 +557,24 @@ int main(int argc, char *argv[])
 	{
 		return 1;
 	}
+
+	// Each worker thread picks up the result of its own detection:
+	QObject::connect(&g_TempoDetector, &SongTempoDetector::songScanned,
+		[](SongPtr aSong, TempoDetector::ResultPtr aResult)
+		{
+			Q_UNUSED(aSong);
+			g_LastScanResult = aResult;
+		}
+	);
+
+	auto numFiles = g_FileNames.size();
+	auto startTime = chrono::steady_clock::now();
 	processFiles();
+	if (g_ShouldBenchmark)
+	{
+		outputBenchmark(numFiles, chrono::duration<double>(chrono::steady_clock::now() - startTime).count());
+		return 0;
+	}
 	outputResults();
 
 	return 0;
@@ -1,7 +1,25 @@
 #include "TempoDetector.hpp"
 #include <cassert>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <complex>
+#include <limits>
+#include <numeric>
+#include <thread>
+#include "SpectralBands.hpp"
+#include "TempoDetectorKernels.hpp"
+
+
+
+
+
+/** Returns the number of seconds elapsed since the specified time point. */
+static double secondsSince(std::chrono::steady_clock::time_point aStart)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - aStart).count();
+}
 
 
 
@@ -45,20 +63,62 @@ template <typename T> T ceil(double aValue)
 
 
 
+/** Returns the maxima of all the aWindowSize-long windows in aValues.
+Item k of the result is max(aValues[k .. k + aWindowSize - 1]).
+Uses a monotonic deque, so the complexity doesn't depend on the window size. */
+static std::vector<Int32> slidingWindowMax(const std::vector<Int32> & aValues, size_t aWindowSize)
+{
+	auto count = aValues.size();
+	if ((aWindowSize == 0) || (aWindowSize > count))
+	{
+		return {};
+	}
+	std::vector<Int32> res;
+	res.reserve(count - aWindowSize + 1);
+	std::vector<size_t> queue;  // Indices of the decreasing values, the front is at queue[head]
+	queue.reserve(count);
+	size_t head = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		while ((queue.size() > head) && (aValues[queue.back()] <= aValues[i]))
+		{
+			queue.pop_back();
+		}
+		queue.push_back(i);
+		if (i + 1 < aWindowSize)
+		{
+			continue;
+		}
+		auto windowStart = i + 1 - aWindowSize;
+		while (queue[head] < windowStart)
+		{
+			++head;
+		}
+		res.push_back(aValues[queue[head]]);
+	}
+	return res;
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Detector:
 
-/** The actual tempo detector. The TempoDetector interface class uses this to detect the tempo. */
+/** The number of consecutive offsets in a single block of the coarse-to-fine search in Detector::detectTempoFromBeats(). */
+static const size_t SIMILARITY_BLOCK_SIZE = 8;
+
+
+
+
+
+/** The actual tempo detector. The TempoDetector interface class uses this to detect the tempo from
+the levels calculated by a TempoDetector::Scanner. */
 class Detector
 {
 public:
-	Detector(
-		const Int16 * aSamples,
-		size_t aNumSamples,
-		const TempoDetector::Options & aOptions
-	):
-		mSamples(aSamples),
-		mNumSamples(aNumSamples),
+	Detector(const TempoDetector::Options & aOptions):
 		mOptions(aOptions)
 	{
 	}
@@ -67,22 +127,39 @@ public:
 
 
 
-	/** Processes the mSamples data - detects its tempo. */
-	std::shared_ptr<TempoDetector::Result> process()
+	/** Processes the levels calculated from the audio data - detects its tempo. */
+	std::shared_ptr<TempoDetector::Result> process(std::vector<Int32> && aLevels)
 	{
-		// Run the mSamples through the detector:
 		auto res = std::make_shared<TempoDetector::Result>();
 		res->mOptions = mOptions;
-		res->mLevels = calcLevels(mOptions);
+		res->mLevels = std::move(aLevels);
+		auto startTime = std::chrono::steady_clock::now();
 		if (mOptions.mShouldNormalizeLevels)
 		{
 			res->mLevels = normalizeLevels(mOptions, res->mLevels);
 		}
-		res->mBeats = detectBeats(mOptions, res->mLevels);
-		if (!res->mBeats.empty())
+		switch (mOptions.mTempoAlgorithm)
 		{
-			std::tie(res->mTempo, res->mConfidence) = detectTempoFromBeats(mOptions, res->mBeats, res->mLevels);
+			case TempoDetector::taBeatSimilarity:
+			{
+				res->mBeats = detectBeats(mOptions, res->mLevels);
+				res->mTimings.mBeats = secondsSince(startTime);
+				startTime = std::chrono::steady_clock::now();
+				if (!res->mBeats.empty())
+				{
+					std::tie(res->mTempo, res->mConfidence) = detectTempoFromBeats(mOptions, res->mBeats, res->mLevels);
+				}
+				break;
+			}
+			case TempoDetector::taAutocorrelation:
+			{
+				res->mTimings.mBeats = secondsSince(startTime);
+				startTime = std::chrono::steady_clock::now();
+				std::tie(res->mTempo, res->mConfidence) = detectTempoFromAutocorrelation(mOptions, res->mLevels);
+				break;
+			}
 		}
+		res->mTimings.mTempo = secondsSince(startTime);
 		return res;
 	}
 
@@ -110,338 +187,421 @@ public:
 	)
 	{
 		// Calculate the similarities:
-		Int32 maxLevel = 0;
-		auto beats = prepareBeats(aBeats, aLevels, maxLevel);
 		auto minOfs = floor<size_t>(mpmToBeatStrides(aOptions, aOptions.mMaxTempo));
 		auto maxOfs = ceil<size_t> (mpmToBeatStrides(aOptions, aOptions.mMinTempo));
-		std::vector<std::pair<double, double>> similarities;  // {similarity, mpm}
-		for (size_t ofs = minOfs; ofs <= maxOfs; ++ofs)
-		{
-			auto sim = calcSimilarityBeatsWeight(aBeats, beats, ofs, maxLevel);
-			auto mpm = beatStridesToBpm(aOptions, ofs);
-			similarities.push_back({sim, mpm});
-		}
-		if (similarities.empty())
+		if (minOfs > maxOfs)
 		{
 			return {0, 0};
 		}
-
-		// Find the second-best MPM (that isn't close enough to the best MPM):
-		std::sort(similarities.begin(), similarities.end(),
-			[](auto aSim1, auto aSim2)
+		Int32 maxLevel = 0;
+		auto beatLevels = prepareBeats(aBeats, aLevels, maxOfs, maxLevel);
+
+		// Coarse search: an upper bound of the similarity for each block of offsets:
+		auto numOfs = maxOfs - minOfs + 1;
+		auto bounds = calcSimilarityBounds(aBeats, beatLevels, minOfs, maxOfs, maxLevel);
+		std::vector<size_t> blocks(bounds.size());
+		std::iota(blocks.begin(), blocks.end(), 0);
+		std::sort(blocks.begin(), blocks.end(),
+			[&bounds](size_t aBlock1, size_t aBlock2)
 			{
-				return (aSim1.first > aSim2.first);
+				return (bounds[aBlock1] > bounds[aBlock2]);
 			}
 		);
-		auto bestMpm = similarities[0].second;
-		auto bestSimilarity = similarities[0].first;
-		if (bestSimilarity < 1)
-		{
-			return {0, 0};
-		}
-		for (const auto & sim: similarities)
+
+		// Fine search: calculate the similarities in the most promising blocks first, until none of the remaining
+		// blocks can contain a similarity higher than the second-best one; then the best and second-best are final:
+		std::vector<double> similarities(numOfs);
+		std::vector<bool> isEvaluated(numOfs, false);
+		std::pair<size_t, double> best(0, -std::numeric_limits<double>::infinity());  // {index of best, second-best similarity}
+		for (auto block: blocks)
 		{
-			if (!isCloseEnoughMpm(sim.second, bestMpm))
+			if (bounds[block] < best.second)
 			{
-				auto confidence = 100 - 100 * sim.first / bestSimilarity;
-				return {bestMpm, clamp<double>(confidence, 0, 100)};
+				break;
 			}
+			auto first = block * SIMILARITY_BLOCK_SIZE;
+			auto last = std::min(first + SIMILARITY_BLOCK_SIZE, numOfs) - 1;
+			auto sims = calcSimilaritiesBeatsWeight(aBeats, beatLevels, minOfs + first, minOfs + last, maxLevel);
+			std::copy(sims.cbegin(), sims.cend(), similarities.begin() + static_cast<std::ptrdiff_t>(first));
+			std::fill(isEvaluated.begin() + static_cast<std::ptrdiff_t>(first), isEvaluated.begin() + static_cast<std::ptrdiff_t>(last + 1), true);
+			best = findBestSimilarities(aOptions, similarities, isEvaluated, minOfs);
 		}
-		return {0, 0};
-	}
-
-
-
-
-	/** Returns true if the two MPMs are close enough to be considered a single match. */
-	static bool isCloseEnoughMpm(double aMpm1, double aMpm2)
-	{
-		return (std::abs(aMpm1 - aMpm2) <= 1.5);
-	}
 
-
-
-
-
-	/** Calculates the self-similarity on aBeats using the specified offset.
-	aBeatMap is the helper map for quick beat lookups, created by prepareBeats().
-	The similarity is a number that can be compared to other similarities. */
-	double calcSimilarityBeatsWeight(
-		const std::vector<std::pair<size_t, Int32>> & aBeats,
-		const std::map<size_t, Int32> & aBeatMap,
-		size_t aOffset,
-		Int32 aMaxLevel
-	)
-	{
-		double res = 0;
-		for (const auto & beat: aBeats)
+		// Calculate the confidence from the best and the second-best MPM (that isn't close enough to the best MPM):
+		auto bestSimilarity = similarities[best.first];
+		if ((bestSimilarity < 1) || (best.second == -std::numeric_limits<double>::infinity()))
 		{
-			auto idx = beat.first + aOffset;
-			auto itr = aBeatMap.find(idx);
-			if (itr != aBeatMap.cend())
-			{
-				res += aMaxLevel - std::abs(beat.second - itr->second);
-				continue;
-			}
-			itr = aBeatMap.find(idx + 1);
-			if (itr != aBeatMap.cend())
-			{
-				res += aMaxLevel - std::abs(beat.second - itr->second) / 2;
-				continue;
-			}
-			itr = aBeatMap.find(idx - 1);
-			if (itr != aBeatMap.cend())
-			{
-				res += aMaxLevel - std::abs(beat.second - itr->second) / 2;
-				continue;
-			}
+			return {0, 0};
 		}
-		return res;
+		auto confidence = 100 - 100 * best.second / bestSimilarity;
+		return {beatStridesToBpm(aOptions, minOfs + best.first), clamp<double>(confidence, 0, 100)};
 	}
 
 
 
 
 
-	/** Prepares a lookup-table of beats based on the input calculated beats.
-	Returns a map of beatIndex -> soundLevel for each detected beat.
-	Cuts 10 % off the beginning and 10 % off the end of the song, timewise. */
-	std::map<size_t, Int32> prepareBeats(
-		const std::vector<std::pair<size_t, Int32>> & aBeats,
-		const std::vector<Int32> & aLevels,
-		Int32 & aOutMaxLevel
+	/** Returns the index of the best similarity, and the best similarity of an offset whose MPM isn't close enough
+	to the best one, among the similarities for which aIsEvaluated is set.
+	aSimilarities and aIsEvaluated are indexed by (offset - aMinOfs).
+	Of multiple equal best similarities, the first one is used. If all the evaluated offsets are close enough
+	to the best one, the second-best similarity is returned as -infinity.
+	A linear selection, the similarities don't need to be sorted. */
+	std::pair<size_t, double> findBestSimilarities(
+		const TempoDetector::Options & aOptions,
+		const std::vector<double> & aSimilarities,
+		const std::vector<bool> & aIsEvaluated,
+		size_t aMinOfs
 	)
 	{
-		std::map<size_t, Int32> res;
-		auto minIdx = static_cast<size_t>(aBeats.back().first * 0.1);
-		auto maxIdx = static_cast<size_t>(aBeats.back().first * 0.9);
-		Int32 maxLevel = 0;
-		for (const auto & beat: aBeats)
+		auto count = aSimilarities.size();
+		size_t bestIdx = count;
+		for (size_t i = 0; i < count; ++i)
 		{
-			if ((beat.first < minIdx) || (beat.first > maxIdx))
+			if (aIsEvaluated[i] && ((bestIdx == count) || (aSimilarities[i] > aSimilarities[bestIdx])))
 			{
-				continue;
+				bestIdx = i;
 			}
-			auto level = std::abs(aLevels[beat.first]);
-			res[beat.first] = level;
-			if (level > maxLevel)
+		}
+		if (bestIdx == count)
+		{
+			return {0, -std::numeric_limits<double>::infinity()};
+		}
+		auto bestMpm = beatStridesToBpm(aOptions, aMinOfs + bestIdx);
+		auto second = -std::numeric_limits<double>::infinity();
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (
+				aIsEvaluated[i] &&
+				(aSimilarities[i] > second) &&
+				!isCloseEnoughMpm(beatStridesToBpm(aOptions, aMinOfs + i), bestMpm)
+			)
 			{
-				maxLevel = level;
+				second = aSimilarities[i];
 			}
 		}
-		aOutMaxLevel = maxLevel;
-		return res;
+		return {bestIdx, second};
 	}
 
 
 
 
-
-	/** Converts the number of strides (across calculated beats) that make up a time interval,
-	into the corresponding BPM, rounded to 2 decimal places.
-	The inverse function is mpmToBeatStrides() */
-	double beatStridesToBpm(
+	/** Calculates the best match for the tempo, and its confidence, based on the autocorrelation of the
+	onset-strength envelope of the levels.
+	The envelope is the positive part of the level differences (only the rising edges), within the middle 80 %
+	of the song, timewise. The autocorrelation is calculated for all offsets at once using FFT, in O(n log n).
+	The confidence is calculated the same way as in detectTempoFromBeats(), from the best and second-best
+	tempo's correlation. The returned confidence ranges from 0 to 100. */
+	std::pair<double, double> detectTempoFromAutocorrelation(
 		const TempoDetector::Options & aOptions,
-		size_t aBeatStrides
+		const std::vector<Int32> & aLevels
 	)
 	{
-		auto bpm = static_cast<double>(aOptions.mSampleRate * 60 / static_cast<int>(aOptions.mStride)) / aBeatStrides;
-		return std::floor(bpm * 100 + 0.5) / 100;
-	}
-
-
+		auto minOfs = floor<size_t>(mpmToBeatStrides(aOptions, aOptions.mMaxTempo));
+		auto maxOfs = ceil<size_t> (mpmToBeatStrides(aOptions, aOptions.mMinTempo));
+		auto minIdx = aLevels.size() / 10;
+		auto maxIdx = aLevels.size() * 9 / 10;
+		if ((minOfs > maxOfs) || (minIdx == 0) || (maxIdx <= minIdx + maxOfs))
+		{
+			return {0, 0};
+		}
 
+		// Calculate the onset-strength envelope, with its mean removed:
+		std::vector<double> envelope;
+		envelope.reserve(maxIdx - minIdx);
+		double sum = 0;
+		for (size_t i = minIdx; i < maxIdx; ++i)
+		{
+			auto onset = std::max(aLevels[i] - aLevels[i - 1], 0);
+			envelope.push_back(onset);
+			sum += onset;
+		}
+		auto mean = sum / envelope.size();
+		for (auto & e: envelope)
+		{
+			e -= mean;
+		}
 
+		// Correlate, normalizing each offset by the number of overlapping items:
+		auto corr = autocorrelate(envelope, maxOfs);
+		auto count = envelope.size();
+		std::vector<double> similarities;
+		similarities.reserve(maxOfs - minOfs + 1);
+		for (size_t ofs = minOfs; ofs <= maxOfs; ++ofs)
+		{
+			similarities.push_back(corr[ofs] / (count - ofs));
+		}
 
-	/** Converts the MPM to the stride length (across calculated beats) representing the tempo. */
-	double mpmToBeatStrides(const TempoDetector::Options & aOptions, double aMpm)
-	{
-		return ((aOptions.mSampleRate * 60 / static_cast<int>(aOptions.mStride)) / aMpm);
+		// Find the best and the second-best MPM (that isn't close enough to the best MPM):
+		auto best = findBestSimilarities(aOptions, similarities, std::vector<bool>(similarities.size(), true), minOfs);
+		auto bestSimilarity = similarities[best.first];
+		if ((bestSimilarity <= 0) || (best.second == -std::numeric_limits<double>::infinity()))
+		{
+			return {0, 0};
+		}
+		auto confidence = 100 - 100 * std::max(best.second, 0.0) / bestSimilarity;
+		return {beatStridesToBpm(aOptions, minOfs + best.first), clamp<double>(confidence, 0, 100)};
 	}
 
 
 
 
 
-	/** Calculates levels of the mSamples data.
-	Uses the appropriate algorithm according to mOptions. */
-	std::vector<Int32> calcLevels(const TempoDetector::Options & aOptions)
+	/** Returns the autocorrelation of aValues for each offset in [0, aMaxOfs].
+	Item k of the result is sum(aValues[i] * aValues[i + k]) over all valid i.
+	Uses the Wiener-Khinchin theorem: the values are zero-padded by at least aMaxOfs items, to avoid the circular
+	wrap-around for the needed offsets, transformed using FFT, squared in magnitude and transformed back. */
+	static std::vector<double> autocorrelate(const std::vector<double> & aValues, size_t aMaxOfs)
 	{
-		switch (aOptions.mLevelAlgorithm)
+		size_t size = 1;
+		while (size < aValues.size() + aMaxOfs)
 		{
-			case TempoDetector::laSumDist:               return calcLevelsSumDist      (aOptions);
-			case TempoDetector::laDiscreetSineTransform: return calcLevelsDST          (aOptions);
-			case TempoDetector::laMinMax:                return calcLevelsMinMax       (aOptions);
-			case TempoDetector::laSumDistMinMax:         return calcLevelsSumDistMinMax(aOptions);
+			size *= 2;
 		}
-		assert(!"Invalid level algorithm");
-		return {};
+		std::vector<std::complex<double>> spectrum(aValues.cbegin(), aValues.cend());
+		spectrum.resize(size);
+		fft(spectrum, false);
+		for (auto & s: spectrum)
+		{
+			s = std::norm(s);
+		}
+		fft(spectrum, true);
+		std::vector<double> res;
+		res.reserve(aMaxOfs + 1);
+		for (size_t i = 0; i <= aMaxOfs; ++i)
+		{
+			res.push_back(spectrum[i].real() / size);
+		}
+		return res;
 	}
 
 
 
 
 
-	/** Calculates the loudness levels from the input mSamples data.
-	This simply assumes that the more the waveform changes, the louder it is, hence the level is just
-	a sum of the distances between neighboring samples across the window.*/
-	std::vector<Int32> calcLevelsSumDist(const TempoDetector::Options & aOptions)
+	/** Transforms aValues in-place, using the iterative radix-2 FFT.
+	The size of aValues needs to be a power of 2.
+	If aIsInverse is true, calculates the inverse transform, without the 1 / N scaling.
+	The complex multiplication is written out by hand, std::complex's operator * is slowed down by the
+	NaN / infinity handling required by the standard. */
+	static void fft(std::vector<std::complex<double>> & aValues, bool aIsInverse)
 	{
-		std::vector<Int32> res;
-		res.reserve(mNumSamples / aOptions.mStride);
+		auto size = aValues.size();
+
+		// Reorder the values into the bit-reversed order:
+		for (size_t i = 1, j = 0; i < size; ++i)
+		{
+			auto bit = size >> 1;
+			for (; (j & bit) != 0; bit >>= 1)
+			{
+				j ^= bit;
+			}
+			j ^= bit;
+			if (i < j)
+			{
+				std::swap(aValues[i], aValues[j]);
+			}
+		}
 
-		// Calculate the first window:
-		Int32 current = 0;
-		for (size_t i = 0; i < aOptions.mWindowSize; ++i)
+		// Precalculate the twiddle factors for the largest butterfly, the smaller ones use every n-th item:
+		static const double pi = 3.14159265358979323846;
+		auto half = size / 2;
+		std::vector<double> twiddleRe(half), twiddleIm(half);
+		for (size_t k = 0; k < half; ++k)
 		{
-			current += std::abs(mSamples[i] - mSamples[i + 1]);
+			auto angle = 2 * pi * k / size;
+			twiddleRe[k] = std::cos(angle);
+			twiddleIm[k] = aIsInverse ? std::sin(angle) : -std::sin(angle);
 		}
-		res.push_back(current);
 
-		// Calculate the next windows, relatively to the current one:
-		size_t maxPos = mNumSamples - aOptions.mWindowSize - aOptions.mStride - 1;
-		for (size_t curPos = 0; curPos < maxPos; curPos += aOptions.mStride)
+		// Butterflies:
+		for (size_t len = 2; len <= size; len *= 2)
 		{
-			for (size_t i = 0; i < aOptions.mStride; ++i)
+			auto halfLen = len / 2;
+			auto twiddleStep = size / len;
+			for (size_t start = 0; start < size; start += len)
 			{
-				current += std::abs(mSamples[curPos + i + aOptions.mWindowSize] - mSamples[curPos + i + aOptions.mWindowSize + 1]);
-				current -= std::abs(mSamples[curPos + i] - mSamples[curPos + i + 1]);
+				for (size_t k = 0; k < halfLen; ++k)
+				{
+					auto wRe = twiddleRe[k * twiddleStep];
+					auto wIm = twiddleIm[k * twiddleStep];
+					auto even = aValues[start + k];
+					auto odd = aValues[start + k + halfLen];
+					std::complex<double> oddW(odd.real() * wRe - odd.imag() * wIm, odd.real() * wIm + odd.imag() * wRe);
+					aValues[start + k] = even + oddW;
+					aValues[start + k + halfLen] = even - oddW;
+				}
 			}
-			res.push_back(current);
 		}
-		return res;
 	}
 
 
 
 
-	/** Calculates the loudness levels from the input mSamples data.
-	This simply assumes that the more the waveform changes, the louder it is, hence the level is just
-	a sum of the distances between neighboring samples across the window.*/
-	std::vector<Int32> calcLevelsSumDistMinMax(const TempoDetector::Options & aOptions)
+
+	/** Returns true if the two MPMs are close enough to be considered a single match. */
+	static bool isCloseEnoughMpm(double aMpm1, double aMpm2)
 	{
-		std::vector<Int32> res;
-		res.reserve(mNumSamples / aOptions.mStride);
+		return (std::abs(aMpm1 - aMpm2) <= 1.5);
+	}
+
+
 
-		// Calculate the first window:
-		Int32 current = 0;
-		for (size_t i = 0; i < aOptions.mWindowSize; ++i)
+
+
+	/** Calculates an upper bound of the self-similarity (see calcSimilaritiesBeatsWeight()) for each block of
+	SIMILARITY_BLOCK_SIZE consecutive offsets in the range [aMinOfs, aMaxOfs].
+	Returns the bounds indexed by ((offset - aMinOfs) / SIMILARITY_BLOCK_SIZE).
+	A beat contributes at most aMaxLevel to the similarity for an offset, and only if there's a beat at that offset
+	from it, or right next to it; so the bound for a block counts aMaxLevel for each beat that has any beat
+	within the block's offsets (+- 1). That is looked up from the prefix counts of the beats, in constant time. */
+	std::vector<double> calcSimilarityBounds(
+		const std::vector<std::pair<size_t, Int32>> & aBeats,
+		const std::vector<Int32> & aBeatLevels,
+		size_t aMinOfs,
+		size_t aMaxOfs,
+		Int32 aMaxLevel
+	)
+	{
+		// counts[i] is the number of beats in aBeatLevels[0 .. i - 1]:
+		std::vector<size_t> counts(aBeatLevels.size() + 1);
+		for (size_t i = 0; i < aBeatLevels.size(); ++i)
 		{
-			current += std::abs(mSamples[i] - mSamples[i + 1]);
+			counts[i + 1] = counts[i] + ((aBeatLevels[i] >= 0) ? 1 : 0);
 		}
-		res.push_back(current);
 
-		// Calculate the next windows, relatively to the current one:
-		size_t maxPos = mNumSamples - aOptions.mWindowSize - aOptions.mStride - 1;
-		for (size_t curPos = 0; curPos < maxPos; curPos += aOptions.mStride)
+		// The offsets [first, last] of a block look at aBeatLevels[beat + aMinOfs + first .. beat + aMinOfs + last + 2]:
+		auto numOfs = aMaxOfs - aMinOfs + 1;
+		auto numBlocks = (numOfs + SIMILARITY_BLOCK_SIZE - 1) / SIMILARITY_BLOCK_SIZE;
+		std::vector<Int64> sums(numBlocks);
+		for (const auto & beat: aBeats)
 		{
-			for (size_t i = 0; i < aOptions.mStride; ++i)
-			{
-				current += std::abs(mSamples[curPos + i + aOptions.mWindowSize] - mSamples[curPos + i + aOptions.mWindowSize + 1]);
-				current -= std::abs(mSamples[curPos + i] - mSamples[curPos + i + 1]);
-			}
-			auto minVal = mSamples[curPos];
-			auto maxVal = minVal;
-			for (size_t i = 0; i < aOptions.mWindowSize; ++i)
+			auto base = beat.first + aMinOfs;
+			for (size_t block = 0; block < numBlocks; ++block)
 			{
-				auto val = mSamples[curPos + i];
-				if (val > maxVal)
-				{
-					maxVal = val;
-				}
-				if (val < minVal)
+				auto first = base + block * SIMILARITY_BLOCK_SIZE;
+				auto end = base + std::min((block + 1) * SIMILARITY_BLOCK_SIZE, numOfs) + 2;
+				if (counts[end] > counts[first])
 				{
-					minVal = val;
+					sums[block] += aMaxLevel;
 				}
 			}
-			res.push_back((current + maxVal - minVal) / 2);
 		}
-		return res;
+		return std::vector<double>(sums.cbegin(), sums.cend());
 	}
 
 
 
 
-	/** Calculates the loudness levels from the input mSamples data.
-	The level is calculated as the difference between the max and min value in the sample range. */
-	std::vector<Int32> calcLevelsMinMax(const TempoDetector::Options & aOptions)
-	{
-		std::vector<Int32> res;
-		res.reserve(mNumSamples / aOptions.mStride);
 
-		// Calculate each window:
-		size_t maxPos = mNumSamples - aOptions.mWindowSize - aOptions.mStride - 1;
-		for (size_t curPos = 0; curPos < maxPos; curPos += aOptions.mStride)
+	/** Calculates the self-similarity on aBeats for each offset in the range [aMinOfs, aMaxOfs].
+	aBeatLevels is the dense beat lookup table created by prepareBeats().
+	Returns the similarities indexed by (offset - aMinOfs). Each similarity is a number that can be
+	compared to other similarities.
+	The beats are processed one by one, for each beat the offsets are a straight linear scan over
+	aBeatLevels, with no branching, so that the compiler can vectorize it. */
+	std::vector<double> calcSimilaritiesBeatsWeight(
+		const std::vector<std::pair<size_t, Int32>> & aBeats,
+		const std::vector<Int32> & aBeatLevels,
+		size_t aMinOfs,
+		size_t aMaxOfs,
+		Int32 aMaxLevel
+	)
+	{
+		auto numOfs = aMaxOfs - aMinOfs + 1;
+		std::vector<Int64> sums(numOfs);
+		auto sumsData = sums.data();
+		for (const auto & beat: aBeats)
 		{
-			auto minVal = mSamples[curPos];
-			auto maxVal = minVal;
-			for (size_t i = 0; i < aOptions.mWindowSize; ++i)
+			// Index 1 in aBeatLevels is beat index 0, so the matching beat for offset ofs is at [beat + ofs + 1]:
+			auto weight = beat.second;
+			auto prevLevels = aBeatLevels.data() + beat.first + aMinOfs;
+			auto levels = prevLevels + 1;
+			auto nextLevels = prevLevels + 2;
+			for (size_t i = 0; i < numOfs; ++i)
 			{
-				auto val = mSamples[curPos + i];
-				if (val > maxVal)
-				{
-					maxVal = val;
-				}
-				if (val < minVal)
-				{
-					minVal = val;
-				}
+				// An exact match is preferred, then the next level, then the previous one:
+				auto exact = levels[i];
+				auto next  = nextLevels[i];
+				auto prev  = prevLevels[i];
+				auto near  = (next >= 0) ? next : prev;
+				Int32 exactSim = aMaxLevel - std::abs(weight - exact);
+				Int32 nearSim  = (near >= 0) ? (aMaxLevel - std::abs(weight - near) / 2) : 0;
+				sumsData[i] += (exact >= 0) ? exactSim : nearSim;
 			}
-			res.push_back(maxVal - minVal);
 		}
-		return res;
+		return std::vector<double>(sums.cbegin(), sums.cend());
 	}
 
 
 
 
-	/** Calculates the loudness levels from the input mSamples data, using discreet sine transform.
-	The idea is that a change in what we think of as levels should be across all frequencies.
-	So we sample a few frequency bands and calculate the levels from those.
-	Doesn't seem to work so well as the Simple method. */
-	std::vector<Int32> calcLevelsDST(const TempoDetector::Options & aOptions)
-	{
-		std::vector<Int32> res;
-		res.reserve(mNumSamples / aOptions.mStride);
 
-		// Calculate each window's level:
-		size_t maxPos = mNumSamples - aOptions.mWindowSize - aOptions.mStride - 1;
-		static const float freq[] = {
-			600,  //   80 Hz
-			250,  //  192 Hz
-			109,  //  440 Hz
-			48,   // 1000 Hz
-		};
-		static const size_t NUM_FREQ = sizeof(freq) / sizeof(*freq);
-		float Int32Min = static_cast<float>(std::numeric_limits<Int32>::min());
-		float Int32Max = static_cast<float>(std::numeric_limits<Int32>::max());
-		for (size_t curPos = 0; curPos < maxPos; curPos += aOptions.mStride)
+	/** Prepares a dense lookup-table of beats based on the input calculated beats.
+	Returns a vector indexed by (beatIndex + 1) that contains the soundLevel for each detected beat,
+	and -1 for level indices that have no beat.
+	The table is large enough to look up any beat index up to (last beat + aMaxOfs + 1) without bounds checks.
+	Only the beats within the middle 80 % of the song, timewise, are put into the table. */
+	std::vector<Int32> prepareBeats(
+		const std::vector<std::pair<size_t, Int32>> & aBeats,
+		const std::vector<Int32> & aLevels,
+		size_t aMaxOfs,
+		Int32 & aOutMaxLevel
+	)
+	{
+		std::vector<Int32> res(aBeats.back().first + aMaxOfs + 3, -1);
+		auto minIdx = static_cast<size_t>(aBeats.back().first * 0.1);
+		auto maxIdx = static_cast<size_t>(aBeats.back().first * 0.9);
+		Int32 maxLevel = 0;
+		for (const auto & beat: aBeats)
 		{
-			float freqCoeff[NUM_FREQ] = {};
-			for (size_t i = 0; i < aOptions.mWindowSize; ++i)
+			if ((beat.first < minIdx) || (beat.first > maxIdx))
 			{
-				auto sampleIndex = i + curPos;
-				auto sampleIndexF = static_cast<float>(i + curPos);
-				auto mSamplesSample = mSamples[sampleIndex];
-				for (size_t f = 0; f < NUM_FREQ; ++f)
-				{
-					freqCoeff[f] += mSamplesSample * sin(sampleIndexF / freq[f]);
-				}
+				continue;
 			}
-			float level = 0;
-			for (auto f: freqCoeff)
+			auto level = std::abs(aLevels[beat.first]);
+			res[beat.first + 1] = level;
+			if (level > maxLevel)
 			{
-				level += std::abs(f);
+				maxLevel = level;
 			}
-			res.push_back(static_cast<Int32>(clamp(level, Int32Min, Int32Max)));
 		}
+		aOutMaxLevel = maxLevel;
 		return res;
 	}
 
 
 
 
-	/** Normalizes the input levels across the mNormalizeLevelsWindowSize neighbors. */
+
+	/** Converts the number of strides (across calculated beats) that make up a time interval,
+	into the corresponding BPM, rounded to 2 decimal places.
+	The inverse function is mpmToBeatStrides() */
+	double beatStridesToBpm(
+		const TempoDetector::Options & aOptions,
+		size_t aBeatStrides
+	)
+	{
+		auto bpm = static_cast<double>(aOptions.mSampleRate * 60 / static_cast<int>(aOptions.mStride)) / aBeatStrides;
+		return std::floor(bpm * 100 + 0.5) / 100;
+	}
+
+
+
+
+
+	/** Converts the MPM to the stride length (across calculated beats) representing the tempo. */
+	double mpmToBeatStrides(const TempoDetector::Options & aOptions, double aMpm)
+	{
+		return ((aOptions.mSampleRate * 60 / static_cast<int>(aOptions.mStride)) / aMpm);
+	}
+
+
+
+
+
+	/** Normalizes the input levels across the mNormalizeLevelsWindowSize neighbors.
+	The local min and max are tracked using monotonic deques, so the complexity doesn't depend on the window size. */
 	std::vector<Int32> normalizeLevels(
 		const TempoDetector::Options & aOptions,
 		const std::vector<Int32> & aLevels
@@ -452,23 +612,40 @@ public:
 		auto count = aLevels.size();
 		normalizedLevels.resize(count);
 		auto win = aOptions.mNormalizeLevelsWindowSize;
+		std::vector<size_t> minQueue, maxQueue;  // Indices of the increasing / decreasing levels, fronts at [minHead] / [maxHead]
+		minQueue.reserve(count);
+		maxQueue.reserve(count);
+		size_t minHead = 0, maxHead = 0;
+		size_t endIdx = 0;  // Levels before endIdx have already been pushed into the queues
 		for (size_t i = 0; i < count; ++i)
 		{
+			// The window for level i is [startIdx, endIdx), but always contains at least the startIdx level:
 			size_t startIdx = (i < win) ? 0 : i - win;
-			size_t endIdx = std::min(i + win, count);
-			auto lMin = aLevels[startIdx];
-			auto lMax = aLevels[startIdx];
-			for (size_t j = startIdx + 1; j < endIdx; ++j)
+			size_t newEndIdx = std::max(std::min(i + win, count), startIdx + 1);
+			for (; endIdx < newEndIdx; ++endIdx)
 			{
-				if (aLevels[j] < lMin)
+				auto level = aLevels[endIdx];
+				while ((minQueue.size() > minHead) && (aLevels[minQueue.back()] >= level))
 				{
-					lMin = aLevels[j];
+					minQueue.pop_back();
 				}
-				else if (aLevels[j] > lMax)
+				minQueue.push_back(endIdx);
+				while ((maxQueue.size() > maxHead) && (aLevels[maxQueue.back()] <= level))
 				{
-					lMax = aLevels[j];
+					maxQueue.pop_back();
 				}
+				maxQueue.push_back(endIdx);
+			}
+			while (minQueue[minHead] < startIdx)
+			{
+				++minHead;
 			}
+			while (maxQueue[maxHead] < startIdx)
+			{
+				++maxHead;
+			}
+			auto lMin = aLevels[minQueue[minHead]];
+			auto lMax = aLevels[maxQueue[maxHead]];
 			normalizedLevels[i] = static_cast<Int32>(65536.0f * (aLevels[i] - lMin) / (lMax - lMin + 1));
 		}
 		return normalizedLevels;
@@ -484,9 +661,15 @@ public:
 		const std::vector<Int32> & aLevels
 	)
 	{
+		// Not enough levels for even a single beat (song too short):
+		auto count = aLevels.size();
+		if (count <= 2 * aOptions.mLocalMaxDistance)
+		{
+			return {};
+		}
+
 		// Calculate the climbing tendencies in aLevels:
 		std::vector<Int32> climbs;
-		auto count = aLevels.size();
 		climbs.reserve(count);
 		climbs.push_back(0);
 		Int32 maxClimb = 0;
@@ -505,21 +688,21 @@ public:
 			}
 		}
 
-		// Calculate beats and their weight:
+		// Calculate beats and their weight.
+		// A beat is a climb that is strictly larger than all the climbs in [i - dist, i + dist), except itself;
+		// the maxima of the windows on each side are calculated up front in linear time:
 		std::vector<std::pair<size_t, Int32>> weightedBeats;
-		auto maxIdx = aLevels.size() - aOptions.mLocalMaxDistance;
-		for (size_t i = aOptions.mLocalMaxDistance; i < maxIdx; ++i)
+		auto dist = aOptions.mLocalMaxDistance;
+		auto maxIdx = aLevels.size() - dist;
+		auto maxBefore = slidingWindowMax(climbs, dist);  // [k] = max(climbs[k .. k + dist - 1])
+		auto maxAfter = slidingWindowMax(climbs, dist - 1);  // [k] = max(climbs[k .. k + dist - 2])
+		for (size_t i = dist; i < maxIdx; ++i)
 		{
-			bool isLocalMaximum = true;
-			for (size_t j = i - aOptions.mLocalMaxDistance; j < i + aOptions.mLocalMaxDistance; ++j)
+			if ((dist > 0) && (maxBefore[i - dist] >= climbs[i]))
 			{
-				if ((i != j) && (climbs[j] >= climbs[i]))
-				{
-					isLocalMaximum = false;
-					break;
-				}
+				continue;
 			}
-			if (!isLocalMaximum)
+			if ((dist > 1) && (maxAfter[i + 1] >= climbs[i]))
 			{
 				continue;
 			}
@@ -552,12 +735,6 @@ public:
 
 protected:
 
-	/** The mSamples samples to scan (16-bit signed mono, mNumSamples-length). */
-	const Int16 * const mSamples;
-
-	/** Number of samples in mSamples; */
-	const size_t mNumSamples;
-
 	/** The options for the detection. */
 	const TempoDetector::Options & mOptions;
 };
@@ -566,6 +743,274 @@ protected:
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// TempoDetector::Scanner::LevelState:
+
+TempoDetector::Scanner::LevelState::LevelState(const Options & aOptions):
+	mOptions(aOptions),
+	mNextLevelPos(0),
+	mHasInitialWindow(false),
+	mLevelsTime(0)
+{
+	// Prefer the kernel specialized for the stride and window size, used by the default options.
+	// Of the generic ones, the SIMD kernels scan each whole window, the sliding kernel scans each sample once,
+	// but is slower per sample; the sliding one wins when the windows overlap a lot
+	// (measured crossover at about 512 levels per window):
+	mCalcMinMax = TempoDetectorKernels::specializedMinMax(aOptions.mStride, aOptions.mWindowSize);
+	if (mCalcMinMax == nullptr)
+	{
+		mCalcMinMax = (aOptions.mWindowSize >= 512 * aOptions.mStride) ?
+			&TempoDetectorKernels::calcMinMaxSliding :
+			TempoDetectorKernels::best().mCalcMinMax;
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TempoDetector::Scanner:
+
+TempoDetector::Scanner::Scanner(const Options & aOptions):
+	Scanner(std::vector<Options>{aOptions})
+{
+}
+
+
+
+
+
+TempoDetector::Scanner::Scanner(const std::vector<Options> & aOptions):
+	mSamplesStart(0),
+	mSharedLevelsTime(0)
+{
+	for (const auto & opt: aOptions)
+	{
+		assert(opt.mSampleRate == aOptions[0].mSampleRate);  // All options must share the samplerate
+		mStates.emplace_back(opt);
+	}
+}
+
+
+
+
+
+void TempoDetector::Scanner::feed(const Int16 * aSamples, size_t aNumSamples)
+{
+	if (aNumSamples == 0)
+	{
+		return;
+	}
+
+	// Append the samples and their distance prefix sums:
+	auto startTime = std::chrono::steady_clock::now();
+	auto prevSize = mSamples.size();
+	mSamples.insert(mSamples.end(), aSamples, aSamples + aNumSamples);
+	mDistPrefix.resize(mSamples.size());
+	if (prevSize == 0)
+	{
+		// The very first sample in the song has no predecessor:
+		assert(mSamplesStart == 0);
+		mDistPrefix[0] = 0;
+		prevSize = 1;
+	}
+	TempoDetectorKernels::best().mCalcDistPrefix(
+		mSamples.data() + prevSize - 1,
+		mSamples.size() - prevSize,
+		mDistPrefix[prevSize - 1],
+		mDistPrefix.data() + prevSize
+	);
+	mSharedLevelsTime += secondsSince(startTime);
+
+	// Calculate the levels for all options:
+	auto minNeededPos = mSamplesStart + mSamples.size();
+	for (auto & state: mStates)
+	{
+		startTime = std::chrono::steady_clock::now();
+		calcAvailableLevels(state);
+		state.mLevelsTime += secondsSince(startTime);
+		minNeededPos = std::min(minNeededPos, state.mNextLevelPos);
+	}
+
+	// Drop the samples that won't be needed anymore (keep at least the last one for the next distance):
+	auto numToDrop = std::min(minNeededPos - mSamplesStart, mSamples.size() - 1);
+	if (numToDrop > 0)
+	{
+		auto dropEnd = static_cast<std::ptrdiff_t>(numToDrop);
+		mSamples.erase(mSamples.begin(), mSamples.begin() + dropEnd);
+		mDistPrefix.erase(mDistPrefix.begin(), mDistPrefix.begin() + dropEnd);
+		mSamplesStart += numToDrop;
+	}
+}
+
+
+
+
+
+std::vector<TempoDetector::ResultPtr> TempoDetector::Scanner::finish(size_t aNumThreads)
+{
+	mSamples.clear();
+	mSamples.shrink_to_fit();
+	mDistPrefix.clear();
+	mDistPrefix.shrink_to_fit();
+
+	// Each thread (including this one) picks the next unprocessed options until all are done:
+	std::vector<ResultPtr> res(mStates.size());
+	std::atomic<size_t> nextState(0);
+	auto processStates = [this, &res, &nextState]()
+	{
+		for (auto idx = nextState++; idx < mStates.size(); idx = nextState++)
+		{
+			Detector d(mStates[idx].mOptions);
+			res[idx] = d.process(std::move(mStates[idx].mLevels));
+			res[idx]->mTimings.mLevels = mStates[idx].mLevelsTime + mSharedLevelsTime / static_cast<double>(mStates.size());
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t i = std::min(aNumThreads, mStates.size()); i > 1; --i)
+	{
+		threads.emplace_back(processStates);
+	}
+	processStates();
+	for (auto & thr: threads)
+	{
+		thr.join();
+	}
+	return res;
+}
+
+
+
+
+
+void TempoDetector::Scanner::calcAvailableLevels(LevelState & aState)
+{
+	const auto & options = aState.mOptions;
+	auto windowSize = options.mWindowSize;
+	auto stride = options.mStride;
+	auto numSamples = mSamplesStart + mSamples.size();
+	auto & levels = aState.mLevels;
+	auto & pos = aState.mNextLevelPos;
+
+	// Each level needs (windowSize + stride + 2) samples from its window start to be available:
+	switch (options.mLevelAlgorithm)
+	{
+		case laSumDist:
+		case laSumDistMinMax:
+		{
+			// The first window:
+			if (!aState.mHasInitialWindow)
+			{
+				if (numSamples <= windowSize)
+				{
+					return;
+				}
+				levels.push_back(sumDistAt(0, windowSize));
+				aState.mHasInitialWindow = true;
+			}
+
+			// The next windows, each one stride further than the previous one:
+			if (options.mLevelAlgorithm == laSumDistMinMax)
+			{
+				auto numLevels = calcMinMaxLevels(aState);
+				auto out = levels.data() + levels.size() - numLevels;
+				for (size_t i = 0; i < numLevels; ++i, pos += stride)
+				{
+					out[i] = (sumDistAt(pos + stride, windowSize) + out[i]) / 2;
+				}
+			}
+			else
+			{
+				for (; pos + windowSize + stride + 1 < numSamples; pos += stride)
+				{
+					levels.push_back(sumDistAt(pos + stride, windowSize));
+				}
+			}
+			break;
+		}
+		case laMinMax:
+		{
+			pos += calcMinMaxLevels(aState) * stride;
+			break;
+		}
+		case laDiscreetSineTransform:
+		{
+			for (; pos + windowSize + stride + 1 < numSamples; pos += stride)
+			{
+				levels.push_back(dstAt(pos, windowSize));
+			}
+			break;
+		}
+	}
+}
+
+
+
+
+
+size_t TempoDetector::Scanner::calcMinMaxLevels(LevelState & aState)
+{
+	// Count the levels for which all the samples are available:
+	const auto & options = aState.mOptions;
+	auto numSamples = mSamplesStart + mSamples.size();
+	auto firstUnavailable = aState.mNextLevelPos + options.mWindowSize + options.mStride + 1;
+	if (firstUnavailable >= numSamples)
+	{
+		return 0;
+	}
+	auto numLevels = (numSamples - firstUnavailable + options.mStride - 1) / options.mStride;
+
+	// Calculate the levels:
+	auto & levels = aState.mLevels;
+	levels.resize(levels.size() + numLevels);
+	aState.mCalcMinMax(
+		mSamples.data() + (aState.mNextLevelPos - mSamplesStart),
+		numLevels,
+		options.mStride,
+		options.mWindowSize,
+		levels.data() + levels.size() - numLevels
+	);
+	return numLevels;
+}
+
+
+
+
+
+/** Calculates the level of a single window using discreet sine transform.
+The idea is that a change in what we think of as levels should be across all frequencies.
+So we sample a few frequency bands and calculate the levels from those; the level is the sum of the bands'
+correlations with sin, phased relative to the song start.
+Doesn't seem to work so well as the Simple method. */
+Int32 TempoDetector::Scanner::dstAt(size_t aIndex, size_t aWindowSize) const
+{
+	// The band frequencies, in radians per sample (at the default 500 Hz samplerate):
+	static const SpectralBands bands({
+		1.0 / 600,  //   80 Hz
+		1.0 / 250,  //  192 Hz
+		1.0 / 109,  //  440 Hz
+		1.0 / 48,   // 1000 Hz
+	});
+	static const size_t NUM_FREQ = 4;
+	static const double Int32Min = static_cast<double>(std::numeric_limits<Int32>::min());
+	static const double Int32Max = static_cast<double>(std::numeric_limits<Int32>::max());
+	assert(bands.numBands() == NUM_FREQ);
+	assert(aIndex >= mSamplesStart);
+	std::complex<double> freqCoeff[NUM_FREQ];
+	bands.correlate(mSamples.data() + (aIndex - mSamplesStart), aWindowSize, aIndex, freqCoeff);
+	double level = 0;
+	for (const auto & f: freqCoeff)
+	{
+		level += std::abs(f.imag());
+	}
+	return static_cast<Int32>(clamp(level, Int32Min, Int32Max));
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // TempoDetector:
 
@@ -575,8 +1020,25 @@ TempoDetector::ResultPtr TempoDetector::scan(
 	const Options & aOptions
 )
 {
-	Detector d(aSamples, aNumSamples, aOptions);
-	return d.process();
+	Scanner scanner(aOptions);
+	scanner.feed(aSamples, aNumSamples);
+	return scanner.finish()[0];
+}
+
+
+
+
+
+std::vector<TempoDetector::ResultPtr> TempoDetector::scan(
+	const Int16 * aSamples,
+	size_t aNumSamples,
+	const std::vector<Options> & aOptions,
+	size_t aNumThreads
+)
+{
+	Scanner scanner(aOptions);
+	scanner.feed(aSamples, aNumSamples);
+	return scanner.finish(aNumThreads);
 }
 
 
@@ -648,6 +1110,27 @@ std::pair<double, double> TempoDetector::aggregateResults(const std::vector<Temp
 
 
 
+double TempoDetector::normalizedConfidence(const std::vector<TempoDetector::ResultPtr> & aResults, double aTempo)
+{
+	if (aResults.empty())
+	{
+		return 0;
+	}
+	double sumConfidence = 0;
+	for (const auto & res: aResults)
+	{
+		if (Detector::isCompatibleTempo(res->mTempo, aTempo))
+		{
+			sumConfidence += res->mConfidence;
+		}
+	}
+	return sumConfidence / static_cast<double>(aResults.size());
+}
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // TempoDetector::Options:
 
@@ -660,7 +1143,8 @@ TempoDetector::Options::Options():
 	mShouldNormalizeLevels(true),
 	mNormalizeLevelsWindowSize(31),
 	mMaxTempo(200),
-	mMinTempo(15)
+	mMinTempo(15),
+	mTempoAlgorithm(taBeatSimilarity)
 {
 }
 
@@ -692,6 +1176,7 @@ bool TempoDetector::Options::operator <(const TempoDetector::Options & aOther)
 	}
 	COMPARE(mMaxTempo);
 	COMPARE(mMinTempo);
+	COMPARE(mTempoAlgorithm);
 	return false;
 }
 
@@ -710,6 +1195,7 @@ bool TempoDetector::Options::operator ==(const TempoDetector::Options & aOther)
 		(mShouldNormalizeLevels == aOther.mShouldNormalizeLevels) &&
 		(mNormalizeLevelsWindowSize == aOther.mNormalizeLevelsWindowSize) &&
 		(mMaxTempo == aOther.mMaxTempo) &&
-		(mMinTempo == aOther.mMinTempo)
+		(mMinTempo == aOther.mMinTempo) &&
+		(mTempoAlgorithm == aOther.mTempoAlgorithm)
 	);
 }
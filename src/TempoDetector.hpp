@@ -10,6 +10,7 @@
 
 using Int16 = int16_t;
 using Int32 = int32_t;
+using Int64 = int64_t;
 using UInt32 = uint32_t;
 
 
@@ -33,6 +34,14 @@ public:
 	};
 
 
+	/** Specifies the algorithm to use for detecting the tempo from the levels. */
+	enum ETempoAlgorithm
+	{
+		taBeatSimilarity,   ///< Detect beats in the levels, then match the beats against themselves at each tempo's offset
+		taAutocorrelation,  ///< Autocorrelation of the onset-strength envelope of the levels, calculated using FFT
+	};
+
+
 
 	/** Holds the options for a single detection. */
 	struct Options
@@ -64,6 +73,9 @@ public:
 		/** The minimum tempo that is tested in the detection. */
 		int mMinTempo;
 
+		/** The algorithm to use for detecting the tempo from the levels. */
+		ETempoAlgorithm mTempoAlgorithm;
+
 		Options(const Options &) = default;
 		Options(Options &&) = default;
 		Options();
@@ -78,6 +90,55 @@ public:
 	/** Holds the calculated result of a single detection. */
 	struct Result
 	{
+		/** The time spent in the individual stages of the detection, in seconds.
+		Used for benchmarking the detector (TempoDetectCmd --bench). */
+		struct Timings
+		{
+			/** Opening the audio file. Filled in only by SongTempoDetector. */
+			double mOpen;
+
+			/** Decoding and resampling the audio. Filled in only by SongTempoDetector. */
+			double mDecode;
+
+			/** Calculating the levels from the audio.
+			The work shared by all the options in a Scanner is split evenly among their results. */
+			double mLevels;
+
+			/** Normalizing the levels and detecting the beats. */
+			double mBeats;
+
+			/** Matching the tempo to the beats (or the levels, for taAutocorrelation). */
+			double mTempo;
+
+
+			Timings():
+				mOpen(0),
+				mDecode(0),
+				mLevels(0),
+				mBeats(0),
+				mTempo(0)
+			{
+			}
+
+			/** Adds the timings from aOther to this object, stage by stage. */
+			Timings & operator +=(const Timings & aOther)
+			{
+				mOpen   += aOther.mOpen;
+				mDecode += aOther.mDecode;
+				mLevels += aOther.mLevels;
+				mBeats  += aOther.mBeats;
+				mTempo  += aOther.mTempo;
+				return *this;
+			}
+
+			/** Returns the total time spent in all the stages. */
+			double total() const
+			{
+				return mOpen + mDecode + mLevels + mBeats + mTempo;
+			}
+		};
+
+
 		/** The options used to calculate this result. */
 		Options mOptions;
 
@@ -88,13 +149,17 @@ public:
 		double mConfidence;
 
 		/** A time-sorted vector of beat indices (into mLevels) and their weight.
-		Only contains the beats from the last mOptions item. */
+		Only contains the beats from the last mOptions item.
+		Empty when using the taAutocorrelation tempo algorithm, which doesn't detect individual beats. */
 		std::vector<std::pair<size_t, Int32>> mBeats;
 
 		/** A vector of all levels calculated for the audio.
 		Only contains the levels from the last mOptions item. */
 		std::vector<Int32> mLevels;
 
+		/** The time spent in the individual stages while calculating this result. */
+		Timings mTimings;
+
 
 		/** Creates an "invalid" result - no confidence, no detected tempo. */
 		Result():
@@ -108,13 +173,132 @@ public:
 
 
 
+	/** Incremental detector that is fed the audio data in chunks, as it is being decoded.
+	The levels are calculated from each chunk as soon as enough audio data is available; only the few
+	samples needed for the next level are kept between chunks. This way the decoding and the analysis
+	can overlap, and the memory usage doesn't depend on the song length (apart from the levels).
+	A single scanner can detect using multiple options at once; the levels for all the options are
+	calculated in a single sweep over the audio data, sharing the prefix sums of the sample distances.
+	All the options need to use the same samplerate.
+	Usage: create with the options, call feed() for each chunk of audio data, then call finish(). */
+	class Scanner
+	{
+	public:
+
+		/** Creates a new scanner that will detect using the specified options. */
+		Scanner(const Options & aOptions);
+
+		/** Creates a new scanner that will detect using each of the specified options.
+		All the options need to have the same mSampleRate. */
+		Scanner(const std::vector<Options> & aOptions);
+
+		/** Processes the next chunk of audio data.
+		aSamples is a pointer to a contiguous block of 16-bit mono samples, aNumSamples in length,
+		continuing right after the previous chunk. */
+		void feed(const Int16 * aSamples, size_t aNumSamples);
+
+		/** Detects the beats and the tempo from all the data fed so far, for each of the options.
+		The options are independent of each other, so they are processed in parallel on up to aNumThreads threads
+		(including the calling thread).
+		Returns the results in the same order as the options given in the constructor.
+		The scanner shouldn't be fed any more data after this call. */
+		std::vector<ResultPtr> finish(size_t aNumThreads = 1);
+
+
+	protected:
+
+		/** The levels calculation state for a single options item. */
+		struct LevelState
+		{
+			/** The options for the detection. */
+			Options mOptions;
+
+			/** The index (within the whole song) of the first sample of the window for the next level. */
+			size_t mNextLevelPos;
+
+			/** True if the initial window has already been processed (laSumDist and laSumDistMinMax only). */
+			bool mHasInitialWindow;
+
+			/** The levels calculated so far. */
+			std::vector<Int32> mLevels;
+
+			/** The time spent calculating mLevels so far, in seconds. */
+			double mLevelsTime;
+
+			/** The kernel calculating the min-max levels (laMinMax and laSumDistMinMax only).
+			Chosen once for the options' stride and window size, see TempoDetectorKernels::CalcMinMaxFn. */
+			void (*mCalcMinMax)(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut);
+
+			LevelState(const Options & aOptions);
+		};
+
+
+		/** The levels calculation state for each of the options. */
+		std::vector<LevelState> mStates;
+
+		/** The audio samples fed so far that will still be needed for calculating further levels. */
+		std::vector<Int16> mSamples;
+
+		/** The prefix sums of the distances between neighboring samples, shared by all the options.
+		mDistPrefix[i] is the sum of abs(s[j] - s[j + 1]) over all j < mSamplesStart + i (within the whole song),
+		so that the sum over any window is a difference of two items. */
+		std::vector<Int64> mDistPrefix;
+
+		/** The index (within the whole song) of the first sample in mSamples and mDistPrefix. */
+		size_t mSamplesStart;
+
+		/** The time spent calculating mDistPrefix so far, in seconds.
+		Split evenly among all the options' level timings in finish(). */
+		double mSharedLevelsTime;
+
+
+		/** Calculates all the levels for the specified options for which there's enough data in mSamples. */
+		void calcAvailableLevels(LevelState & aState);
+
+		/** Returns the sum of distances between neighboring samples in the window starting at the specified
+		index (within the whole song). */
+		Int32 sumDistAt(size_t aIndex, size_t aWindowSize) const
+		{
+			return static_cast<Int32>(mDistPrefix[aIndex + aWindowSize - mSamplesStart] - mDistPrefix[aIndex - mSamplesStart]);
+		}
+
+		/** Calculates the laMinMax levels for all the windows of the specified options for which there's enough
+		data in mSamples, and appends them to the options' levels.
+		Doesn't update the next level position, returns the number of levels appended instead. */
+		size_t calcMinMaxLevels(LevelState & aState);
+
+		/** Returns the level of the window starting at the specified index, using the DST algorithm. */
+		Int32 dstAt(size_t aIndex, size_t aWindowSize) const;
+	};
+
+
+
 	/** Scans the specified audiodata synchronously, using the specified options.
 	aSamples is a pointer to a contiguous block of 16-bit mono samples, aNumSamples in length.
 	The samples are interpreted as having the samplerate of aOptions.mSampleRate.
-	Results from multiple scans over the same song may be aggregated with aggregateResults(). */
+	Results from multiple scans over the same song may be aggregated with aggregateResults().
+	This is a shortcut for feeding all the samples into a Scanner at once. */
 	static ResultPtr scan(const Int16 * aSamples, size_t aNumSamples, const Options & aOptions);
 
+	/** Scans the specified audiodata synchronously, using each of the specified options.
+	The levels for all the options are calculated in a single pass over the samples, then the tempo
+	for the individual options is detected on up to aNumThreads threads in parallel.
+	Returns the results in the same order as aOptions.
+	All the options need to have the same mSampleRate. */
+	static std::vector<ResultPtr> scan(
+		const Int16 * aSamples,
+		size_t aNumSamples,
+		const std::vector<Options> & aOptions,
+		size_t aNumThreads = 1
+	);
+
 	/** Aggregates results from multiple scans (using varying options) into a single tempo + confidence value.
 	Returns the tempo (BPM) and confidence (0 .. 100; higher means more confident). */
 	static std::pair<double, double> aggregateResults(const std::vector<ResultPtr> & aResults);
+
+	/** Returns the confidence of the aggregated tempo, normalized to 0 .. 100 regardless of the number of results:
+	the sum of the confidences of the results that agree with aTempo (aggregateResults()), divided by the number
+	of results. Unlike the aggregated confidence, which is a plain sum when all the results agree, this can be
+	compared to a fixed threshold. */
+	static double normalizedConfidence(const std::vector<ResultPtr> & aResults, double aTempo);
 };
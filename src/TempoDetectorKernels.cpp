@@ -0,0 +1,528 @@
+#include "TempoDetectorKernels.hpp"
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+
+// Detect the x86 SIMD support in the compiler:
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+	#define TEMPODETECTORKERNELS_HAS_X86 1
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define TARGET_AVX2
+	#else
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#else
+	#define TEMPODETECTORKERNELS_HAS_X86 0
+#endif
+
+
+
+
+
+namespace TempoDetectorKernels
+{
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar:
+
+static void calcDistPrefixScalar(const Int16 * aSamples, size_t aCount, Int64 aPrefix, Int64 * aOut)
+{
+	for (size_t i = 0; i < aCount; ++i)
+	{
+		aPrefix += std::abs(aSamples[i] - aSamples[i + 1]);
+		aOut[i] = aPrefix;
+	}
+}
+
+
+
+
+
+/** Returns the difference between the max and the min sample in the window. */
+static Int32 minMaxScalar(const Int16 * aSamples, size_t aWindowSize)
+{
+	auto minVal = aSamples[0];
+	auto maxVal = minVal;
+	for (size_t i = 1; i < aWindowSize; ++i)
+	{
+		auto val = aSamples[i];
+		if (val > maxVal)
+		{
+			maxVal = val;
+		}
+		if (val < minVal)
+		{
+			minVal = val;
+		}
+	}
+	return maxVal - minVal;
+}
+
+
+
+
+
+static void calcMinMaxScalar(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut)
+{
+	for (size_t k = 0; k < aNumLevels; ++k)
+	{
+		aOut[k] = minMaxScalar(aSamples + k * aStride, aWindowSize);
+	}
+}
+
+
+
+
+
+/** The min-max kernel specialized for a fixed stride and window size, which replace the (ignored) parameters.
+The compiler can fully unroll the window loop, used where SIMD is not available. */
+template <size_t Stride, size_t WindowSize>
+static void calcMinMaxFixedScalar(const Int16 * aSamples, size_t aNumLevels, size_t /* aStride */, size_t /* aWindowSize */, Int32 * aOut)
+{
+	for (size_t k = 0; k < aNumLevels; ++k)
+	{
+		aOut[k] = minMaxScalar(aSamples + k * Stride, WindowSize);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Sliding:
+
+void calcMinMaxSliding(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut)
+{
+	if (aNumLevels == 0)
+	{
+		return;
+	}
+
+	// Indices of the increasing / decreasing samples, the fronts are at [minHead] / [maxHead]:
+	auto numSamples = (aNumLevels - 1) * aStride + aWindowSize;
+	std::vector<size_t> minQueue, maxQueue;
+	minQueue.reserve(numSamples);
+	maxQueue.reserve(numSamples);
+	size_t minHead = 0, maxHead = 0;
+	size_t level = 0;
+	size_t levelEnd = aWindowSize;
+	for (size_t i = 0; i < numSamples; ++i)
+	{
+		auto val = aSamples[i];
+		while ((minQueue.size() > minHead) && (aSamples[minQueue.back()] >= val))
+		{
+			minQueue.pop_back();
+		}
+		minQueue.push_back(i);
+		while ((maxQueue.size() > maxHead) && (aSamples[maxQueue.back()] <= val))
+		{
+			maxQueue.pop_back();
+		}
+		maxQueue.push_back(i);
+		if (i + 1 != levelEnd)
+		{
+			continue;
+		}
+
+		// The window for the current level is complete, emit the level:
+		auto levelStart = level * aStride;
+		while (minQueue[minHead] < levelStart)
+		{
+			++minHead;
+		}
+		while (maxQueue[maxHead] < levelStart)
+		{
+			++maxHead;
+		}
+		aOut[level] = aSamples[maxQueue[maxHead]] - aSamples[minQueue[minHead]];
+		++level;
+		levelEnd += aStride;
+	}
+}
+
+
+
+
+
+#if TEMPODETECTORKERNELS_HAS_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2:
+
+static void calcDistPrefixSSE2(const Int16 * aSamples, size_t aCount, Int64 aPrefix, Int64 * aOut)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= aCount; i += 4)
+	{
+		// Load 4 samples and their successors, sign-extended to 32 bits:
+		__m128i cur  = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(aSamples + i));
+		__m128i next = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(aSamples + i + 1));
+		cur  = _mm_srai_epi32(_mm_unpacklo_epi16(cur,  cur),  16);
+		next = _mm_srai_epi32(_mm_unpacklo_epi16(next, next), 16);
+
+		// Absolute difference:
+		__m128i dist = _mm_sub_epi32(cur, next);
+		__m128i sign = _mm_srai_epi32(dist, 31);
+		dist = _mm_sub_epi32(_mm_xor_si128(dist, sign), sign);
+
+		// Prefix sum within the register:
+		dist = _mm_add_epi32(dist, _mm_slli_si128(dist, 4));
+		dist = _mm_add_epi32(dist, _mm_slli_si128(dist, 8));
+
+		// Widen to 64 bits (the sums are non-negative) and add the running prefix:
+		__m128i base = _mm_set1_epi64x(aPrefix);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aOut + i),     _mm_add_epi64(_mm_unpacklo_epi32(dist, zero), base));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aOut + i + 2), _mm_add_epi64(_mm_unpackhi_epi32(dist, zero), base));
+		aPrefix += _mm_cvtsi128_si32(_mm_shuffle_epi32(dist, 0xff));
+	}
+	calcDistPrefixScalar(aSamples + i, aCount - i, aPrefix, aOut + i);
+}
+
+
+
+
+
+/** Returns the difference between the max and the min of the 8 samples in each register. */
+static inline Int32 reduceMinMaxSSE2(__m128i aMin, __m128i aMax)
+{
+	aMin = _mm_min_epi16(aMin, _mm_shuffle_epi32(aMin, 0x4e));
+	aMax = _mm_max_epi16(aMax, _mm_shuffle_epi32(aMax, 0x4e));
+	aMin = _mm_min_epi16(aMin, _mm_shuffle_epi32(aMin, 0xb1));
+	aMax = _mm_max_epi16(aMax, _mm_shuffle_epi32(aMax, 0xb1));
+	aMin = _mm_min_epi16(aMin, _mm_shufflelo_epi16(aMin, 0xb1));
+	aMax = _mm_max_epi16(aMax, _mm_shufflelo_epi16(aMax, 0xb1));
+	return static_cast<Int16>(_mm_extract_epi16(aMax, 0)) - static_cast<Int16>(_mm_extract_epi16(aMin, 0));
+}
+
+
+
+
+
+/** Returns the difference between the max and the min sample in the window.
+The window must be at least 8 samples long. Overlapping loads are used for the window tail. */
+static inline Int32 minMaxSSE2(const Int16 * aSamples, size_t aWindowSize)
+{
+	__m128i minVal = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSamples));
+	__m128i maxVal = minVal;
+	size_t i = 8;
+	for (; i + 8 <= aWindowSize; i += 8)
+	{
+		__m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSamples + i));
+		minVal = _mm_min_epi16(minVal, val);
+		maxVal = _mm_max_epi16(maxVal, val);
+	}
+	if (i < aWindowSize)
+	{
+		__m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i *>(aSamples + aWindowSize - 8));
+		minVal = _mm_min_epi16(minVal, val);
+		maxVal = _mm_max_epi16(maxVal, val);
+	}
+	return reduceMinMaxSSE2(minVal, maxVal);
+}
+
+
+
+
+
+static void calcMinMaxSSE2(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut)
+{
+	if (aWindowSize < 8)
+	{
+		calcMinMaxScalar(aSamples, aNumLevels, aStride, aWindowSize, aOut);
+		return;
+	}
+	for (size_t k = 0; k < aNumLevels; ++k)
+	{
+		aOut[k] = minMaxSSE2(aSamples + k * aStride, aWindowSize);
+	}
+}
+
+
+
+
+
+/** Reduces eight pairs of vectors to a single vector each; lane j of the results is the min / max over
+the whole aMin[j] / aMax[j]. Interleaves the vectors while reducing, instead of reducing each of them separately. */
+static inline void transposeMinMaxSSE2(__m128i * aMin, __m128i * aMax, __m128i & aOutMin, __m128i & aOutMax)
+{
+	__m128i min2[4], max2[4];
+	for (size_t j = 0; j < 4; ++j)
+	{
+		min2[j] = _mm_min_epi16(_mm_unpacklo_epi16(aMin[2 * j], aMin[2 * j + 1]), _mm_unpackhi_epi16(aMin[2 * j], aMin[2 * j + 1]));
+		max2[j] = _mm_max_epi16(_mm_unpacklo_epi16(aMax[2 * j], aMax[2 * j + 1]), _mm_unpackhi_epi16(aMax[2 * j], aMax[2 * j + 1]));
+	}
+	__m128i min4[2], max4[2];
+	for (size_t j = 0; j < 2; ++j)
+	{
+		min4[j] = _mm_min_epi16(_mm_unpacklo_epi32(min2[2 * j], min2[2 * j + 1]), _mm_unpackhi_epi32(min2[2 * j], min2[2 * j + 1]));
+		max4[j] = _mm_max_epi16(_mm_unpacklo_epi32(max2[2 * j], max2[2 * j + 1]), _mm_unpackhi_epi32(max2[2 * j], max2[2 * j + 1]));
+	}
+	aOutMin = _mm_min_epi16(_mm_unpacklo_epi64(min4[0], min4[1]), _mm_unpackhi_epi64(min4[0], min4[1]));
+	aOutMax = _mm_max_epi16(_mm_unpacklo_epi64(max4[0], max4[1]), _mm_unpackhi_epi64(max4[0], max4[1]));
+}
+
+
+
+
+
+/** The min-max kernel specialized for a fixed stride and window size (at least 8 samples), which replace the (ignored) parameters.
+The loads for each window are fully unrolled, and eight windows are reduced at once, using transposeMinMaxSSE2(). */
+template <size_t Stride, size_t WindowSize>
+static void calcMinMaxFixedSSE2(const Int16 * aSamples, size_t aNumLevels, size_t /* aStride */, size_t /* aWindowSize */, Int32 * aOut)
+{
+	static_assert(WindowSize >= 8, "The window needs to be at least as wide as a register");
+	size_t k = 0;
+	for (; k + 8 <= aNumLevels; k += 8)
+	{
+		__m128i minVal[8], maxVal[8];
+		for (size_t j = 0; j < 8; ++j)
+		{
+			auto samples = aSamples + (k + j) * Stride;
+			minVal[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples));
+			maxVal[j] = minVal[j];
+			for (size_t i = 8; i < WindowSize; i += 8)
+			{
+				// The last load overlaps the previous one if the window size is not a multiple of 8:
+				auto ofs = (i + 8 <= WindowSize) ? i : WindowSize - 8;
+				__m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples + ofs));
+				minVal[j] = _mm_min_epi16(minVal[j], val);
+				maxVal[j] = _mm_max_epi16(maxVal[j], val);
+			}
+		}
+		__m128i minAll, maxAll;
+		transposeMinMaxSSE2(minVal, maxVal, minAll, maxAll);
+
+		// Sign-extend to 32 bits before subtracting, the difference may not fit into 16 bits:
+		__m128i minLo = _mm_srai_epi32(_mm_unpacklo_epi16(minAll, minAll), 16);
+		__m128i minHi = _mm_srai_epi32(_mm_unpackhi_epi16(minAll, minAll), 16);
+		__m128i maxLo = _mm_srai_epi32(_mm_unpacklo_epi16(maxAll, maxAll), 16);
+		__m128i maxHi = _mm_srai_epi32(_mm_unpackhi_epi16(maxAll, maxAll), 16);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aOut + k),     _mm_sub_epi32(maxLo, minLo));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(aOut + k + 4), _mm_sub_epi32(maxHi, minHi));
+	}
+	for (; k < aNumLevels; ++k)
+	{
+		aOut[k] = minMaxSSE2(aSamples + k * Stride, WindowSize);
+	}
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2:
+
+TARGET_AVX2 static void calcDistPrefixAVX2(const Int16 * aSamples, size_t aCount, Int64 aPrefix, Int64 * aOut)
+{
+	size_t i = 0;
+	for (; i + 8 <= aCount; i += 8)
+	{
+		// Load 8 samples and their successors, sign-extended to 32 bits:
+		__m256i cur  = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(aSamples + i)));
+		__m256i next = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(aSamples + i + 1)));
+		__m256i dist = _mm256_abs_epi32(_mm256_sub_epi32(cur, next));
+
+		// Prefix sum within each 128-bit lane, then carry the low lane's total into the high lane:
+		dist = _mm256_add_epi32(dist, _mm256_slli_si256(dist, 4));
+		dist = _mm256_add_epi32(dist, _mm256_slli_si256(dist, 8));
+		__m256i lowTotal = _mm256_shuffle_epi32(dist, 0xff);
+		dist = _mm256_add_epi32(dist, _mm256_permute2x128_si256(lowTotal, lowTotal, 0x08));
+
+		// Widen to 64 bits (the sums are non-negative) and add the running prefix:
+		__m256i base = _mm256_set1_epi64x(aPrefix);
+		__m128i high = _mm256_extracti128_si256(dist, 1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aOut + i),     _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(dist)), base));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(aOut + i + 4), _mm256_add_epi64(_mm256_cvtepu32_epi64(high), base));
+		aPrefix += _mm_cvtsi128_si32(_mm_shuffle_epi32(high, 0xff));
+	}
+	calcDistPrefixScalar(aSamples + i, aCount - i, aPrefix, aOut + i);
+}
+
+
+
+
+
+TARGET_AVX2 static void calcMinMaxAVX2(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut)
+{
+	if (aWindowSize < 16)
+	{
+		// A 256-bit register is wider than the window, use the 128-bit version:
+		calcMinMaxSSE2(aSamples, aNumLevels, aStride, aWindowSize, aOut);
+		return;
+	}
+	for (size_t k = 0; k < aNumLevels; ++k)
+	{
+		auto samples = aSamples + k * aStride;
+		__m256i minVal = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples));
+		__m256i maxVal = minVal;
+		size_t i = 16;
+		for (; i + 16 <= aWindowSize; i += 16)
+		{
+			__m256i val = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples + i));
+			minVal = _mm256_min_epi16(minVal, val);
+			maxVal = _mm256_max_epi16(maxVal, val);
+		}
+		if (i < aWindowSize)
+		{
+			__m256i val = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples + aWindowSize - 16));
+			minVal = _mm256_min_epi16(minVal, val);
+			maxVal = _mm256_max_epi16(maxVal, val);
+		}
+		aOut[k] = reduceMinMaxSSE2(
+			_mm_min_epi16(_mm256_castsi256_si128(minVal), _mm256_extracti128_si256(minVal, 1)),
+			_mm_max_epi16(_mm256_castsi256_si128(maxVal), _mm256_extracti128_si256(maxVal, 1))
+		);
+	}
+}
+
+
+
+
+
+/** Returns true if the CPU and the OS support AVX2. */
+static bool detectAVX2()
+{
+	#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+		{
+			return false;
+		}
+		__cpuid(info, 1);
+		bool hasOsxsave = ((info[2] & (1 << 27)) != 0);
+		bool hasAvx = ((info[2] & (1 << 28)) != 0);
+		if (!hasOsxsave || !hasAvx)
+		{
+			return false;
+		}
+		if ((_xgetbv(0) & 0x06) != 0x06)
+		{
+			// The OS doesn't save the YMM registers
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return ((info[1] & (1 << 5)) != 0);
+	#else
+		__builtin_cpu_init();
+		return (__builtin_cpu_supports("avx2") != 0);
+	#endif
+}
+
+#endif  // TEMPODETECTORKERNELS_HAS_X86
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TempoDetectorKernels:
+
+bool isSupported(EInstructionSet aInstructionSet)
+{
+	switch (aInstructionSet)
+	{
+		case isScalar: return true;
+		#if TEMPODETECTORKERNELS_HAS_X86
+			case isSSE2: return true;
+			case isAVX2:
+			{
+				static const bool hasAVX2 = detectAVX2();
+				return hasAVX2;
+			}
+		#else
+			case isSSE2: return false;
+			case isAVX2: return false;
+		#endif
+	}
+	return false;
+}
+
+
+
+
+
+const Kernels & get(EInstructionSet aInstructionSet)
+{
+	assert(isSupported(aInstructionSet));
+	static const Kernels scalar = {&calcDistPrefixScalar, &calcMinMaxScalar};
+	#if TEMPODETECTORKERNELS_HAS_X86
+		static const Kernels sse2 = {&calcDistPrefixSSE2, &calcMinMaxSSE2};
+		static const Kernels avx2 = {&calcDistPrefixAVX2, &calcMinMaxAVX2};
+		switch (aInstructionSet)
+		{
+			case isScalar: return scalar;
+			case isSSE2:   return sse2;
+			case isAVX2:   return avx2;
+		}
+	#endif
+	return scalar;
+}
+
+
+
+
+
+const Kernels & best()
+{
+	static const Kernels & res = get(
+		isSupported(isAVX2) ? isAVX2 :
+		isSupported(isSSE2) ? isSSE2 :
+		isScalar
+	);
+	return res;
+}
+
+
+
+
+
+CalcMinMaxFn specializedMinMax(size_t aStride, size_t aWindowSize)
+{
+	#if TEMPODETECTORKERNELS_HAS_X86
+		#define MINMAX_SPECIALIZATION(STRIDE, WINDOWSIZE) {STRIDE, WINDOWSIZE, &calcMinMaxFixedSSE2<STRIDE, WINDOWSIZE>}
+	#else
+		#define MINMAX_SPECIALIZATION(STRIDE, WINDOWSIZE) {STRIDE, WINDOWSIZE, &calcMinMaxFixedScalar<STRIDE, WINDOWSIZE>}
+	#endif
+
+	/** A single compile-time specialization of the min-max kernel. */
+	struct Specialization
+	{
+		size_t mStride;
+		size_t mWindowSize;
+		CalcMinMaxFn mFn;
+	};
+
+	// The window sizes used by SongTempoDetector, with the default stride and its neighbors:
+	static const Specialization specializations[] =
+	{
+		MINMAX_SPECIALIZATION(4, 11), MINMAX_SPECIALIZATION(4, 13), MINMAX_SPECIALIZATION(4, 15), MINMAX_SPECIALIZATION(4, 17), MINMAX_SPECIALIZATION(4, 19),
+		MINMAX_SPECIALIZATION(8, 11), MINMAX_SPECIALIZATION(8, 13), MINMAX_SPECIALIZATION(8, 15), MINMAX_SPECIALIZATION(8, 17), MINMAX_SPECIALIZATION(8, 19),
+		MINMAX_SPECIALIZATION(16, 11), MINMAX_SPECIALIZATION(16, 13), MINMAX_SPECIALIZATION(16, 15), MINMAX_SPECIALIZATION(16, 17), MINMAX_SPECIALIZATION(16, 19),
+	};
+	#undef MINMAX_SPECIALIZATION
+
+	for (const auto & spec: specializations)
+	{
+		if ((spec.mStride == aStride) && (spec.mWindowSize == aWindowSize))
+		{
+			return spec.mFn;
+		}
+	}
+	return nullptr;
+}
+
+
+
+
+
+}  // namespace TempoDetectorKernels
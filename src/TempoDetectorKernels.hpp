@@ -0,0 +1,65 @@
+#pragma once
+
+#include "TempoDetector.hpp"
+
+
+
+
+
+/** The low-level loops used by TempoDetector for calculating the levels, in several implementations.
+Each instruction set provides the same set of kernels that give bit-identical results; the best
+one supported by the CPU is chosen at runtime, with the plain C++ implementation as the fallback. */
+namespace TempoDetectorKernels
+{
+	/** The instruction sets for which the kernels are implemented. */
+	enum EInstructionSet
+	{
+		isScalar,  ///< Plain C++, available everywhere
+		isSSE2,    ///< x86 SSE2
+		isAVX2,    ///< x86 AVX2
+	};
+
+
+
+	/** The signature of the kernels calculating the min-max levels, see Kernels::mCalcMinMax. */
+	using CalcMinMaxFn = void (*)(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut);
+
+
+
+	/** A set of kernels, all implemented using the same instruction set. */
+	struct Kernels
+	{
+		/** Calculates the running sum of distances between neighboring samples.
+		aSamples points to (aCount + 1) samples; for each i in [0, aCount), aOut[i] is set to
+		aPrefix + sum(abs(aSamples[j] - aSamples[j + 1])) over j in [0, i]. */
+		void (*mCalcDistPrefix)(const Int16 * aSamples, size_t aCount, Int64 aPrefix, Int64 * aOut);
+
+		/** Calculates the difference between the max and the min sample in aNumLevels windows.
+		The k-th window starts at aSamples[k * aStride] and is aWindowSize samples long; its level is stored in aOut[k]. */
+		CalcMinMaxFn mCalcMinMax;
+	};
+
+
+
+	/** Returns true if the kernels for the specified instruction set have been compiled in
+	and the current CPU supports them. */
+	bool isSupported(EInstructionSet aInstructionSet);
+
+	/** Returns the kernels implemented using the specified instruction set.
+	The caller needs to check that the instruction set is supported, using isSupported(). */
+	const Kernels & get(EInstructionSet aInstructionSet);
+
+	/** Returns the fastest kernels supported by the current CPU. */
+	const Kernels & best();
+
+	/** Calculates the same levels as Kernels::mCalcMinMax, but tracks the min and max in monotonic deques,
+	so that the cost per level doesn't depend on the window size. Faster than the SIMD kernels only
+	when the window is much larger than the stride; plain C++, available everywhere. */
+	void calcMinMaxSliding(const Int16 * aSamples, size_t aNumLevels, size_t aStride, size_t aWindowSize, Int32 * aOut);
+
+	/** Returns the kernel calculating the same levels as Kernels::mCalcMinMax, specialized at compile time
+	for the specified stride and window size, or nullptr if there's no such specialization.
+	Specializations exist for the window sizes used by SongTempoDetector, with the common strides;
+	they use the best instruction set available at compile time. */
+	CalcMinMaxFn specializedMinMax(size_t aStride, size_t aWindowSize);
+}  // namespace TempoDetectorKernels
@@ -7,6 +7,7 @@
 #include "../../ComponentCollection.hpp"
 #include "../../DB/Database.hpp"
 #include "../../DB/TagImportExport.hpp"
+#include "../../LibraryWatcher.hpp"
 
 
 
@@ -19,12 +20,18 @@ DlgLibraryMaintenance::DlgLibraryMaintenance(ComponentCollection & aComponents,
 {
 	mUI->setupUi(this);
 	Settings::loadWindowPos("DlgLibraryMaintenance", *this);
+	auto watcher = mComponents.get<LibraryWatcher>();
+	mUI->chbWatchLibraryFolders->setChecked(watcher->isEnabled());
+	mUI->lwWatchedFolders->addItems(watcher->roots());
 
 	// Connect the signals:
 	connect(mUI->btnClose,                   &QPushButton::pressed, this, &QDialog::close);
 	connect(mUI->btnRemoveInaccessibleSongs, &QPushButton::pressed, this, &DlgLibraryMaintenance::removeInaccessibleSongs);
 	connect(mUI->btnExportAllTags,           &QPushButton::pressed, this, &DlgLibraryMaintenance::exportAllTags);
 	connect(mUI->btnImportTags,              &QPushButton::pressed, this, &DlgLibraryMaintenance::importTags);
+	connect(mUI->chbWatchLibraryFolders,     &QCheckBox::toggled,   this, &DlgLibraryMaintenance::watchLibraryFoldersToggled);
+	connect(mUI->btnAddWatchedFolder,        &QPushButton::pressed, this, &DlgLibraryMaintenance::addWatchedFolder);
+	connect(mUI->btnRemoveWatchedFolder,     &QPushButton::pressed, this, &DlgLibraryMaintenance::removeWatchedFolder);
 }
 
 
@@ -184,3 +191,47 @@ void DlgLibraryMaintenance::importTags()
 		}
 	);
 }
+
+
+
+
+
+void DlgLibraryMaintenance::watchLibraryFoldersToggled(bool aIsChecked)
+{
+	mComponents.get<LibraryWatcher>()->setEnabled(aIsChecked);
+}
+
+
+
+
+
+void DlgLibraryMaintenance::addWatchedFolder()
+{
+	auto folder = QFileDialog::getExistingDirectory(
+		this,
+		tr("SkauTan: Choose folder to watch")
+	);
+	if (folder.isEmpty())
+	{
+		return;
+	}
+	auto watcher = mComponents.get<LibraryWatcher>();
+	watcher->addRoot(folder);
+	mUI->lwWatchedFolders->clear();
+	mUI->lwWatchedFolders->addItems(watcher->roots());
+}
+
+
+
+
+
+void DlgLibraryMaintenance::removeWatchedFolder()
+{
+	auto watcher = mComponents.get<LibraryWatcher>();
+	for (const auto & item: mUI->lwWatchedFolders->selectedItems())
+	{
+		watcher->removeRoot(item->text());
+	}
+	mUI->lwWatchedFolders->clear();
+	mUI->lwWatchedFolders->addItems(watcher->roots());
+}
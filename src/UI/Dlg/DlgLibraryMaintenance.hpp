@@ -71,4 +71,13 @@ private slots:
 
 	/** Asks for the source file, then imports tags from the file and fills them into the Library. */
 	void importTags();
+
+	/** Enables or disables the LibraryWatcher, based on the checkbox state. */
+	void watchLibraryFoldersToggled(bool aIsChecked);
+
+	/** Asks for a folder, then adds it to the folders watched by LibraryWatcher. */
+	void addWatchedFolder();
+
+	/** Removes the selected folders from the folders watched by LibraryWatcher. */
+	void removeWatchedFolder();
 };
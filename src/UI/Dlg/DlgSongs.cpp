@@ -14,6 +14,7 @@
 #include "../../MetadataScanner.hpp"
 #include "../../Stopwatch.hpp"
 #include "../../LengthHashCalculator.hpp"
+#include "../../LibraryCrawler.hpp"
 #include "../../Settings.hpp"
 #include "DlgSongProperties.hpp"
 #include "DlgTempoDetect.hpp"
@@ -58,6 +59,7 @@ DlgSongs::DlgSongs(
 	{
 		mFilterModel.reset(new QSortFilterProxyModel);
 	}
+	mUI->btnCancelCrawl->hide();
 	if (!aShowManipulators)
 	{
 		mUI->btnAddFolder->hide();
@@ -91,6 +93,7 @@ DlgSongs::DlgSongs(
 	connect(mUI->btnClose,              &QPushButton::clicked,                   this, &DlgSongs::close);
 	connect(mUI->btnAddToPlaylist,      &QPushButton::clicked,                   this, &DlgSongs::addSelectedToPlaylist);
 	connect(mUI->btnRescanMetadata,     &QPushButton::clicked,                   this, &DlgSongs::rescanMetadata);
+	connect(mUI->btnCancelCrawl,        &QPushButton::clicked,                   mComponents.get<LibraryCrawler>().get(), &LibraryCrawler::cancel);
 	connect(&mSongModel,                &SongModel::songEdited,                  this, &DlgSongs::modelSongEdited);
 	connect(&mSongModel,                &SongModel::rowsInserted,                this, &DlgSongs::updateSongStats);
 	connect(db.get(),                    &Database::songFileAdded,                this, &DlgSongs::updateSongStats);
@@ -163,27 +166,7 @@ void DlgSongs::addFiles(const QStringList & aFileNames)
 
 void DlgSongs::addFolderRecursive(const QString & aPath)
 {
-	QDir dir(aPath + "/");
-	QStringList songs;
-	for (const auto & item: dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot))
-	{
-		if (item.isDir())
-		{
-			addFolderRecursive(item.absoluteFilePath());
-			continue;
-		}
-		if (!item.isFile())
-		{
-			continue;
-		}
-		songs.append(item.absoluteFilePath());
-	}
-	if (songs.empty())
-	{
-		return;
-	}
-	qDebug() << "Adding " << songs.size() << " songs from folder " << aPath;
-	mComponents.get<Database>()->addSongFiles(songs);
+	mComponents.get<LibraryCrawler>()->crawlFolder(aPath);
 }
 
 
@@ -469,11 +452,37 @@ void DlgSongs::modelSongEdited(SongPtr aSong)
 
 void DlgSongs::periodicUiUpdate()
 {
+	// While searching folders for new songs, show the number of songs found, with a busy indicator:
+	auto crawler = mComponents.get<LibraryCrawler>();
+	if (crawler->isCrawling())
+	{
+		mUI->lblLibraryRescan->setText(tr("Searching folders: %1 songs found").arg(crawler->numFilesFound()));
+		if (mUI->btnCancelCrawl->isHidden())
+		{
+			mUI->pbLibraryRescan->setRange(0, 0);
+			mUI->btnCancelCrawl->show();
+		}
+		if (!mIsLibraryRescanShown)
+		{
+			mUI->wLibraryRescan->show();
+			mIsLibraryRescanShown = true;
+		}
+
+		// Force the LibraryRescan UI to update from scratch once the search finishes:
+		mLastLibraryRescanQueue = -1;
+		mLastLibraryRescanTotal = 0;
+	}
+	else if (!mUI->btnCancelCrawl->isHidden())
+	{
+		mUI->lblLibraryRescan->setText(tr("Library rescan:"));
+		mUI->btnCancelCrawl->hide();
+	}
+
 	// Update the LibraryRescan UI:
 	// Hash calc is calculated twice for the queue length, because after calculating the hash,
 	// songs will go to metadata updater anyway.
 	auto queueLength = mComponents.get<LengthHashCalculator>()->queueLength() * 2 + mComponents.get<MetadataScanner>()->queueLength();
-	if (mLastLibraryRescanQueue != queueLength)
+	if (!crawler->isCrawling() && (mLastLibraryRescanQueue != queueLength))
 	{
 		mLastLibraryRescanQueue = queueLength;
 		if (queueLength == 0)
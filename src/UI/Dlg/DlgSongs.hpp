@@ -50,6 +50,7 @@ public:
 	void addFiles(const QStringList & aFileNames);
 
 	/** Adds songs from the specified path to the DB, recursively.
+	The folders are searched in the background by LibraryCrawler, the progress is shown in the LibraryRescan UI.
 	Skips duplicate files. */
 	void addFolderRecursive(const QString & aPath);
 
@@ -286,7 +286,7 @@ void DlgTempoDetect::detectTempo()
 	}
 
 	// Start the detection:
-	mDetector->queueScanSong(mSong, {options});
+	mDetector->queueScanSong(mSong, {options}, SongTempoDetector::maxDetectionThreads());
 }
 
 
@@ -322,7 +322,7 @@ void DlgTempoDetect::saveDebugBeats()
 	}
 	auto options = readOptionsFromUi();
 	options.mDebugAudioBeatsFileName = fileName;
-	mDetector->queueScanSong(mSong, {options});
+	mDetector->queueScanSong(mSong, {options}, SongTempoDetector::maxDetectionThreads());
 }
 
 
@@ -343,7 +343,7 @@ void DlgTempoDetect::saveDebugLevels()
 	}
 	auto options = readOptionsFromUi();
 	options.mDebugAudioLevelsFileName = fileName;
-	mDetector->queueScanSong(mSong, {options});
+	mDetector->queueScanSong(mSong, {options}, SongTempoDetector::maxDetectionThreads());
 }
 
 
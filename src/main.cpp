@@ -13,6 +13,8 @@
 #include "BackgroundTasks.hpp"
 #include "MetadataScanner.hpp"
 #include "LengthHashCalculator.hpp"
+#include "LibraryCrawler.hpp"
+#include "LibraryWatcher.hpp"
 #include "PlaylistItemSong.hpp"
 #include "Template.hpp"
 #include "Settings.hpp"
@@ -134,6 +136,9 @@ int main(int argc, char *argv[])
 		qRegisterMetaType<SongPtr>();
 		qRegisterMetaType<Song::SharedDataPtr>();
 		qRegisterMetaType<TempoDetector::ResultPtr>();
+		qRegisterMetaType<MetadataScanner::Tag>();
+		qRegisterMetaType<Song::FileFingerprint>();
+		qRegisterMetaType<LibraryCrawler::FoundFiles>();
 		auto instConf = std::make_shared<InstallConfiguration>();
 		Settings::init(instConf->dataLocation("SkauTan.ini"));
 
@@ -142,17 +147,19 @@ int main(int argc, char *argv[])
 		cc.addComponent(instConf);
 		auto mainDB           = cc.addNew<Database>(cc);
 		auto scanner          = cc.addNew<MetadataScanner>();
-		auto lhCalc           = cc.addNew<LengthHashCalculator>();
+		auto lhCalc           = cc.addNew<LengthHashCalculator>(cc);
 		auto player           = cc.addNew<Player>();
 		auto midiControllers  = cc.addNew<DJControllers>();
 		auto voteServer       = cc.addNew<LocalVoteServer>(cc);
 		auto tempoDetector    = cc.addNew<SongTempoDetector>();
 		auto bkgTempoDetector = cc.addNew<BackgroundTempoDetector>(cc);
+		auto libraryCrawler   = cc.addNew<LibraryCrawler>();
+		auto libraryWatcher   = cc.addNew<LibraryWatcher>();
 
 		// Connect the main objects together:
-		app.connect(mainDB.get(),        &Database::needFileHash,                     lhCalc.get(),        &LengthHashCalculator::queueHashFile);
+		app.connect(mainDB.get(),        &Database::needFileHash,                     lhCalc.get(),        &LengthHashCalculator::queueIngestFile);
 		app.connect(mainDB.get(),        &Database::needSongLength,                   lhCalc.get(),        &LengthHashCalculator::queueLengthSong);
-		app.connect(lhCalc.get(),        &LengthHashCalculator::fileHashCalculated,   mainDB.get(),        &Database::songHashCalculated);
+		app.connect(lhCalc.get(),        &LengthHashCalculator::fileIngested,         mainDB.get(),        &Database::songFileIngested);
 		app.connect(lhCalc.get(),        &LengthHashCalculator::fileHashFailed,       mainDB.get(),        &Database::songHashFailed);
 		app.connect(lhCalc.get(),        &LengthHashCalculator::songLengthCalculated, mainDB.get(),        &Database::songLengthCalculated);
 		app.connect(mainDB.get(),        &Database::needSongTagRescan,                scanner.get(),       &MetadataScanner::queueScanSong);
@@ -163,6 +170,11 @@ int main(int argc, char *argv[])
 		app.connect(voteServer.get(),    &LocalVoteServer::addVoteGenreTypicality,    mainDB.get(),        &Database::addVoteGenreTypicality);
 		app.connect(voteServer.get(),    &LocalVoteServer::addVotePopularity,         mainDB.get(),        &Database::addVotePopularity);
 		app.connect(tempoDetector.get(), &SongTempoDetector::songTempoDetected,       mainDB.get(),        &Database::saveSongSharedData);
+		app.connect(tempoDetector.get(), &SongTempoDetector::songTempoDetected,       bkgTempoDetector.get(), &BackgroundTempoDetector::songTempoDetected);
+		app.connect(mainDB.get(),        &Database::songFileAdded,                    bkgTempoDetector.get(), &BackgroundTempoDetector::songFileAdded);
+		app.connect(libraryCrawler.get(), &LibraryCrawler::filesFound,                mainDB.get(),        &Database::addFoundFiles);
+		app.connect(libraryWatcher.get(), &LibraryWatcher::filesFound,                mainDB.get(),        &Database::addFoundFiles);
+		app.connect(libraryWatcher.get(), &LibraryWatcher::filesRemoved,              mainDB.get(),        &Database::removeMissingSongFiles);
 		app.connect(player.get(),  &Player::startedPlayback, [&](IPlaylistItemPtr aItem)
 			{
 				// Update the "last played" value in the DB:
@@ -174,6 +186,12 @@ int main(int argc, char *argv[])
 			}
 		);
 
+		// Enable the analysis audio cache before loading the DB, the ingest tasks queued by the loading check it:
+		tempoDetector->audioCache().setFolder(
+			instConf->dataLocation("AnalysisAudioCache/"),
+			Settings::loadValue("SongTempoDetector", "AudioCacheMaxSizeMiB", 256).toLongLong() * 1024 * 1024
+		);
+
 		// Load the DB:
 		auto dbFile = instConf->dbFileName();
 		DatabaseBackup::dailyBackupOnStartup(dbFile, instConf->dbBackupsFolder());
@@ -211,7 +229,9 @@ int main(int argc, char *argv[])
 		}
 
 		// Run the app:
+		bkgTempoDetector->setMaxConcurrency(Settings::loadValue("BackgroundTempoDetector", "MaxConcurrency", 1).toInt());
 		bkgTempoDetector->start();
+		libraryWatcher->start();
 		auto res = app.exec();
 
 		// Save the server state:
@@ -220,6 +240,10 @@ int main(int argc, char *argv[])
 		// Stop all background tasks:
 		BackgroundTasks::get().stopAll();
 
+		// Write all the pending DB changes and the snapshot for the next startup:
+		// (After the background tasks are stopped, so that none of them modifies the songs while saving)
+		mainDB->close();
+
 		return res;
 	}
 	catch (const std::exception & exc)
@@ -0,0 +1,357 @@
+// DatabaseLoading.cpp
+
+// Generates a DB with thousands of filters and templates, reloads it and checks that the filters and templates
+// are loaded intact, and that the single-query loading of the filter nodes and template items is faster
+// than the former per-filter / per-template loading (N+1), by a generous margin (MIN_LOAD_SPEEDUP).
+// Needs no data files, the DB is generated in a temporary folder.
+
+
+
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QTemporaryDir>
+#include "../src/DB/Database.hpp"
+#include "../src/Settings.hpp"
+#include "../src/Stopwatch.hpp"
+
+
+
+
+/** Global failure flag, any failing test sets this to true.
+The program's exit status is set according to this value. */
+static bool g_HasFailed = false;
+
+
+
+
+
+/** The number of generated filters. */
+static const int NUM_FILTERS = 3000;
+
+/** The number of generated templates. */
+static const int NUM_TEMPLATES = 2000;
+
+/** The number of items in each generated template. */
+static const int NUM_TEMPLATE_ITEMS = 10;
+
+/** The number of times each loading is repeated, the fastest time is used. */
+static const int NUM_REPEATS = 3;
+
+/** The minimum speedup of the single-query loading over the former per-item loading.
+The former loading runs 5000 queries (and a linear filter lookup for each of the 20000 template items),
+compared to the two queries now, so the expected speedup is several times. The threshold is generous,
+so that it doesn't fail on wallclock jitter on loaded CI machines, yet still fails if the speedup is lost. */
+static const double MIN_LOAD_SPEEDUP = 1.5;
+
+
+
+
+
+/** Provides access to the protected loading functions of the Database. */
+class TestDatabase:
+	public Database
+{
+public:
+
+	TestDatabase(ComponentCollection & aComponents):
+		Database(aComponents)
+	{
+	}
+
+
+	/** Reloads all the filters and templates from the DB, using the regular loading functions.
+	Returns the time taken, in msec. */
+	double reloadFiltersAndTemplates()
+	{
+		mTemplates.clear();
+		mFilters.clear();
+		STOPWATCH("Reloading filters and templates");
+		QElapsedTimer timer;
+		timer.start();
+		loadFilters();
+		loadTemplates();
+		return static_cast<double>(timer.nsecsElapsed()) / 1e6;
+	}
+
+
+	/** Reloads the contents of all the filters and templates the way they were loaded before the single-query
+	loading: one query per filter for its nodes, one query per template for its items, and a linear lookup
+	of each item's filter. The filter and template objects themselves are kept, only their contents are reloaded,
+	so this is a slight underestimate of the former loading time.
+	Returns the time taken, in msec. */
+	double reloadFiltersAndTemplatesPerItem()
+	{
+		for (const auto & tmpl: mTemplates)
+		{
+			while (!tmpl->items().empty())
+			{
+				tmpl->delItem(0);
+			}
+		}
+		STOPWATCH("Reloading filters and templates per item (the former loading)");
+		QElapsedTimer timer;
+		timer.start();
+		for (const auto & filter: mFilters)
+		{
+			loadFilterNodesPerFilter(*filter);
+		}
+		for (const auto & tmpl: mTemplates)
+		{
+			loadTemplateItemsPerTemplate(*tmpl);
+		}
+		return static_cast<double>(timer.nsecsElapsed()) / 1e6;
+	}
+
+
+protected:
+
+	/** Loads the nodes of the specified filter using a query for the single filter (the former loadFilterNodes()). */
+	void loadFilterNodesPerFilter(Filter & aFilter)
+	{
+		QSqlQuery query(mDatabase);
+		query.setForwardOnly(true);
+		if (!query.prepare("SELECT RowID, * FROM FilterNodes WHERE FilterID = ?"))
+		{
+			std::cerr << "Cannot prepare the filter nodes query: " << query.lastError().text().toStdString() << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+		query.addBindValue(aFilter.dbRowId());
+		if (!query.exec())
+		{
+			std::cerr << "Cannot query the filter nodes: " << query.lastError().text().toStdString() << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+		auto fiRowId        = query.record().indexOf("RowID");
+		auto fiParentRowId  = query.record().indexOf("ParentID");
+		auto fiKind         = query.record().indexOf("Kind");
+		auto fiComparison   = query.record().indexOf("Comparison");
+		auto fiSongProperty = query.record().indexOf("SongProperty");
+		auto fiValue        = query.record().indexOf("Value");
+		std::map<qlonglong, std::pair<qlonglong, Filter::NodePtr>> nodes;
+		while (query.next())
+		{
+			Filter::NodePtr node;
+			auto kind = Filter::Node::intToKind(query.value(fiKind).toInt());
+			if (kind == Filter::Node::nkComparison)
+			{
+				node.reset(new Filter::Node(
+					Filter::Node::intToSongProperty(query.value(fiSongProperty).toInt()),
+					Filter::Node::intToComparison(query.value(fiComparison).toInt()),
+					query.value(fiValue)
+				));
+			}
+			else
+			{
+				node.reset(new Filter::Node(kind, {}));
+			}
+			nodes[query.value(fiRowId).toLongLong()] = std::make_pair(query.value(fiParentRowId).toLongLong(), node);
+		}
+		assignFilterNodes(aFilter, nodes);
+	}
+
+
+	/** Loads the items of the specified template using a query for the single template,
+	looking up each item's filter linearly (the former loadTemplateItems() and filterFromRowId()). */
+	void loadTemplateItemsPerTemplate(Template & aTemplate)
+	{
+		QSqlQuery query(mDatabase);
+		query.setForwardOnly(true);
+		if (!query.prepare("SELECT * FROM TemplateItems WHERE TemplateID = ? ORDER BY IndexInTemplate ASC"))
+		{
+			std::cerr << "Cannot prepare the template items query: " << query.lastError().text().toStdString() << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+		query.addBindValue(aTemplate.dbRowId());
+		if (!query.exec())
+		{
+			std::cerr << "Cannot query the template items: " << query.lastError().text().toStdString() << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+		auto fiFilterId = query.record().indexOf("FilterID");
+		while (query.next())
+		{
+			auto filterId = query.value(fiFilterId).toLongLong();
+			for (const auto & filter: mFilters)
+			{
+				if (filter->dbRowId() == filterId)
+				{
+					aTemplate.appendItem(filter);
+					break;
+				}
+			}
+		}
+	}
+};
+
+
+
+
+
+/** The expected contents of the DB, for checking after the reload. */
+struct Expected
+{
+	/** FilterRowID -> Filter hash. */
+	std::map<qlonglong, QByteArray> mFilterHashes;
+
+	/** TemplateRowID -> RowIDs of the filters in the template's items. */
+	std::map<qlonglong, std::vector<qlonglong>> mTemplateItems;
+};
+
+
+
+
+
+/** Fills the DB with the generated filters and templates, returns the expected contents. */
+static Expected generate(Database & aDB)
+{
+	STOPWATCH("Generating filters and templates");
+	Expected res;
+	std::vector<FilterPtr> filters;
+	for (int i = 0; i < NUM_FILTERS; ++i)
+	{
+		auto filter = aDB.createFilter();
+		filter->setDisplayName(QString("Filter %1").arg(i));
+		std::vector<Filter::NodePtr> children =
+		{
+			std::make_shared<Filter::Node>(Filter::Node::nspPrimaryGenre, Filter::Node::ncEqual, QString("G%1").arg(i % 17)),
+			std::make_shared<Filter::Node>(Filter::Node::nspLength, Filter::Node::ncGreaterThan, 60 + i % 100),
+			std::make_shared<Filter::Node>(Filter::Node::Kind::nkOr, std::vector<Filter::NodePtr>{
+				std::make_shared<Filter::Node>(Filter::Node::nspLocalRating, Filter::Node::ncGreaterThanOrEqual, i % 5),
+				std::make_shared<Filter::Node>(Filter::Node::nspNotes, Filter::Node::ncContains, QString("n%1").arg(i)),
+			}),
+		};
+		filter->setRootNode(std::make_shared<Filter::Node>(Filter::Node::nkAnd, children));
+		aDB.saveFilter(*filter);
+		res.mFilterHashes[filter->dbRowId()] = filter->hash();
+		filters.push_back(filter);
+	}
+	for (int i = 0; i < NUM_TEMPLATES; ++i)
+	{
+		auto tmpl = aDB.createTemplate();
+		tmpl->setDisplayName(QString("Template %1").arg(i));
+		auto & items = res.mTemplateItems[tmpl->dbRowId()];
+		for (int j = 0; j < NUM_TEMPLATE_ITEMS; ++j)
+		{
+			const auto & filter = filters[static_cast<size_t>((i * 7 + j * 13) % NUM_FILTERS)];
+			tmpl->appendItem(filter);
+			items.push_back(filter->dbRowId());
+		}
+		aDB.saveTemplate(*tmpl);
+	}
+	return res;
+}
+
+
+
+
+
+/** Checks that the filters and templates loaded in aDB match the expected ones. */
+static void checkLoaded(const Database & aDB, const Expected & aExpected)
+{
+	if (aDB.filters().size() != aExpected.mFilterHashes.size())
+	{
+		std::cerr << "Loaded " << aDB.filters().size() << " filters, expected " << aExpected.mFilterHashes.size() << std::endl;
+		g_HasFailed = true;
+	}
+	for (const auto & filter: aDB.filters())
+	{
+		auto itr = aExpected.mFilterHashes.find(filter->dbRowId());
+		if ((itr == aExpected.mFilterHashes.end()) || (itr->second != filter->hash()))
+		{
+			std::cerr << "Filter " << filter->displayName().toStdString() << " was not loaded intact" << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+	}
+
+	if (aDB.templates().size() != aExpected.mTemplateItems.size())
+	{
+		std::cerr << "Loaded " << aDB.templates().size() << " templates, expected " << aExpected.mTemplateItems.size() << std::endl;
+		g_HasFailed = true;
+	}
+	for (const auto & tmpl: aDB.templates())
+	{
+		std::vector<qlonglong> items;
+		for (const auto & item: tmpl->items())
+		{
+			items.push_back(item->dbRowId());
+		}
+		auto itr = aExpected.mTemplateItems.find(tmpl->dbRowId());
+		if ((itr == aExpected.mTemplateItems.end()) || (itr->second != items))
+		{
+			std::cerr << "Template " << tmpl->displayName().toStdString() << " was not loaded intact" << std::endl;
+			g_HasFailed = true;
+			return;
+		}
+	}
+}
+
+
+
+
+
+int main(int argc, char * argv[])
+{
+	QCoreApplication app(argc, argv);
+	QTemporaryDir dir;
+	if (!dir.isValid())
+	{
+		std::cerr << "Cannot create a temporary folder for the DB" << std::endl;
+		return 1;
+	}
+	Settings::init(dir.filePath("DatabaseLoading.ini"));
+	auto dbFileName = dir.filePath("DatabaseLoading.sqlite");
+
+	// Generate the DB:
+	Expected expected;
+	{
+		ComponentCollection cc;
+		Database db(cc);
+		db.open(dbFileName);
+		expected = generate(db);
+	}
+
+	// Reload and check:
+	ComponentCollection cc;
+	TestDatabase db(cc);
+	db.open(dbFileName);
+	checkLoaded(db, expected);
+
+	// Compare the loading times with the former per-item loading, the fastest of several runs to reduce the noise:
+	double loadTime = 0, perItemLoadTime = 0;
+	for (int i = 0; i < NUM_REPEATS; ++i)
+	{
+		auto t = db.reloadFiltersAndTemplates();
+		loadTime = (i == 0) ? t : std::min(loadTime, t);
+		checkLoaded(db, expected);
+		t = db.reloadFiltersAndTemplatesPerItem();
+		perItemLoadTime = (i == 0) ? t : std::min(perItemLoadTime, t);
+		checkLoaded(db, expected);
+	}
+	auto speedup = perItemLoadTime / std::max(loadTime, 1e-3);
+	std::cerr << "Loading " << NUM_FILTERS << " filters and " << NUM_TEMPLATES << " templates: "
+		<< loadTime << " msec; the former per-item loading: " << perItemLoadTime << " msec; speedup: "
+		<< speedup << "x (min " << MIN_LOAD_SPEEDUP << "x)" << std::endl;
+	if (speedup < MIN_LOAD_SPEEDUP)
+	{
+		std::cerr << "Loading the filters and templates is not sufficiently faster than the former per-item loading" << std::endl;
+		g_HasFailed = true;
+	}
+
+	if (!g_HasFailed)
+	{
+		std::cerr << "All tests passed" << std::endl;
+	}
+	return g_HasFailed ? 1 : 0;
+}
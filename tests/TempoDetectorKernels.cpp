@@ -0,0 +1,206 @@
+// TempoDetectorKernels.cpp
+
+// Tests that the SIMD and sliding-window implementations of the TempoDetector kernels give bit-identical results to the scalar ones
+
+
+
+
+#include <iostream>
+#include <random>
+#include "../src/TempoDetectorKernels.hpp"
+
+
+
+
+/** Global failure flag, any failing test sets this to true.
+The program's exit status is set according to this value. */
+static bool g_HasFailed = false;
+
+
+
+
+
+/** Returns the name of the instruction set, for the messages. */
+static const char * instructionSetName(TempoDetectorKernels::EInstructionSet aInstructionSet)
+{
+	switch (aInstructionSet)
+	{
+		case TempoDetectorKernels::isScalar: return "Scalar";
+		case TempoDetectorKernels::isSSE2:   return "SSE2";
+		case TempoDetectorKernels::isAVX2:   return "AVX2";
+	}
+	return "<unknown>";
+}
+
+
+
+
+
+/** Generates random samples, with occasional runs of the extreme values. */
+static std::vector<Int16> generateSamples(size_t aCount, std::mt19937 & aRng)
+{
+	std::uniform_int_distribution<int> sampleDist(-32768, 32767);
+	std::uniform_int_distribution<int> kindDist(0, 9);
+	std::vector<Int16> res;
+	res.reserve(aCount);
+	for (size_t i = 0; i < aCount; ++i)
+	{
+		switch (kindDist(aRng))
+		{
+			case 0:  res.push_back(-32768); break;
+			case 1:  res.push_back(32767); break;
+			default: res.push_back(static_cast<Int16>(sampleDist(aRng))); break;
+		}
+	}
+	return res;
+}
+
+
+
+
+
+/** Compares the distance prefix kernel of the specified instruction set against the scalar one. */
+static void testDistPrefix(TempoDetectorKernels::EInstructionSet aInstructionSet, std::mt19937 & aRng)
+{
+	const auto & scalar = TempoDetectorKernels::get(TempoDetectorKernels::isScalar);
+	const auto & tested = TempoDetectorKernels::get(aInstructionSet);
+	for (size_t count = 0; count < 100; ++count)
+	{
+		auto samples = generateSamples(count + 1, aRng);
+		Int64 prefix = static_cast<Int64>(aRng() % 1000000);
+		std::vector<Int64> expected(count), actual(count);
+		scalar.mCalcDistPrefix(samples.data(), count, prefix, expected.data());
+		tested.mCalcDistPrefix(samples.data(), count, prefix, actual.data());
+		if (expected != actual)
+		{
+			std::cerr << instructionSetName(aInstructionSet) << ": CalcDistPrefix differs for count " << count << std::endl;
+			g_HasFailed = true;
+		}
+	}
+}
+
+
+
+
+
+/** Compares the min-max kernel of the specified instruction set against the scalar one. */
+static void testMinMax(TempoDetectorKernels::EInstructionSet aInstructionSet, std::mt19937 & aRng)
+{
+	const auto & scalar = TempoDetectorKernels::get(TempoDetectorKernels::isScalar);
+	const auto & tested = TempoDetectorKernels::get(aInstructionSet);
+	for (size_t windowSize = 1; windowSize <= 70; ++windowSize)
+	{
+		for (size_t stride = 1; stride <= 16; ++stride)
+		{
+			size_t numLevels = 37;
+			auto samples = generateSamples(numLevels * stride + windowSize, aRng);
+			std::vector<Int32> expected(numLevels), actual(numLevels);
+			scalar.mCalcMinMax(samples.data(), numLevels, stride, windowSize, expected.data());
+			tested.mCalcMinMax(samples.data(), numLevels, stride, windowSize, actual.data());
+			if (expected != actual)
+			{
+				std::cerr << instructionSetName(aInstructionSet) << ": CalcMinMax differs for window size "
+					<< windowSize << ", stride " << stride << std::endl;
+				g_HasFailed = true;
+			}
+		}
+	}
+}
+
+
+
+
+
+/** Compares the sliding-window min-max kernel against the scalar one. */
+static void testMinMaxSliding(std::mt19937 & aRng)
+{
+	const auto & scalar = TempoDetectorKernels::get(TempoDetectorKernels::isScalar);
+	for (size_t windowSize: {1, 2, 3, 7, 8, 31, 100, 1000})
+	{
+		for (size_t stride = 1; stride <= 16; ++stride)
+		{
+			for (size_t numLevels: {0, 1, 2, 37})
+			{
+				auto samples = generateSamples(numLevels * stride + windowSize, aRng);
+				std::vector<Int32> expected(numLevels), actual(numLevels);
+				scalar.mCalcMinMax(samples.data(), numLevels, stride, windowSize, expected.data());
+				TempoDetectorKernels::calcMinMaxSliding(samples.data(), numLevels, stride, windowSize, actual.data());
+				if (expected != actual)
+				{
+					std::cerr << "CalcMinMaxSliding differs for window size " << windowSize
+						<< ", stride " << stride << ", " << numLevels << " levels" << std::endl;
+					g_HasFailed = true;
+				}
+			}
+		}
+	}
+}
+
+
+
+
+
+/** Compares the min-max kernels specialized for the stride and window size against the scalar one. */
+static void testMinMaxSpecialized(std::mt19937 & aRng)
+{
+	const auto & scalar = TempoDetectorKernels::get(TempoDetectorKernels::isScalar);
+	size_t numSpecialized = 0;
+	for (size_t windowSize = 1; windowSize <= 70; ++windowSize)
+	{
+		for (size_t stride = 1; stride <= 16; ++stride)
+		{
+			auto specialized = TempoDetectorKernels::specializedMinMax(stride, windowSize);
+			if (specialized == nullptr)
+			{
+				continue;
+			}
+			numSpecialized += 1;
+			for (size_t numLevels: {0, 1, 7, 8, 9, 37})
+			{
+				auto samples = generateSamples(numLevels * stride + windowSize, aRng);
+				std::vector<Int32> expected(numLevels), actual(numLevels);
+				scalar.mCalcMinMax(samples.data(), numLevels, stride, windowSize, expected.data());
+				specialized(samples.data(), numLevels, stride, windowSize, actual.data());
+				if (expected != actual)
+				{
+					std::cerr << "Specialized CalcMinMax differs for window size " << windowSize
+						<< ", stride " << stride << ", " << numLevels << " levels" << std::endl;
+					g_HasFailed = true;
+				}
+			}
+		}
+	}
+	if (TempoDetectorKernels::specializedMinMax(8, 11) == nullptr)
+	{
+		std::cerr << "No specialized CalcMinMax for the default options" << std::endl;
+		g_HasFailed = true;
+	}
+	std::cerr << "Tested " << numSpecialized << " specialized CalcMinMax kernels" << std::endl;
+}
+
+
+
+
+
+int main()
+{
+	std::mt19937 rng(0);
+	testMinMaxSliding(rng);
+	testMinMaxSpecialized(rng);
+	for (auto is: {TempoDetectorKernels::isSSE2, TempoDetectorKernels::isAVX2})
+	{
+		if (!TempoDetectorKernels::isSupported(is))
+		{
+			std::cerr << instructionSetName(is) << " not supported, skipping." << std::endl;
+			continue;
+		}
+		testDistPrefix(is, rng);
+		testMinMax(is, rng);
+	}
+
+	if (!g_HasFailed)
+	{
+		std::cerr << "All tests passed" << std::endl;
+	}
+	return g_HasFailed ? 1 : 0;
+}
@@ -0,0 +1,456 @@
+// TempoDetectorSynthetic.cpp
+
+// Generates synthetic tracks at known tempos, runs them through TempoDetector and SongTempoDetector
+// and checks that neither the detection accuracy nor the throughput regresses below the thresholds.
+// Needs no audio files nor network access, the tracks are generated at runtime.
+
+
+
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <QDataStream>
+#include <QFile>
+#include <QTemporaryDir>
+#include "../src/Song.hpp"
+#include "../src/SongTempoDetector.hpp"
+#include "../src/TempoDetector.hpp"
+
+
+
+
+/** Global failure flag, any failing test sets this to true.
+The program's exit status is set according to this value. */
+static bool g_HasFailed = false;
+
+
+
+
+
+/** The minimum fraction of the tracks with a tempo (all but tkSilence and tkNoise)
+that TempoDetector needs to detect correctly. The baseline at the time of writing is 0.93. */
+static const double MIN_DETECTOR_ACCURACY = 0.9;
+
+/** The minimum fraction of the tracks with a tempo that SongTempoDetector needs to detect correctly.
+Lower than for TempoDetector, the resampling from the file's samplerate smears some of the beats. */
+static const double MIN_SONG_DETECTOR_ACCURACY = 0.8;
+
+/** The minimum throughput of TempoDetector, in seconds of audio per second of processing.
+Conservative, so that it holds in debug builds on slow machines (baseline: about 5000 in debug, 40000 in release). */
+static const double MIN_DETECTOR_SPEED = 500;
+
+/** The minimum throughput of SongTempoDetector (decoding the file, resampling and detecting),
+in seconds of audio per second of processing. Much lower than MIN_DETECTOR_SPEED, the decoding and resampling
+dominate the time. There was no measured baseline for this when the test was written; the value is a floor
+that still detects a 3-minute song within 10 seconds (in a debug build). Raise it once a baseline is measured. */
+static const double MIN_SONG_DETECTOR_SPEED = 20;
+
+/** The max difference between the detected and the generated tempo, for the detection to be considered correct. */
+static const double MAX_TEMPO_DIFF = 1.5;
+
+/** The samplerate of the files generated for SongTempoDetector. */
+static const int FILE_SAMPLE_RATE = 8000;
+
+
+
+
+
+/** The kinds of the generated tracks. */
+enum ETrackKind
+{
+	tkClick,    ///< A noise burst on each beat, accented on the first beat of each measure
+	tkSwing,    ///< Like tkClick, plus a weaker swung off-beat at 2/3 of each beat
+	tkDrift,    ///< Like tkClick, with the tempo drifting from -2 % to +2 % over the track
+	tkNoisy,    ///< Like tkClick, with white noise in the background
+	tkSilence,  ///< Digital silence, no tempo may be detected
+	tkNoise,    ///< White noise only; the detected tempo is arbitrary, used for robustness and throughput only
+};
+
+/** All the track kinds, for iterating. */
+static const ETrackKind TRACK_KINDS[] = {tkClick, tkSwing, tkDrift, tkNoisy, tkSilence, tkNoise};
+
+/** The lengths of the generated tracks, in seconds. */
+static const double TRACK_LENGTHS[] = {30, 90, 180};
+
+/** The length of the tracks used for SongTempoDetector, in seconds.
+Long enough for the excerpt detection to use an excerpt. */
+static const double SONG_TRACK_LENGTH = 90;
+
+
+
+
+
+/** The dance genre of a generated track, provides the tempo range used for the detection. */
+struct Genre
+{
+	/** The genre code, as used by Song::detectionTempoRangeForGenre(). */
+	const char * mName;
+
+	/** The tempo of the generated tracks. */
+	double mMpm;
+
+	/** The number of beats in a measure. */
+	int mBeatsPerMeasure;
+};
+
+/** The genres for which the tracks are generated. */
+static const Genre GENRES[] =
+{
+	{"SW", 29, 3},
+	{"TG", 32, 4},
+	{"VW", 58, 3},
+	{"QS", 50, 4},
+	{"SB", 50, 2},
+	{"CH", 30, 4},
+	{"RU", 25, 4},
+	{"PD", 60, 2},
+	{"JI", 42, 4},
+};
+
+
+
+
+
+/** Accumulates the accuracy and throughput of a detector over the tracks. */
+struct Stats
+{
+	/** The number of tracks with a tempo that were detected correctly. */
+	size_t mNumCorrect = 0;
+
+	/** The number of tracks with a tempo. */
+	size_t mNumTempoTracks = 0;
+
+	/** The total length of all the processed tracks, in seconds. */
+	double mAudioLength = 0;
+
+	/** The total time spent in the detector, in seconds. */
+	double mProcessingTime = 0;
+};
+
+
+
+
+
+/** Returns the name of the track kind, for the messages. */
+static const char * trackKindName(ETrackKind aKind)
+{
+	switch (aKind)
+	{
+		case tkClick:   return "click";
+		case tkSwing:   return "swing";
+		case tkDrift:   return "drift";
+		case tkNoisy:   return "noisy";
+		case tkSilence: return "silence";
+		case tkNoise:   return "noise";
+	}
+	return "<unknown>";
+}
+
+
+
+
+
+/** Returns a uniformly distributed random value in [-1, 1).
+Uses the raw generator output, the std distributions are implementation-defined. */
+static double uniform(std::mt19937 & aRng)
+{
+	return static_cast<double>(aRng()) / 2147483648.0 - 1;
+}
+
+
+
+
+
+/** Mixes an exponentially decaying noise burst (a "click") into aAudio at the specified time. */
+static void addClick(std::vector<double> & aAudio, double aTime, double aAmplitude, int aSampleRate, std::mt19937 & aRng)
+{
+	auto start = static_cast<size_t>(aTime * aSampleRate);
+	auto length = static_cast<size_t>(0.15 * aSampleRate);
+	auto decay = 0.03 * aSampleRate;
+	for (size_t i = 0; (i < length) && (start + i < aAudio.size()); ++i)
+	{
+		aAudio[start + i] += aAmplitude * std::exp(-static_cast<double>(i) / decay) * uniform(aRng);
+	}
+}
+
+
+
+
+
+/** Generates the 16-bit mono audio of a single track. */
+static std::vector<Int16> generateTrack(
+	ETrackKind aKind,
+	const Genre & aGenre,
+	double aLength,
+	int aSampleRate,
+	unsigned aSeed
+)
+{
+	std::mt19937 rng(aSeed);
+	std::vector<double> audio(static_cast<size_t>(aLength * aSampleRate));
+	switch (aKind)
+	{
+		case tkSilence:
+		{
+			break;
+		}
+		case tkNoise:
+		{
+			for (auto & a: audio)
+			{
+				a = 0.3 * uniform(rng);
+			}
+			break;
+		}
+		case tkClick:
+		case tkSwing:
+		case tkDrift:
+		case tkNoisy:
+		{
+			int beat = 0;
+			for (double t = 0; t < aLength; ++beat)
+			{
+				auto mpm = (aKind == tkDrift) ? aGenre.mMpm * (0.98 + 0.04 * t / aLength) : aGenre.mMpm;
+				auto beatLength = 60 / (mpm * aGenre.mBeatsPerMeasure);
+				addClick(audio, t, (beat % aGenre.mBeatsPerMeasure == 0) ? 0.9 : 0.5, aSampleRate, rng);
+				if (aKind == tkSwing)
+				{
+					addClick(audio, t + beatLength * 2 / 3, 0.3, aSampleRate, rng);
+				}
+				t += beatLength;
+			}
+			if (aKind == tkNoisy)
+			{
+				for (auto & a: audio)
+				{
+					a += 0.15 * uniform(rng);
+				}
+			}
+			break;
+		}
+	}
+
+	std::vector<Int16> res;
+	res.reserve(audio.size());
+	for (auto a: audio)
+	{
+		res.push_back(static_cast<Int16>(std::max(-32768.0, std::min(32767.0, a * 32767))));
+	}
+	return res;
+}
+
+
+
+
+
+/** Checks the detected tempo of the track, updates the stats and outputs a message on a wrong detection. */
+static void checkDetectedTempo(
+	const char * aDetectorName,
+	ETrackKind aKind,
+	const Genre & aGenre,
+	double aLength,
+	double aDetectedTempo,
+	Stats & aStats
+)
+{
+	switch (aKind)
+	{
+		case tkNoise:
+		{
+			// Any tempo is acceptable, the detection just needs to finish
+			return;
+		}
+		case tkSilence:
+		{
+			if (aDetectedTempo > 0)
+			{
+				std::cerr << aDetectorName << ": detected tempo " << aDetectedTempo << " in silence ("
+					<< aGenre.mName << ", " << aLength << " sec)" << std::endl;
+				g_HasFailed = true;
+			}
+			return;
+		}
+		case tkClick:
+		case tkSwing:
+		case tkDrift:
+		case tkNoisy:
+		{
+			aStats.mNumTempoTracks += 1;
+			if (std::abs(aDetectedTempo - aGenre.mMpm) <= MAX_TEMPO_DIFF)
+			{
+				aStats.mNumCorrect += 1;
+			}
+			else
+			{
+				std::cerr << aDetectorName << ": " << trackKindName(aKind) << " " << aGenre.mName << ", "
+					<< aLength << " sec: expected " << aGenre.mMpm << ", detected " << aDetectedTempo << std::endl;
+			}
+			return;
+		}
+	}
+}
+
+
+
+
+
+/** Outputs the stats and fails the test if they are below the specified thresholds. */
+static void checkStats(const char * aDetectorName, const Stats & aStats, double aMinAccuracy, double aMinSpeed)
+{
+	auto accuracy = static_cast<double>(aStats.mNumCorrect) / aStats.mNumTempoTracks;
+	auto speed = aStats.mAudioLength / aStats.mProcessingTime;
+	std::cerr << aDetectorName << ": " << aStats.mNumCorrect << " / " << aStats.mNumTempoTracks
+		<< " correct (accuracy " << accuracy << ", min " << aMinAccuracy << "), "
+		<< speed << " sec of audio per sec (min " << aMinSpeed << ")" << std::endl;
+	if (accuracy < aMinAccuracy)
+	{
+		std::cerr << aDetectorName << ": accuracy regressed" << std::endl;
+		g_HasFailed = true;
+	}
+	if (speed < aMinSpeed)
+	{
+		std::cerr << aDetectorName << ": throughput regressed" << std::endl;
+		g_HasFailed = true;
+	}
+}
+
+
+
+
+
+/** Runs all the generated tracks directly through TempoDetector, with the options that SongTempoDetector uses. */
+static void testTempoDetector()
+{
+	Stats stats;
+	unsigned seed = 0;
+	for (auto length: TRACK_LENGTHS)
+	{
+		for (auto kind: TRACK_KINDS)
+		{
+			for (const auto & genre: GENRES)
+			{
+				TempoDetector::Options opt;
+				std::tie(opt.mMinTempo, opt.mMaxTempo) = Song::detectionTempoRangeForGenre(genre.mName);
+				auto audio = generateTrack(kind, genre, length, opt.mSampleRate, ++seed);
+				std::vector<TempoDetector::Options> opts;
+				for (size_t ws: {11, 13, 15, 17, 19})
+				{
+					opt.mWindowSize = ws;
+					opts.push_back(opt);
+				}
+
+				auto startTime = std::chrono::steady_clock::now();
+				auto results = TempoDetector::scan(audio.data(), audio.size(), opts);
+				auto tempo = TempoDetector::aggregateResults(results).first;
+				stats.mProcessingTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+				stats.mAudioLength += length;
+				checkDetectedTempo("TempoDetector", kind, genre, length, tempo, stats);
+			}
+		}
+	}
+	checkStats("TempoDetector", stats, MIN_DETECTOR_ACCURACY, MIN_DETECTOR_SPEED);
+}
+
+
+
+
+
+/** Writes the 16-bit mono audio into a WAV file. Returns true on success. */
+static bool writeWavFile(const QString & aFileName, const std::vector<Int16> & aAudio, int aSampleRate)
+{
+	QFile f(aFileName);
+	if (!f.open(QIODevice::WriteOnly))
+	{
+		return false;
+	}
+	auto dataSize = static_cast<quint32>(aAudio.size() * sizeof(Int16));
+	QDataStream ds(&f);
+	ds.setByteOrder(QDataStream::LittleEndian);
+	ds.writeRawData("RIFF", 4);
+	ds << static_cast<quint32>(36 + dataSize);
+	ds.writeRawData("WAVEfmt ", 8);
+	ds << static_cast<quint32>(16);                 // fmt chunk size
+	ds << static_cast<quint16>(1);                  // PCM
+	ds << static_cast<quint16>(1);                  // Mono
+	ds << static_cast<quint32>(aSampleRate);
+	ds << static_cast<quint32>(aSampleRate * 2);    // Bytes per second
+	ds << static_cast<quint16>(2);                  // Bytes per frame
+	ds << static_cast<quint16>(16);                 // Bits per sample
+	ds.writeRawData("data", 4);
+	ds << dataSize;
+	for (auto sample: aAudio)
+	{
+		ds << static_cast<qint16>(sample);
+	}
+	return (ds.status() == QDataStream::Ok);
+}
+
+
+
+
+
+/** Runs the generated tracks, written into WAV files, through SongTempoDetector, both on the whole song
+and using the excerpt detection. */
+static void testSongTempoDetector()
+{
+	QTemporaryDir dir;
+	if (!dir.isValid())
+	{
+		std::cerr << "Cannot create a temporary folder for the generated files" << std::endl;
+		g_HasFailed = true;
+		return;
+	}
+	SongTempoDetector detector;
+	for (auto shouldUseExcerpt: {false, true})
+	{
+		auto detectorName = shouldUseExcerpt ? "SongTempoDetector (excerpt)" : "SongTempoDetector";
+		Stats stats;
+		unsigned seed = 1000;
+		for (auto kind: TRACK_KINDS)
+		{
+			for (const auto & genre: GENRES)
+			{
+				auto fileName = dir.filePath(QString("%1-%2.wav").arg(trackKindName(kind)).arg(genre.mName));
+				if (!writeWavFile(fileName, generateTrack(kind, genre, SONG_TRACK_LENGTH, FILE_SAMPLE_RATE, ++seed), FILE_SAMPLE_RATE))
+				{
+					std::cerr << "Cannot write the generated file " << fileName.toStdString() << std::endl;
+					g_HasFailed = true;
+					return;
+				}
+				auto songSD = std::make_shared<Song::SharedData>(QByteArray(), SONG_TRACK_LENGTH);
+				songSD->mTagManual.mGenre = QString(genre.mName);
+				auto song = std::make_shared<Song>(fileName, songSD);
+
+				auto startTime = std::chrono::steady_clock::now();
+				double tempo = -1;
+				if (detector.detect(songSD, shouldUseExcerpt))
+				{
+					tempo = song->detectedTempo().valueOr(-1);
+				}
+				stats.mProcessingTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+				stats.mAudioLength += SONG_TRACK_LENGTH;
+				checkDetectedTempo(detectorName, kind, genre, SONG_TRACK_LENGTH, tempo, stats);
+				QFile::remove(fileName);
+			}
+		}
+		checkStats(detectorName, stats, MIN_SONG_DETECTOR_ACCURACY, MIN_SONG_DETECTOR_SPEED);
+	}
+}
+
+
+
+
+
+int main()
+{
+	testTempoDetector();
+	testSongTempoDetector();
+
+	if (!g_HasFailed)
+	{
+		std::cerr << "All tests passed" << std::endl;
+	}
+	return g_HasFailed ? 1 : 0;
+}